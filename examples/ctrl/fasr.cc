@@ -47,6 +47,7 @@ private:
   double charger_heading;
   nav_mode_t mode;
   bool at_dest;
+  unsigned int seed; // our own random sequence, so we can run in parallel
 
   // unsigned int charger_detection_accum;
 
@@ -60,7 +61,7 @@ public:
         source(source), sink(sink), avoidcount(0),
         // randcount(0),
         work_get(0), work_put(0), charger_ahoy(false), charger_bearing(0), charger_range(0),
-        charger_heading(0), mode(MODE_WORK), at_dest(false)
+        charger_heading(0), mode(MODE_WORK), at_dest(false), seed(pos->GetId())
   // charger_detection_accum(0)
   {
     // need at least these models to get any work done
@@ -76,11 +77,13 @@ public:
     pos->Subscribe();
 
     // LaserUpdate() controls the robot, by reading from laser and
-    // writing to position
-    laser->AddCallback(Model::CB_UPDATE, (model_callback_t)LaserUpdate, this);
+    // writing to position. It only touches this robot, so it is
+    // thread-safe, as is FiducialUpdate(). PositionUpdate() is not, as
+    // it moves flags between robots.
+    laser->AddCallback(Model::CB_UPDATE, (model_callback_t)LaserUpdate, this, true);
     laser->Subscribe();
 
-    fiducial->AddCallback(Model::CB_UPDATE, (model_callback_t)FiducialUpdate, this);
+    fiducial->AddCallback(Model::CB_UPDATE, (model_callback_t)FiducialUpdate, this, true);
     fiducial->Subscribe();
 
     // gripper->AddUpdateCallback( (model_callback_t)GripperUpdate, this );
@@ -225,7 +228,7 @@ public:
       if (avoidcount < 1) {
         if (verbose)
           puts("Avoid START");
-        avoidcount = random() % avoidduration + avoidduration;
+        avoidcount = rand_r(&seed) % avoidduration + avoidduration;
 
         if (minleft < minright) {
           pos->SetTurnSpeed(-avoidturn);
@@ -13,6 +13,7 @@ typedef struct {
   ModelPosition *pos;
   ModelRanger *laser;
   int avoidcount, randcount;
+  unsigned int seed; // our own random sequence, so we can run in parallel
 } robot_t;
 
 int LaserUpdate(Model *mod, robot_t *robot);
@@ -33,6 +34,7 @@ extern "C" int Init(Model *mod, CtrlArgs *)
 
   robot->avoidcount = 0;
   robot->randcount = 0;
+  robot->seed = mod->GetId();
 
   robot->pos = dynamic_cast<ModelPosition *>(mod);
   if (!robot->pos) {
@@ -73,7 +75,8 @@ extern "C" int Init(Model *mod, CtrlArgs *)
   }
   
   robot->laser = laser;
-  robot->laser->AddCallback(Model::CB_UPDATE, model_callback_t(LaserUpdate), robot);
+  // LaserUpdate() only touches this robot, so it is thread-safe
+  robot->laser->AddCallback(Model::CB_UPDATE, model_callback_t(LaserUpdate), robot, true);
   robot->laser->Subscribe(); // starts the ranger updates
 
   return 0; // ok
@@ -136,7 +139,7 @@ int LaserUpdate(Model *, robot_t *robot)
     if (robot->avoidcount < 1) {
       if (verbose)
         puts("Avoid START");
-      robot->avoidcount = random() % avoidduration + avoidduration;
+      robot->avoidcount = rand_r(&robot->seed) % avoidduration + avoidduration;
 
       if (minleft < minright) {
         robot->pos->SetTurnSpeed(-avoidturn);
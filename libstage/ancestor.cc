@@ -8,7 +8,9 @@ Ancestor::Ancestor() : child_type_counts(), children(), debug(false), props(), t
 
 Ancestor::~Ancestor()
 {
-  FOR_EACH (it, children)
+  // each child erases itself from children as it is deleted
+  const std::vector<Model *> doomed(children);
+  FOR_EACH (it, doomed)
     delete (*it);
 }
 
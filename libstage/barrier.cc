@@ -0,0 +1,195 @@
+/*
+  barrier.cc
+  reusable thread barrier used to synchronize the world's worker threads.
+*/
+
+#include <limits.h>
+#include <sched.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "barrier.hh"
+using namespace Stg;
+
+// bounds of the adaptive spin budget, in iterations of the spin
+// loop. Each iteration is a few tens of nanoseconds.
+static const int SPIN_MIN(16);
+static const int SPIN_MAX(1 << 16);
+
+// number of times to yield the CPU before sleeping, if there are
+// more threads than cores
+static const int YIELD_MAX(4);
+
+static inline void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+Barrier::Barrier(unsigned int parties)
+    : parties(parties), next_parties(parties), arrived(0), sense(0), sleepers(0), spin_limit(SPIN_MAX / 16),
+      spin_forever(false), helper(NULL), helper_arg(NULL), cpus(std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)))
+{
+#ifndef __linux__
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+#endif
+}
+
+Barrier::~Barrier()
+{
+#ifndef __linux__
+  pthread_mutex_destroy(&mutex);
+  pthread_cond_destroy(&cond);
+#endif
+}
+
+void Barrier::SetParties(unsigned int p)
+{
+  assert(__atomic_load_n(&arrived, __ATOMIC_ACQUIRE) == 0);
+  parties = p;
+  next_parties = p;
+}
+
+void Barrier::SetNextParties(unsigned int p)
+{
+  __atomic_store_n(&next_parties, p, __ATOMIC_RELEASE);
+}
+
+bool Barrier::Wait()
+{
+  // the sense can't flip before we arrive, since we are one of the
+  // parties it waits for, so reading it first tells us what to wait for
+  const int target(!__atomic_load_n(&sense, __ATOMIC_ACQUIRE));
+
+  const unsigned int expected(__atomic_load_n(&parties, __ATOMIC_ACQUIRE));
+
+  if ((unsigned int)__atomic_add_fetch(&arrived, 1, __ATOMIC_ACQ_REL) == expected) {
+    // last to arrive: reset for the next phase and release everyone
+    __atomic_store_n(&arrived, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&parties, __atomic_load_n(&next_parties, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELEASE);
+    __atomic_store_n(&sense, target, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST) > 0)
+      WakeAll();
+
+    return true;
+  }
+
+  // with more threads than cores, the thread we are waiting for may
+  // need our core: spinning would only delay it, so yield instead
+  const bool oversubscribed(expected > cpus);
+
+  // spinning forever only pays with a core per thread; otherwise the
+  // spinners take turns at the core with the thread they wait for
+  if (spin_forever && !oversubscribed) {
+    while (!Spin(target, SPIN_MAX))
+      ;
+    return false;
+  }
+
+  if (oversubscribed) {
+    for (int i(0); i < YIELD_MAX; ++i) {
+      if (!Help())
+        sched_yield();
+      if (__atomic_load_n(&sense, __ATOMIC_ACQUIRE) == target)
+        return false;
+    }
+  } else {
+    const int limit(__atomic_load_n(&spin_limit, __ATOMIC_RELAXED));
+
+    if (Spin(target, limit)) {
+      // waits are short: spin a little longer next time
+      if (limit < SPIN_MAX)
+        __atomic_store_n(&spin_limit, limit * 2, __ATOMIC_RELAXED);
+      return false;
+    }
+
+    // waits are long: don't waste so much time spinning next time
+    if (limit > SPIN_MIN)
+      __atomic_store_n(&spin_limit, limit / 2, __ATOMIC_RELAXED);
+  }
+
+  Sleep(target);
+  return false;
+}
+
+bool Barrier::Spin(int target, int limit)
+{
+  for (int i(0); i < limit; ++i) {
+    if (__atomic_load_n(&sense, __ATOMIC_ACQUIRE) == target)
+      return true;
+    if (!Help())
+      cpu_relax();
+  }
+  return (__atomic_load_n(&sense, __ATOMIC_ACQUIRE) == target);
+}
+
+#ifdef __linux__
+
+void Barrier::Sleep(int target)
+{
+  // announce ourselves before the final check so the releasing
+  // thread can't miss us (both sides use seq_cst)
+  __atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+
+  // FUTEX_WAIT returns immediately if the sense already changed
+  while (__atomic_load_n(&sense, __ATOMIC_SEQ_CST) != target)
+    if (!Help())
+      syscall(SYS_futex, &sense, FUTEX_WAIT_PRIVATE, !target, NULL, NULL, 0);
+
+  __atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+void Barrier::WakeAll()
+{
+  syscall(SYS_futex, &sense, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+void Barrier::Wake()
+{
+  // a sleeper that is about to wait again may miss this, but then the
+  // work is done without it
+  if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST) > 0)
+    WakeAll();
+}
+
+#else // no futex: fall back to a condition variable
+
+void Barrier::Sleep(int target)
+{
+  pthread_mutex_lock(&mutex);
+  __atomic_add_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&sense, __ATOMIC_SEQ_CST) != target) {
+    pthread_mutex_unlock(&mutex);
+    const bool helped(Help());
+    pthread_mutex_lock(&mutex);
+    if (!helped && __atomic_load_n(&sense, __ATOMIC_SEQ_CST) != target)
+      pthread_cond_wait(&cond, &mutex);
+  }
+  __atomic_sub_fetch(&sleepers, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&mutex);
+}
+
+void Barrier::WakeAll()
+{
+  // taking the lock orders the broadcast after the sleeper's check
+  pthread_mutex_lock(&mutex);
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+}
+
+void Barrier::Wake()
+{
+  if (__atomic_load_n(&sleepers, __ATOMIC_SEQ_CST) > 0)
+    WakeAll();
+}
+
+#endif
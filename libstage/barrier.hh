@@ -0,0 +1,99 @@
+#pragma once
+/*
+  barrier.hh
+  reusable thread barrier used to synchronize the world's worker threads.
+*/
+
+#include "stage.hh"
+
+namespace Stg {
+
+/** A reusable sense-reversing barrier. The main thread and the
+    worker threads all call Wait() twice per World::Update(): once to
+    start a tick and once to finish it, plus once more after calling
+    thread-safe update callbacks, and twice more around energy
+    accounting, when there are enough models to need them.
+
+    Arriving threads spin for a while before sleeping, since at short
+    sim intervals the wait is usually over in a few microseconds and
+    a futex round trip would cost more than the work being
+    synchronized. The spin budget adapts: it grows when waits end
+    while spinning and shrinks when they don't. On Linux sleeping
+    threads wait on a futex, elsewhere on a condition variable.
+
+    Waiting threads can be given other work to do meanwhile: they
+    call the helper function, if one is set, as they spin and each
+    time they wake.
+*/
+class Barrier {
+public:
+  explicit Barrier(unsigned int parties);
+  ~Barrier();
+
+  /** Block until all parties have called Wait(). Returns true in
+      exactly one thread per phase: the last to arrive. */
+  bool Wait();
+
+  /** Change the number of threads that must arrive before the
+      barrier opens. Must not be called while any thread is waiting. */
+  void SetParties(unsigned int parties);
+  unsigned int GetParties() const { return parties; }
+
+  /** Change the number of threads that must arrive, starting from
+      the phase after the one in progress. Threads already waiting
+      are counted against the old number, so this may be called at
+      any time by a thread that has not yet arrived in this phase. */
+  void SetNextParties(unsigned int parties);
+
+  /** If true, waiting threads never sleep, as long as there is a
+      core for each of them. This minimizes wakeup latency when
+      running as fast as possible, at the cost of burning a core per
+      thread while idle. */
+  void SetSpinForever(bool spin) { spin_forever = spin; }
+  bool GetSpinForever() const { return spin_forever; }
+
+  /** Set the function that waiting threads call with arg to do
+      other work. It returns true if it found any to do. */
+  void SetHelper(bool (*func)(void *), void *arg)
+  {
+    helper = func;
+    helper_arg = arg;
+  }
+
+  /** Wake any sleeping threads, without opening the barrier, so that
+      they call the helper. */
+  void Wake();
+
+private:
+  unsigned int parties; ///< number of threads that meet at this barrier
+  unsigned int next_parties; ///< parties from the next phase on
+  int arrived; ///< number of threads waiting in the current phase
+  int sense; ///< flips each time the barrier opens. Also the futex word
+  int sleepers; ///< number of threads blocked in the kernel
+  int spin_limit; ///< adaptive number of spins before sleeping
+  bool spin_forever;
+  bool (*helper)(void *); ///< called by waiting threads, if not NULL
+  void *helper_arg;
+  const unsigned int cpus; ///< online CPU cores, spinning is pointless with more parties than this
+
+  /** Returns true if the helper did some work. */
+  bool Help() { return helper && (*helper)(helper_arg); }
+
+  /** spin until the sense changes or the spin budget runs out.
+      Returns true if the barrier opened while spinning. */
+  bool Spin(int target, int limit);
+
+  void Sleep(int target);
+  void WakeAll();
+
+#ifndef __linux__
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+#endif
+
+  // not copyable
+  Barrier(const Barrier &);
+  Barrier &operator=(const Barrier &);
+};
+
+} // namespace Stg
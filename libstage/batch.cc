@@ -0,0 +1,784 @@
+/**
+  \defgroup stagebatch stage-batch: running many simulations at once
+
+  USAGE:  stage-batch [options] <worldfile>
+
+  Runs the world once for each seed and each combination of
+  overridden world properties, without a GUI and as fast as possible,
+  until the world's quit_time, and writes a line of results for each
+  run. The runs are shared out over the cores. Each run is a process
+  forked from stage-batch after it has started up and read the
+  worldfile, so runs can't disturb each other and a crash only loses
+  one run.
+
+  With --branch, the world is instead loaded and run up to the given
+  simulated time once, and each run is a process forked from there,
+  sharing the loaded world copy-on-write and carrying on with its own
+  seed until quit_time. This saves loading and warming up the world
+  for every run. The controllers are started before the branches part,
+  so they all get the same arguments; they can tell the branches apart
+  by World::GetSeed(). Defined properties apply to every branch, so
+  each may have only one value.
+
+  Available [options] are:
+
+    --seeds "list" : run with each of these seeds, eg. "1-8,20". By
+                     default, runs with the worldfile's seed
+
+    -s "list"      : equivalent to --seeds "list"
+
+    --define "name=v1,v2..." : set the world property name to each
+                     value in turn. May be given several times, to run
+                     every combination of values
+
+    -D "name=v1,v2..." : equivalent to --define
+
+    --jobs n       : use no more than n cores. Defaults to all of them
+
+    -j n           : equivalent to --jobs n
+
+    --branch sec   : run the world for sec simulated seconds, then
+                     fork a run from there for each seed
+
+    -b sec         : equivalent to --branch sec
+
+    --threads n    : worker threads for each run. Defaults to 1
+
+    -t n           : equivalent to --threads n
+
+    --output file  : write the results to file instead of standard output
+
+    -o file        : equivalent to --output file
+
+    --json         : write the results as JSON instead of CSV
+
+    --verbose      : show the output of each run
+
+    -v             : equivalent to --verbose
+
+    --args \"str\"   : define an argument string to be passed to all controllers
+
+    -a \"str\"       : equivalent to --args "str"
+
+    --help         : print this message
+
+    -h             : equivalent to --help
+
+    -?             : equivalent to --help
+
+  The results of each run are its seed and defined properties, the
+  number of updates, the simulated and wall clock seconds the updates
+  took, the wall clock seconds spent loading the world, the simulated
+  seconds per wall clock second, how many times models stalled, the
+  number of model updates spent stalled, the energy stored in and the
+  capacity of all the power packs at the end, the energy they
+  dissipated, and the values controllers recorded with
+  World::SetMetric(). With --branch, the updates, simulated seconds
+  and stalls include those before the branch, and the seconds spent
+  loading are those spent loading the world and running it up to the
+  branch, which the runs share.
+
+  If the world sets trajectory_log, each run records its trajectories
+  to a file of its own, named with "-run" and the run's number
+  inserted before the extension. With --branch only the world run up
+  to the branch records them.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "config.h"
+#include "stage.hh"
+#include "worldfile.hh"
+using namespace Stg;
+
+const char *USAGE =
+    "USAGE:  stage-batch [options] <worldfile>\n"
+    "Available [options] are:\n"
+    "  --seeds \"list\" : run with each of these seeds, eg. \"1-8,20\"\n"
+    "  -s \"list\"      : equivalent to --seeds \"list\"\n"
+    "  --define \"name=v1,v2...\" : set the world property name to each value in turn\n"
+    "  -D \"name=v1,v2...\" : equivalent to --define\n"
+    "  --jobs n       : use no more than n cores\n"
+    "  -j n           : equivalent to --jobs n\n"
+    "  --branch sec   : run the world for sec simulated seconds, then fork a run from there for each seed\n"
+    "  -b sec         : equivalent to --branch sec\n"
+    "  --threads n    : worker threads for each run\n"
+    "  -t n           : equivalent to --threads n\n"
+    "  --output file  : write the results to file instead of standard output\n"
+    "  -o file        : equivalent to --output file\n"
+    "  --json         : write the results as JSON instead of CSV\n"
+    "  --verbose      : show the output of each run\n"
+    "  -v             : equivalent to --verbose\n"
+    "  --args \"str\"   : define an argument string to be passed to all "
+    "controllers\n"
+    "  -a \"str\"       : equivalent to --args \"str\"\n"
+    "  -h             : equivalent to --help\n"
+    "  -?             : equivalent to --help";
+
+/* options descriptor */
+
+static struct option longopts[] = {
+  { "seeds",  required_argument,   NULL,  's' },
+  { "define",  required_argument,   NULL,  'D' },
+  { "jobs",  required_argument,   NULL,  'j' },
+  { "branch",  required_argument,   NULL,  'b' },
+  { "threads",  required_argument,   NULL,  't' },
+  { "output",  required_argument,   NULL,  'o' },
+  { "json",  no_argument,   NULL,  'J' },
+  { "verbose",  no_argument,   NULL,  'v' },
+  { "help",  optional_argument,   NULL,  'h' },
+  { "args",  required_argument,   NULL,  'a' },
+  { NULL, 0, NULL, 0 }
+};
+
+// the results every run has, in the order they are written
+static const char *COLUMNS[] = { "updates",         "sim_sec",        "wall_sec",
+                                 "load_sec",        "speed",          "stalls",
+                                 "stalled_updates", "energy_stored",  "energy_capacity",
+                                 "energy_dissipated" };
+static const size_t NCOLUMNS(sizeof(COLUMNS) / sizeof(COLUMNS[0]));
+
+// prefix of the values recorded with World::SetMetric() in a run's report
+static const std::string METRIC("metric:");
+
+/** A world property and the values to run it with. */
+class Define {
+public:
+  std::string name;
+  std::vector<std::string> values;
+};
+
+/** One simulation: a seed, if not the worldfile's, a value for
+    each defined property, and the file to record its trajectories
+    to, if any. */
+class Run {
+public:
+  std::string seed;
+  std::vector<std::string> values;
+  std::string trajectory_log;
+  std::map<std::string, double> results;
+  bool ok;
+
+  Run() : seed(), values(), trajectory_log(), results(), ok(false) {}
+};
+
+/** A run in progress, and the report it has sent so far. */
+class Child {
+public:
+  pid_t pid;
+  int fd;
+  size_t run;
+  std::string report;
+};
+
+/** Counts how often the models stall, from a world update callback. */
+class StallCount {
+public:
+  std::vector<Model *> models;
+  std::vector<char> stalled;
+  uint64_t stalls;
+  uint64_t stalled_updates;
+
+  StallCount() : models(), stalled(), stalls(0), stalled_updates(0) {}
+};
+
+static double wall_sec()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static std::vector<std::string> split(const std::string &str, char sep)
+{
+  std::vector<std::string> parts;
+  std::istringstream in(str);
+  std::string part;
+  while (std::getline(in, part, sep))
+    if (!part.empty())
+      parts.push_back(part);
+  return parts;
+}
+
+// expands ranges such as "1-4" in a list of seeds
+static bool parse_seeds(const std::string &str, std::vector<std::string> &seeds)
+{
+  std::vector<std::string> parts(split(str, ','));
+  FOR_EACH (it, parts) {
+    unsigned long lo, hi;
+    char dash;
+    std::istringstream in(*it);
+    if (!(in >> lo))
+      return false;
+    if (in >> dash) {
+      if (dash != '-' || !(in >> hi) || hi < lo)
+        return false;
+    } else
+      hi = lo;
+
+    for (unsigned long s(lo); s <= hi; ++s) {
+      std::ostringstream seed;
+      seed << s;
+      seeds.push_back(seed.str());
+    }
+  }
+  return !seeds.empty();
+}
+
+static bool parse_define(const std::string &str, std::vector<Define> &defines)
+{
+  const size_t eq(str.find('='));
+  if (eq == 0 || eq == std::string::npos)
+    return false;
+
+  Define def;
+  def.name = str.substr(0, eq);
+  def.values = split(str.substr(eq + 1), ',');
+  if (def.values.empty())
+    return false;
+
+  defines.push_back(def);
+  return true;
+}
+
+static int count_stalls(World *, void *arg)
+{
+  StallCount *sc(static_cast<StallCount *>(arg));
+
+  for (size_t i(0); i < sc->models.size(); ++i) {
+    const bool stalled(sc->models[i]->Stalled());
+    if (stalled) {
+      ++sc->stalled_updates;
+      if (!sc->stalled[i])
+        ++sc->stalls;
+    }
+    sc->stalled[i] = stalled;
+  }
+
+  return 0; // keep the callback
+}
+
+static void write_all(int fd, const std::string &str)
+{
+  for (size_t done(0); done < str.size();) {
+    const ssize_t n(write(fd, str.data() + done, str.size() - done));
+    if (n < 0 && errno != EINTR)
+      return;
+    if (n > 0)
+      done += n;
+  }
+}
+
+static void hide_stdout()
+{
+  const int null(open("/dev/null", O_WRONLY));
+  dup2(null, STDOUT_FILENO);
+  close(null);
+}
+
+// loads the world with the run's seed and defined properties. Returns
+// NULL if it fails to load or would never end
+static World *load_world(const std::string &path, const std::string &content,
+                         unsigned int threads, const std::vector<Define> &defines, const Run &run)
+{
+  // properties given again at the end of the worldfile replace the
+  // earlier ones
+  std::ostringstream text;
+  text << content << "\nthreads " << threads << "\n";
+  if (!run.seed.empty())
+    text << "seed " << run.seed << "\n";
+  for (size_t d(0); d < defines.size(); ++d)
+    text << defines[d].name << " " << run.values[d] << "\n";
+  if (!run.trajectory_log.empty())
+    text << "trajectory_log \"" << run.trajectory_log << "\"\n";
+
+  std::istringstream in(text.str());
+  World *world(new World(path));
+  if (!world->Load(in, path))
+    return NULL;
+
+  if (world->GetWorldFile()->ReadFloat(0, "quit_time", 0) <= 0) {
+    PRINT_ERR1("%s has no quit_time, so the run would never end", path.c_str());
+    return NULL;
+  }
+
+  return world;
+}
+
+static void count_stalls_of(World *world, StallCount &sc)
+{
+  const std::set<Model *> models(world->GetAllModels());
+  sc.models.assign(models.begin(), models.end());
+  sc.stalled.assign(sc.models.size(), 0);
+  world->AddUpdateCallback(count_stalls, &sc);
+}
+
+// runs in the forked child: runs the world to the end, then reports
+// the results on fd as lines of name and value separated by a tab
+static void finish_run(World *world, StallCount &sc, double load_sec, int fd)
+{
+  const double start(wall_sec());
+  const usec_t sim_start(world->SimTimeNow());
+  while (!world->Update())
+    ;
+  const double end(wall_sec());
+
+  // power packs are shared by the models below them
+  std::set<PowerPack *> packs;
+  FOR_EACH (it, sc.models)
+    if (PowerPack *pp = (*it)->FindPowerPack())
+      packs.insert(pp);
+
+  joules_t stored(0), capacity(0), dissipated(0);
+  FOR_EACH (it, packs) {
+    stored += (*it)->GetStored();
+    capacity += (*it)->GetCapacity();
+    dissipated += (*it)->GetDissipated();
+  }
+
+  const double sim(world->SimTimeNow() / 1e6);
+
+  std::ostringstream report;
+  report.precision(12);
+  report << "seed\t" << world->GetSeed() << "\n"
+         << "updates\t" << world->GetUpdateCount() << "\n"
+         << "sim_sec\t" << sim << "\n"
+         << "wall_sec\t" << end - start << "\n"
+         << "load_sec\t" << load_sec << "\n"
+         << "speed\t" << (sim - sim_start / 1e6) / std::max(end - start, 1e-9) << "\n"
+         << "stalls\t" << sc.stalls << "\n"
+         << "stalled_updates\t" << sc.stalled_updates << "\n"
+         << "energy_stored\t" << stored << "\n"
+         << "energy_capacity\t" << capacity << "\n"
+         << "energy_dissipated\t" << dissipated << "\n";
+
+  const std::map<std::string, double> metrics(world->GetMetrics());
+  FOR_EACH (it, metrics)
+    report << METRIC << it->first << "\t" << it->second << "\n";
+
+  write_all(fd, report.str());
+
+  // skip tearing the world down: the process is about to go anyway
+  fflush(NULL);
+  _exit(EXIT_SUCCESS);
+}
+
+// runs in the forked child: loads and runs the world
+static void run_child(const std::string &path, const std::string &content, unsigned int threads,
+                      const std::vector<Define> &defines, const Run &run, int fd, bool verbose)
+{
+  if (!verbose)
+    hide_stdout();
+
+  // separate processes would each have seeded this differently
+  srand48(time(NULL) ^ getpid());
+
+  const double load_start(wall_sec());
+
+  World *world(load_world(path, content, threads, defines, run));
+  if (!world)
+    _exit(EXIT_FAILURE);
+
+  StallCount sc;
+  count_stalls_of(world, sc);
+
+  finish_run(world, sc, wall_sec() - load_start, fd);
+}
+
+// runs in the child forked from the warmed-up world: carries on with
+// the run's seed
+static void run_branch(World *world, StallCount &sc, double load_sec, const Run &run, int fd,
+                       bool verbose)
+{
+  if (!verbose)
+    hide_stdout();
+
+  srand48(time(NULL) ^ getpid());
+
+  if (!run.seed.empty())
+    world->SetSeed(strtoul(run.seed.c_str(), NULL, 10));
+
+  finish_run(world, sc, load_sec, fd);
+}
+
+static void parse_report(const std::string &report, Run &run)
+{
+  std::vector<std::string> lines(split(report, '\n'));
+  FOR_EACH (it, lines) {
+    const size_t tab(it->rfind('\t'));
+    if (tab == std::string::npos)
+      continue;
+    const std::string name(it->substr(0, tab));
+    const double value(atof(it->c_str() + tab + 1));
+    if (name == "seed")
+      run.seed = it->substr(tab + 1);
+    else
+      run.results[name] = value;
+  }
+}
+
+static std::string csv_field(const std::string &str)
+{
+  if (str.find_first_of(",\"\n") == std::string::npos)
+    return str;
+
+  std::string quoted("\"");
+  FOR_EACH (it, str) {
+    if (*it == '"')
+      quoted += '"';
+    quoted += *it;
+  }
+  return quoted + "\"";
+}
+
+static std::string json_string(const std::string &str)
+{
+  std::string quoted("\"");
+  FOR_EACH (it, str) {
+    if (*it == '"' || *it == '\\')
+      quoted += '\\';
+    quoted += *it;
+  }
+  return quoted + "\"";
+}
+
+static void write_results(std::ostream &out, const std::vector<Run> &runs,
+                          const std::vector<Define> &defines, bool json)
+{
+  // every run gets a column for every metric any run recorded
+  std::set<std::string> metrics;
+  FOR_EACH (it, runs)
+    FOR_EACH (res, it->results)
+      if (res->first.compare(0, METRIC.size(), METRIC) == 0)
+        metrics.insert(res->first);
+
+  out.precision(12);
+
+  if (json) {
+    out << "[\n";
+    for (size_t r(0); r < runs.size(); ++r) {
+      const Run &run(runs[r]);
+      out << "  { \"run\": " << r << ", \"seed\": " << json_string(run.seed);
+      for (size_t d(0); d < defines.size(); ++d)
+        out << ", " << json_string(defines[d].name) << ": " << json_string(run.values[d]);
+      out << ", \"ok\": " << (run.ok ? "true" : "false");
+
+      for (size_t c(0); c < NCOLUMNS; ++c) {
+        std::map<std::string, double>::const_iterator it(run.results.find(COLUMNS[c]));
+        if (it != run.results.end())
+          out << ", \"" << COLUMNS[c] << "\": " << it->second;
+      }
+      FOR_EACH (m, metrics) {
+        std::map<std::string, double>::const_iterator it(run.results.find(*m));
+        if (it != run.results.end())
+          out << ", " << json_string(m->substr(METRIC.size())) << ": " << it->second;
+      }
+
+      out << " }" << (r + 1 < runs.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+    return;
+  }
+
+  out << "run,seed";
+  FOR_EACH (it, defines)
+    out << "," << csv_field(it->name);
+  out << ",ok";
+  for (size_t c(0); c < NCOLUMNS; ++c)
+    out << "," << COLUMNS[c];
+  FOR_EACH (it, metrics)
+    out << "," << csv_field(it->substr(METRIC.size()));
+  out << "\n";
+
+  for (size_t r(0); r < runs.size(); ++r) {
+    const Run &run(runs[r]);
+    out << r << "," << csv_field(run.seed);
+    FOR_EACH (it, run.values)
+      out << "," << csv_field(*it);
+    out << "," << (run.ok ? 1 : 0);
+
+    for (size_t c(0); c < NCOLUMNS; ++c) {
+      out << ",";
+      std::map<std::string, double>::const_iterator it(run.results.find(COLUMNS[c]));
+      if (it != run.results.end())
+        out << it->second;
+    }
+    FOR_EACH (m, metrics) {
+      out << ",";
+      std::map<std::string, double>::const_iterator it(run.results.find(*m));
+      if (it != run.results.end())
+        out << it->second;
+    }
+    out << "\n";
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  // initialize libstage - call this first
+  Stg::Init(&argc, &argv);
+
+  int ch = 0, optindex = 0;
+  std::vector<std::string> seeds;
+  std::vector<Define> defines;
+  unsigned int jobs(std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)));
+  unsigned int threads(1);
+  std::string output;
+  bool json(false);
+  bool verbose(false);
+  double branch(-1);
+
+  while ((ch = getopt_long(argc, argv, "s:D:j:b:t:o:va:h?", longopts, &optindex)) != -1) {
+    switch (ch) {
+    case 'a': World::ctrlargs = std::string(optarg); break;
+    case 's':
+      if (!parse_seeds(optarg, seeds)) {
+        PRINT_ERR1("bad list of seeds \"%s\"", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'D':
+      if (!parse_define(optarg, defines)) {
+        PRINT_ERR1("bad definition \"%s\", expected name=value[,value...]", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'j': jobs = std::max(1, atoi(optarg)); break;
+    case 'b': branch = std::max(0.0, atof(optarg)); break;
+    case 't': threads = std::max(1, atoi(optarg)); break;
+    case 'o': output = optarg; break;
+    case 'J': json = true; break;
+    case 'v': verbose = true; break;
+    case 'h':
+    case '?':
+    default: puts(USAGE); exit(EXIT_FAILURE);
+    }
+  }
+
+  if (optind != argc - 1) {
+    puts(USAGE);
+    exit(EXIT_FAILURE);
+  }
+
+  // read the worldfile once, for every run to load from memory
+  const std::string path(argv[optind]);
+  std::ifstream file(path.c_str());
+  if (!file) {
+    PRINT_ERR1("failed to open file %s", path.c_str());
+    exit(EXIT_FAILURE);
+  }
+  std::ostringstream content;
+  content << file.rdbuf();
+
+  // a run for every seed with every combination of defined values,
+  // the seeds changing fastest
+  if (seeds.empty())
+    seeds.push_back(std::string());
+
+  if (branch >= 0)
+    FOR_EACH (it, defines)
+      if (it->values.size() > 1) {
+        PRINT_ERR1("%s can only have one value: the branches share the loaded world",
+                   it->name.c_str());
+        exit(EXIT_FAILURE);
+      }
+
+  std::vector<Run> runs;
+  std::vector<size_t> pick(defines.size(), 0);
+  for (bool more(true); more;) {
+    FOR_EACH (it, seeds) {
+      Run run;
+      run.seed = *it;
+      for (size_t d(0); d < defines.size(); ++d)
+        run.values.push_back(defines[d].values[pick[d]]);
+      runs.push_back(run);
+    }
+
+    more = false;
+    for (size_t d(0); d < defines.size() && !more; ++d) {
+      if (++pick[d] < defines[d].values.size())
+        more = true;
+      else
+        pick[d] = 0;
+    }
+  }
+
+  // the runs would all truncate and write the same trajectory log,
+  // so give each a file of its own
+  if (branch < 0) {
+    Worldfile wf;
+    std::istringstream in(content.str());
+    const std::string trajectory_log(wf.Load(in, path) ? wf.ReadString(0, "trajectory_log", "")
+                                                       : std::string());
+    for (size_t r(0); r < runs.size(); ++r) {
+      std::string name(trajectory_log);
+      for (size_t d(0); d < defines.size(); ++d)
+        if (defines[d].name == "trajectory_log") {
+          name = runs[r].values[d];
+          if (name.size() >= 2 && name[0] == '"' && name[name.size() - 1] == '"')
+            name = name.substr(1, name.size() - 2);
+        }
+
+      if (!name.empty()) {
+        std::ostringstream suffix;
+        suffix << "-run" << r;
+        runs[r].trajectory_log = TrajectoryLog::Suffixed(name, suffix.str());
+      }
+    }
+  }
+
+  // each run has its own worker threads
+  const size_t slots(std::max(1U, jobs / threads));
+
+  fprintf(stderr, "[%s: %u runs, %u at a time]\n", PROJECT, (unsigned int)runs.size(),
+          (unsigned int)std::min(slots, runs.size()));
+
+  // load the world and run it up to the branch, showing its output
+  // only if asked to
+  World *world(NULL);
+  StallCount sc;
+  double load_sec(0);
+
+  if (branch >= 0) {
+    fflush(stdout);
+    const int saved_stdout(dup(STDOUT_FILENO));
+    if (!verbose)
+      hide_stdout();
+
+    const double load_start(wall_sec());
+
+    Run shared;
+    shared.values = runs[0].values;
+    world = load_world(path, content.str(), threads, defines, shared);
+    if (!world)
+      exit(EXIT_FAILURE);
+
+    count_stalls_of(world, sc);
+
+    bool ended(false);
+    while (world->SimTimeNow() < branch * 1e6 && !ended)
+      ended = world->Update();
+
+    load_sec = wall_sec() - load_start;
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    if (ended) {
+      PRINT_ERR1("%s ends before the branch", path.c_str());
+      exit(EXIT_FAILURE);
+    }
+
+    fprintf(stderr, "[%s: branching at %.1f simulated sec, after %.1f sec]\n", PROJECT,
+            world->SimTimeNow() / 1e6, load_sec);
+  }
+
+  std::vector<Child> children;
+  size_t next(0), done(0);
+
+  while (next < runs.size() || !children.empty()) {
+    while (next < runs.size() && children.size() < slots) {
+      int fds[2];
+      if (pipe(fds) != 0) {
+        PRINT_ERR1("pipe failed: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+
+      // don't let the child write out what is buffered here
+      fflush(NULL);
+
+      const pid_t pid(world ? world->Fork() : fork());
+      if (pid < 0) {
+        PRINT_ERR1("fork failed: %s", strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+      if (pid == 0) {
+        close(fds[0]);
+        for (size_t c(0); c < children.size(); ++c)
+          close(children[c].fd);
+        if (world)
+          run_branch(world, sc, load_sec, runs[next], fds[1], verbose);
+        else
+          run_child(path, content.str(), threads, defines, runs[next], fds[1], verbose);
+      }
+
+      close(fds[1]);
+      Child child;
+      child.pid = pid;
+      child.fd = fds[0];
+      child.run = next++;
+      children.push_back(child);
+    }
+
+    // read the reports as they arrive, so no child blocks on a full pipe
+    std::vector<struct pollfd> pfds(children.size());
+    for (size_t c(0); c < children.size(); ++c) {
+      pfds[c].fd = children[c].fd;
+      pfds[c].events = POLLIN;
+      pfds[c].revents = 0;
+    }
+
+    if (poll(&pfds[0], pfds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      PRINT_ERR1("poll failed: %s", strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    for (size_t c(children.size()); c-- > 0;) {
+      if (!pfds[c].revents)
+        continue;
+
+      Child &child(children[c]);
+      char buf[4096];
+      const ssize_t n(read(child.fd, buf, sizeof(buf)));
+      if (n > 0) {
+        child.report.append(buf, n);
+        continue;
+      }
+      if (n < 0 && errno == EINTR)
+        continue;
+
+      // the child has finished
+      close(child.fd);
+      int status(0);
+      waitpid(child.pid, &status, 0);
+
+      Run &run(runs[child.run]);
+      run.ok = WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS;
+      parse_report(child.report, run);
+
+      fprintf(stderr, "[run %u of %u %s]\n", (unsigned int)++done, (unsigned int)runs.size(),
+              run.ok ? "done" : "FAILED");
+
+      children.erase(children.begin() + c);
+    }
+  }
+
+  if (output.empty())
+    write_results(std::cout, runs, defines, json);
+  else {
+    std::ofstream out(output.c_str());
+    if (!out) {
+      PRINT_ERR1("failed to write %s", output.c_str());
+      exit(EXIT_FAILURE);
+    }
+    write_results(out, runs, defines, json);
+  }
+
+  // finishes the trajectory log of the world run up to the branch
+  delete world;
+
+  return EXIT_SUCCESS;
+}
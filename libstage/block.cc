@@ -167,14 +167,56 @@ Model *Block::TestCollision()
   return NULL; // no hit
 }
 
+Model *Block::FindContacts(std::vector<Contact> &contacts)
+{
+  Model *hitmod(NULL);
+  Model &mod(group->mod);
+
+  if (mod.vis.obstacle_return && global_z.min < 0)
+    hitmod = mod.world->GetGround();
+
+  const unsigned int layer(mod.world->updates % 2);
+  const double cell(1.0 / mod.world->Resolution());
+
+  FOR_EACH (cell_it, rendered_cells[layer]) {
+    const std::vector<Block *> &blocks((*cell_it)->GetBlocks(layer));
+    if (blocks.size() < 2) // only us
+      continue;
+
+    const point_int_t pos((*cell_it)->region->superregion->CellPosition(*cell_it));
+    const point_t pt((pos.x + 0.5) * cell, (pos.y + 0.5) * cell);
+
+    FOR_EACH (block_it, blocks) {
+      Block *testblock(*block_it);
+      Model *testmod(&testblock->group->mod);
+
+      if (testmod == &mod || mod.IsRelated(testmod))
+        continue;
+
+      // another of our blocks may have found it in this cell already
+      if (contacts.empty() || contacts.back().mod != testmod || !(contacts.back().point == pt))
+        contacts.push_back(Contact(testmod, pt));
+
+      // the same test as TestCollision()
+      if (hitmod == NULL && mod.vis.obstacle_return && testmod->vis.obstacle_return
+          && testblock->global_z.min <= global_z.max && testblock->global_z.max >= global_z.min)
+        hitmod = testmod;
+    }
+  }
+
+  return hitmod;
+}
+
 void Block::Map(unsigned int layer)
 {
+  // the model's global pose, as recorded by Model::Map()
+  Pose gpose(group->mod.map_pose[layer]);
+
   // calculate the global pixel coords of the block vertices
   // and render this block's polygon into the world
-  group->mod.world->MapPoly(group->mod.LocalToPixels(pts), this, layer);
+  group->mod.world->MapPoly(group->mod.LocalToPixels(pts, gpose), this, layer);
 
   // update the block's absolute z bounds at this rendering
-  Pose gpose(group->mod.GetGlobalPose());
   gpose.z += group->mod.geom.pose.z;
   global_z.min = local_z.min + gpose.z;
   global_z.max = local_z.max + gpose.z;
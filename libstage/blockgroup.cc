@@ -6,10 +6,19 @@
 #include <libgen.h> // for dirname(3)
 #include <limits.h> // for _POSIX_PATH_MAX
 #include <limits>
+#include <sys/stat.h>
 
 using namespace Stg;
 using namespace std;
 
+// the polygons traced from bitmaps, by file name and modification
+// time. Shared read-only by every model that loads the same bitmap, in
+// this world or any other, so that clones and repeated loads of a
+// world don't trace its images again
+typedef std::pair<std::string, ::time_t> bitmap_key_t;
+static std::map<bitmap_key_t, std::vector<std::vector<point_t> > > bitmap_polys;
+static pthread_mutex_t bitmap_polys_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 BlockGroup::BlockGroup(Model &mod) : blocks(), displaylist(0), mod(mod)
 { /* empty */
 }
@@ -49,6 +58,19 @@ Model *BlockGroup::TestCollision()
   return hitmod; // NULL if no collision
 }
 
+Model *BlockGroup::FindContacts(std::vector<Contact> &contacts)
+{
+  Model *hitmod(NULL);
+
+  FOR_EACH (it, blocks) {
+    Model *mod(it->FindContacts(contacts));
+    if (hitmod == NULL)
+      hitmod = mod;
+  }
+
+  return hitmod;
+}
+
 /** find the 3d bounding box of all the blocks in the group */
 bounds3d_t BlockGroup::BoundingBox() const
 {
@@ -314,13 +336,29 @@ void BlockGroup::LoadBitmap(const std::string &bitmapfile, Worldfile *wf)
 
   Color col(1.0, 0.0, 1.0, 1.0);
 
-  std::vector<std::vector<point_t> > polys;
+  struct stat st;
+  const bitmap_key_t key(full, stat(full.c_str(), &st) == 0 ? st.st_mtime : 0);
 
-  if (polys_from_image_file(full, polys)) {
-    PRINT_ERR1("failed to load polys from image file \"%s\"", full.c_str());
-    return;
+  pthread_mutex_lock(&bitmap_polys_mutex);
+
+  std::map<bitmap_key_t, std::vector<std::vector<point_t> > >::iterator found(
+      bitmap_polys.find(key));
+  if (found == bitmap_polys.end()) {
+    std::vector<std::vector<point_t> > traced;
+    if (polys_from_image_file(full, traced)) {
+      pthread_mutex_unlock(&bitmap_polys_mutex);
+      PRINT_ERR1("failed to load polys from image file \"%s\"", full.c_str());
+      return;
+    }
+
+    found = bitmap_polys.insert(std::make_pair(key, std::vector<std::vector<point_t> >())).first;
+    found->second.swap(traced);
   }
 
+  // entries are never changed or removed, so they can be read unlocked
+  pthread_mutex_unlock(&bitmap_polys_mutex);
+
+  const std::vector<std::vector<point_t> > &polys(found->second);
   FOR_EACH (it, polys)
     AppendBlock(Block(this, *it, Bounds(0, 1)));
 
@@ -29,6 +29,10 @@ Color::Color(const std::string &name) : r(1), g(0), b(0), a(1)
   static FILE *file = NULL;
   static std::map<std::string, Color> table;
 
+  // worlds updated in parallel may look up colors at the same time
+  static pthread_mutex_t table_mutex = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_lock(&table_mutex);
+
   if (file == NULL) {
     std::string rgbFile = FileManager::findFile("rgb.txt");
     file = fopen(rgbFile.c_str(), "r");
@@ -72,13 +76,16 @@ Color::Color(const std::string &name) : r(1), g(0), b(0), a(1)
     fclose(file);
   }
 
-  // look up the colorname in the database
-  Color &found = table[name];
+  // look up the colorname in the database, leaving unknown names red
+  std::map<std::string, Color>::const_iterator found(table.find(name));
+  if (found != table.end()) {
+    this->r = found->second.r;
+    this->g = found->second.g;
+    this->b = found->second.b;
+    this->a = found->second.a;
+  }
 
-  this->r = found.r;
-  this->g = found.g;
-  this->b = found.b;
-  this->a = found.a;
+  pthread_mutex_unlock(&table_mutex);
 }
 
 bool Color::operator==(const Color &other) const
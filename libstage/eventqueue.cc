@@ -0,0 +1,231 @@
+/*
+  eventqueue.cc
+  timing wheel for scheduling model updates and other simulation events.
+*/
+
+#include "stage.hh"
+using namespace Stg;
+
+World::EventQueue::EventQueue()
+    : tick_interval(1e5), current(0), count(0), near_wheel(WHEELSIZE), far_wheel(WHEELSIZE),
+      overflow()
+{
+}
+
+void World::EventQueue::SetTickInterval(usec_t usec)
+{
+  assert(usec > 0);
+
+  // pull everything out of the wheel and put it back with the new
+  // tick size
+  std::vector<Event> all;
+  all.reserve(count);
+
+  for (uint64_t i(0); i < WHEELSIZE; ++i) {
+    all.insert(all.end(), near_wheel[i].begin(), near_wheel[i].end());
+    all.insert(all.end(), far_wheel[i].begin(), far_wheel[i].end());
+    near_wheel[i].clear();
+    far_wheel[i].clear();
+  }
+
+  for (; !overflow.empty(); overflow.pop())
+    all.push_back(overflow.top());
+
+  current = current * tick_interval / usec;
+  tick_interval = usec;
+
+  FOR_EACH (it, all)
+    Insert(*it);
+}
+
+void World::EventQueue::Push(const Event &ev)
+{
+  Insert(ev);
+  ++count;
+}
+
+void World::EventQueue::Insert(const Event &ev)
+{
+  // anything overdue goes in the current slot
+  const uint64_t tick(std::max(Tick(ev.time), current));
+
+  if (tick - current < WHEELSIZE)
+    near_wheel[tick & WHEELMASK].push_back(ev);
+  else if ((tick >> WHEELBITS) - (current >> WHEELBITS) < WHEELSIZE)
+    far_wheel[(tick >> WHEELBITS) & WHEELMASK].push_back(ev);
+  else
+    overflow.push(ev);
+}
+
+void World::EventQueue::Cascade()
+{
+  // all the events in this far slot now fall within the near wheel
+  std::vector<Event> &slot(far_wheel[(current >> WHEELBITS) & WHEELMASK]);
+  FOR_EACH (it, slot)
+    near_wheel[Tick(it->time) & WHEELMASK].push_back(*it);
+  slot.clear();
+
+  // and the overflow may have come within reach of the far wheel
+  while (!overflow.empty()
+         && (Tick(overflow.top().time) >> WHEELBITS) - (current >> WHEELBITS) < WHEELSIZE) {
+    Insert(overflow.top());
+    overflow.pop();
+  }
+}
+
+// order by time only, so that a stable sort keeps events queued at
+// the same time in the order they were queued
+static bool earlier(const World::Event &a, const World::Event &b)
+{
+  return a.time < b.time;
+}
+
+void World::EventQueue::ConsumeSlot(std::vector<Event> &slot, usec_t now)
+{
+  // events in a slot usually share a time, but not always
+  for (size_t i(1); i < slot.size(); ++i)
+    if (slot[i].time < slot[i - 1].time) {
+      std::stable_sort(slot.begin(), slot.end(), earlier);
+      break;
+    }
+
+  // callbacks may queue new events for now, which are appended to
+  // this slot, so don't hold iterators or references into it
+  for (size_t i(0); i < slot.size(); ++i) {
+    Event ev(slot[i]);
+    --count;
+
+    const int cancel((ev.cb)(ev.mod, ev.arg)); // call the event's callback on the model
+
+    if (ev.period && !cancel) {
+      ev.time = now + ev.period;
+      Push(ev);
+    }
+  }
+
+  slot.clear();
+}
+
+void World::EventQueue::Consume(usec_t now)
+{
+  const uint64_t target(now / tick_interval);
+
+  // nothing to do, so jump straight to the target tick
+  if (count == 0) {
+    current = std::max(current, target);
+    return;
+  }
+
+  for (;;) {
+    ConsumeSlot(near_wheel[current & WHEELMASK], now);
+
+    if (current >= target)
+      break;
+
+    if ((++current & WHEELMASK) == 0)
+      Cascade();
+  }
+}
+
+void World::EventQueue::Extract(const std::set<Model *> &mods, std::vector<Event> &out)
+{
+  const size_t before(out.size());
+
+  // keep the remaining events of each slot in order
+  for (uint64_t i(0); i < 2 * WHEELSIZE; ++i) {
+    std::vector<Event> &slot(i < WHEELSIZE ? near_wheel[i] : far_wheel[i - WHEELSIZE]);
+    size_t kept(0);
+    for (size_t j(0); j < slot.size(); ++j) {
+      if (mods.count(slot[j].mod))
+        out.push_back(slot[j]);
+      else
+        slot[kept++] = slot[j];
+    }
+    slot.erase(slot.begin() + kept, slot.end());
+  }
+
+  std::priority_queue<Event> keep;
+  for (; !overflow.empty(); overflow.pop()) {
+    if (mods.count(overflow.top().mod))
+      out.push_back(overflow.top());
+    else
+      keep.push(overflow.top());
+  }
+  overflow.swap(keep);
+
+  count -= out.size() - before;
+}
+
+void World::EventQueue::Save(WorldSnapshot &snap) const
+{
+  snap.Put(tick_interval);
+  snap.Put(current);
+  snap.Put(count);
+
+  // the wheels as they are, so that events in a slot keep their order
+  for (uint64_t i(0); i < 2 * WHEELSIZE; ++i) {
+    const std::vector<Event> &slot(i < WHEELSIZE ? near_wheel[i] : far_wheel[i - WHEELSIZE]);
+    if (!slot.empty()) {
+      snap.Put(i);
+      SaveEvents(snap, slot);
+    }
+  }
+  snap.Put(2 * WHEELSIZE); // end of the slots
+
+  // the overflow comes out in a well-defined order
+  std::vector<Event> over;
+  for (std::priority_queue<Event> copy(overflow); !copy.empty(); copy.pop())
+    over.push_back(copy.top());
+  SaveEvents(snap, over);
+}
+
+void World::EventQueue::Restore(const WorldSnapshot &snap, size_t &pos)
+{
+  snap.Get(pos, tick_interval);
+  snap.Get(pos, current);
+  snap.Get(pos, count);
+
+  for (uint64_t i(0); i < WHEELSIZE; ++i) {
+    near_wheel[i].clear();
+    far_wheel[i].clear();
+  }
+
+  for (;;) {
+    uint64_t i(0);
+    snap.Get(pos, i);
+    if (i >= 2 * WHEELSIZE)
+      break;
+    RestoreEvents(snap, pos, i < WHEELSIZE ? near_wheel[i] : far_wheel[i - WHEELSIZE]);
+  }
+
+  std::vector<Event> over;
+  RestoreEvents(snap, pos, over);
+  overflow = std::priority_queue<Event>(over.begin(), over.end());
+}
+
+void World::EventQueue::SaveEvents(WorldSnapshot &snap, const std::vector<Event> &events)
+{
+  snap.Put(events.size());
+  FOR_EACH (it, events) {
+    snap.Put(it->time);
+    snap.Put(it->mod);
+    snap.Put(it->cb);
+    snap.Put(it->arg);
+    snap.Put(it->period);
+  }
+}
+
+void World::EventQueue::RestoreEvents(const WorldSnapshot &snap, size_t &pos,
+                                      std::vector<Event> &events)
+{
+  size_t n(0);
+  snap.Get(pos, n);
+  events.resize(n);
+  FOR_EACH (it, events) {
+    snap.Get(pos, it->time);
+    snap.Get(pos, it->mod);
+    snap.Get(pos, it->cb);
+    snap.Get(pos, it->arg);
+    snap.Get(pos, it->period);
+  }
+}
@@ -0,0 +1,172 @@
+/*
+  loadbalance.cc
+  assignment of thread-safe models to worker threads' event queues
+  by their measured update cost.
+*/
+
+#include "stage.hh"
+using namespace Stg;
+
+// number of updates over which model update costs are measured
+static const uint64_t COST_WINDOW(10);
+
+// measurements are noisy, so don't move models unless the busiest
+// queue has at least this much more than the mean load
+static const double IMBALANCE_MAX(1.1);
+
+// order models by decreasing load, breaking ties by ID so that the
+// assignment doesn't depend on pointer values
+class heavier {
+  const World *world;
+
+public:
+  explicit heavier(const World *world) : world(world) {}
+  bool operator()(const Model *a, const Model *b) const
+  {
+    const double la(world->ModelLoad(a)), lb(world->ModelLoad(b));
+    return (la == lb ? a->GetId() < b->GetId() : la > lb);
+  }
+};
+
+double World::ModelLoad(const Model *mod) const
+{
+  // models with longer intervals than ours are not updated every time
+  const double rate(std::min(1.0, (double)sim_interval / std::max(mod->interval, (usec_t)1)));
+  return (mod->update_cost > 0 ? mod->update_cost : default_model_load) * rate;
+}
+
+unsigned int World::GetEventQueue(Model *mod)
+{
+  if (worker_threads < 1)
+    return 0;
+
+  // use the least loaded worker queue
+  unsigned int best(1);
+  for (unsigned int q(2); q <= worker_threads; ++q)
+    if (queue_loads[q] < queue_loads[best])
+      best = q;
+
+  queue_loads[best] += ModelLoad(mod);
+  return best;
+}
+
+void World::BalanceLoad()
+{
+  // there is nothing to balance with a single worker
+  if (!load_balance || worker_threads < 2)
+    return;
+
+  const uint64_t phase(updates % load_balance_interval);
+
+  if (measure_costs) {
+    // the first pass comes after a short warm-up
+    if (updates == COST_WINDOW || phase == 0) {
+      measure_costs = false;
+      AssignQueues(false);
+    }
+  } else if (phase == load_balance_interval - COST_WINDOW)
+    measure_costs = true;
+}
+
+void World::Reassign(std::vector<Model *> &mods, std::set<Model *> &moved)
+{
+  // longest processing time first: place the heaviest models first,
+  // each on the queue with the least load so far
+  std::sort(mods.begin(), mods.end(), heavier(this));
+  queue_loads.assign(worker_threads + 1, 0.0);
+
+  FOR_EACH (it, mods) {
+    unsigned int best(1);
+    for (unsigned int q(2); q <= worker_threads; ++q)
+      if (queue_loads[q] < queue_loads[best])
+        best = q;
+
+    queue_loads[best] += ModelLoad(*it);
+
+    if ((*it)->event_queue_num != best) {
+      (*it)->event_queue_num = best;
+      moved.insert(*it);
+    }
+  }
+}
+
+void World::AssignQueues(bool force)
+{
+  std::vector<Model *> mods;
+  std::set<Model *> stranded;
+  double total(0);
+  unsigned int measured(0);
+
+  FOR_EACH (it, models) {
+    Model *mod(*it);
+
+    // fold the measurements from this window into the estimate
+    if (mod->cost_count > 0) {
+      mod->update_cost = (double)mod->cost_sum / mod->cost_count;
+      mod->cost_sum = 0;
+      mod->cost_count = 0;
+    }
+
+    if (mod->event_queue_num > 0 && mod->subs > 0) {
+      mods.push_back(mod);
+
+      if (mod->update_cost > 0) {
+        total += mod->update_cost;
+        ++measured;
+      }
+    } else if (mod->event_queue_num > worker_threads) {
+      // not subscribed, but it may still have an event left on the
+      // queue of a parked thread. It gets a new queue when it starts
+      // up again anyway.
+      mod->event_queue_num = 1;
+      stranded.insert(mod);
+    }
+  }
+
+  // models that start up before the next pass are assumed to be
+  // average
+  if (measured)
+    default_model_load = total / measured;
+
+  // find the load with the current assignment
+  queue_loads.assign(worker_threads + 1, 0.0);
+  FOR_EACH (it, mods)
+    if ((*it)->event_queue_num > worker_threads)
+      force = true; // on the queue of a parked thread
+    else
+      queue_loads[(*it)->event_queue_num] += ModelLoad(*it);
+
+  double sum(0), busiest(0);
+  for (unsigned int q(1); q <= worker_threads; ++q) {
+    sum += queue_loads[q];
+    busiest = std::max(busiest, queue_loads[q]);
+  }
+
+  std::set<Model *> moved(stranded);
+
+  if (force || busiest > IMBALANCE_MAX * sum / worker_threads)
+    Reassign(mods, moved);
+
+  MoveEvents(moved);
+
+  if (show_load) {
+    printf("\n[load usec/update:");
+    for (unsigned int q(1); q <= worker_threads; ++q)
+      printf(" %.1f", queue_loads[q] / 1e3);
+    printf(" (%u moved)]\n", (unsigned int)moved.size());
+  }
+}
+
+void World::MoveEvents(const std::set<Model *> &moved)
+{
+  if (moved.empty())
+    return;
+
+  // parked threads' queues may hold events too
+  std::vector<Event> events;
+  for (unsigned int q(1); q < event_queues.size(); ++q)
+    event_queues[q].Extract(moved, events);
+
+  FOR_EACH (it, events)
+    event_queues[it->mod->event_queue_num].Push(*it);
+}
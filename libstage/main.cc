@@ -13,6 +13,10 @@
 
     -g             : equivalent to --gui
 
+    --parallel     : update several worlds at the same time, without a GUI
+
+    -p             : equivalent to --parallel
+
     --help         : print this message
 
     --args \"str\"   : define an argument string to be passed to all controllers
@@ -36,6 +40,8 @@ const char *USAGE = "USAGE:  stage [options] <worldfile1> [worldfile2 ... worldf
                     "  -c             : equivalent to --clock\n"
                     "  --gui          : run without a GUI\n"
                     "  -g             : equivalent to --gui\n"
+                    "  --parallel     : update several worlds at the same time, without a GUI\n"
+                    "  -p             : equivalent to --parallel\n"
                     "  --help         : print this message\n"
                     "  --args \"str\"   : define an argument string to be passed to all "
                     "controllers\n"
@@ -48,6 +54,7 @@ const char *USAGE = "USAGE:  stage [options] <worldfile1> [worldfile2 ... worldf
 static struct option longopts[] = {
   { "gui",  optional_argument,   NULL,  'g' },
   { "clock",  optional_argument,   NULL,  'c' },
+  { "parallel",  optional_argument,   NULL,  'p' },
   { "help",  optional_argument,   NULL,  'h' },
   { "args",  required_argument,   NULL,  'a' },
   { NULL, 0, NULL, 0 }
@@ -64,7 +71,7 @@ int main( int argc, char* argv[] )
   bool usegui = true;
   bool showclock = false;
 
-  while ((ch = getopt_long(argc, argv, "cgh?", longopts, &optindex)) != -1) {
+  while ((ch = getopt_long(argc, argv, "cgph?", longopts, &optindex)) != -1) {
     switch (ch) {
     case 0: // long option given
       printf("option %s given\n", longopts[optindex].name);
@@ -78,6 +85,10 @@ int main( int argc, char* argv[] )
       usegui = false;
       printf("[GUI disabled]");
       break;
+    case 'p':
+      World::SetParallelWorlds(true);
+      printf("[Parallel worlds]");
+      break;
     case 'h':
     case '?':
       puts(USAGE);
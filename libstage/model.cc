@@ -48,6 +48,8 @@
     map_resolution 0.1
     say ""
     alwayson 0
+    lazy 0
+    log_trajectory 0
 
     stack_children 1
     )
@@ -121,6 +123,20 @@
     - gui_move <int>\n if 1, the model can be moved by the mouse in
     the GUI window
 
+    - lazy <int>\n If non-zero, a ranger, blobfinder or fiducial
+    model records its pose at each update but only senses when its
+    data is next read, so scans that nobody reads are never made. The
+    data is sensed from the pose and with the noise of the update it
+    was due. Read in that update, which is the usual case of a
+    controller reading it in an update callback, the world is as it
+    was then too, though ranges may differ from the usual by up to a
+    cell of the world's resolution since other models have moved in
+    the meantime. Read later, the world is as it is at the time of
+    reading.
+
+    - log_trajectory <int>\n If non-zero, the model's trajectory is
+    recorded to the file named by the world option trajectory_log.
+
     - stack_children <int>\n If non-zero (the default), the coordinate
     system of child models is offset in z so that its origin is on
     _top_ of this model, making it easy to stack models together. If
@@ -134,6 +150,7 @@
 
 #include <ltdl.h> // for library module loading
 #include <map>
+#include <sched.h> // for sched_yield()
 #include <sstream> // for converting values to strings
 
 #include "config.h" // for build-time config
@@ -145,11 +162,20 @@ using namespace Stg;
 // static members
 uint32_t Model::count(0);
 std::map<Stg::id_t, Model *> Model::modelsbyid;
+
+// protects modelsbyid, since worlds updated in parallel may create
+// and destroy models at the same time
+static pthread_mutex_t modelsbyid_mutex = PTHREAD_MUTEX_INITIALIZER;
 std::map<std::string, creator_t> Model::name_map;
 
 // static const members
 static const double DEFAULT_FRICTION = 0.0;
 
+// values of lazy_state
+static const int LAZY_FRESH(0); // the data is up to date
+static const int LAZY_STALE(1); // the last update was deferred
+static const int LAZY_SENSING(2); // a thread is bringing the data up to date
+
 Bounds &Bounds::Load(Worldfile *wf, const int section, const char *keyword)
 {
   wf->ReadTuple(section, keyword, 0, 2, "ll", &min, &max);
@@ -232,12 +258,14 @@ Model::Model(World *world, Model *parent, const std::string &type, const std::st
       callbacks(__CB_TYPE_COUNT), // one slot in the vector for each type
       color(1, 0, 0), // red
       data_fresh(false), disabled(false), cv_list(), flag_list(), friction(DEFAULT_FRICTION),
-      geom(), has_default_block(true), id(Model::count++), interval((usec_t)1e5), // 100msec
+      geom(), has_default_block(true), id(__atomic_fetch_add(&Model::count, 1, __ATOMIC_RELAXED)), serial(world->models_made++), interval((usec_t)1e5), // 100msec
       interval_energy((usec_t)1e5), // 100msec
-      last_update(0), log_state(false), map_resolution(0.1), mass(0), parent(parent), pose(),
-      power_pack(NULL), pps_charging(), rastervis(), rebuild_displaylist(true), say_string(),
-      stack_children(true), stall(false), subs(0), thread_safe(false), trail(20),
-      trail_index(0),  trail_interval(10), type(type), event_queue_num(0), used(false), watts(0.0), watts_give(0.0),
+      last_update(0), lazy(false), lazy_state(LAZY_FRESH), log_state(false), map_resolution(0.1),
+      mass(0), own_scan(NULL), parent(parent), pose(), power_pack(NULL), pps_charging(),
+      rastervis(), rebuild_displaylist(true), say_string(), sense_pose(), sense_update(0),
+      shared_scan(NULL), stack_children(true), stall(false), subs(0), thread_safe(false),
+      trail(20), trail_index(0),  trail_interval(10), type(type), event_queue_num(0), used(false),
+      update_cost(0), cost_sum(0), cost_count(0), watts(0.0), watts_give(0.0),
       watts_take(0.0), wf(NULL), wf_entity(0), world(world),
       world_gui(dynamic_cast<WorldGui *>(world))
 {
@@ -246,7 +274,9 @@ Model::Model(World *world, Model *parent, const std::string &type, const std::st
   PRINT_DEBUG3("Constructing model world: %s parent: %s type: %s \n", world->Token(),
                parent ? parent->Token() : "(null)", type.c_str());
 
+  pthread_mutex_lock(&modelsbyid_mutex);
   modelsbyid[id] = this;
+  pthread_mutex_unlock(&modelsbyid_mutex);
 
   if (name.size()) // use a name if specified
   {
@@ -301,6 +331,12 @@ Model::~Model(void)
 {
   // children are removed in ancestor class
 
+  if (shared_scan)
+    shared_scan->RemoveUser(this);
+
+  // our children that share our scan stop doing so
+  delete own_scan;
+
   if (world) // if I'm not a worldless dummy model
   {
     UnMap(); // remove from all layers
@@ -309,7 +345,9 @@ Model::~Model(void)
     // list if I have no parent
     EraseAll(this, parent ? parent->children : world->children);
     // erase from the static map of all models
+    pthread_mutex_lock(&modelsbyid_mutex);
     modelsbyid.erase(id);
+    pthread_mutex_unlock(&modelsbyid_mutex);
 
     world->RemoveModel(this);
   }
@@ -472,16 +510,22 @@ point_t Model::LocalToGlobal(const point_t &pt) const
 }
 
 std::vector<point_int_t> Model::LocalToPixels(const std::vector<point_t> &local) const
+{
+  return LocalToPixels(local, GetGlobalPose());
+}
+
+std::vector<point_int_t> Model::LocalToPixels(const std::vector<point_t> &local,
+                                              const Pose &gpose) const
 {
   const size_t sz = local.size();
 
   std::vector<point_int_t> global(sz);
 
-  const Pose gpose(GetGlobalPose() + geom.pose);
+  const Pose origin(gpose + geom.pose);
   Pose ptpose;
 
   for (size_t i = 0; i < sz; i++) {
-    ptpose = gpose + Pose(local[i].x, local[i].y, 0, 0);
+    ptpose = origin + Pose(local[i].x, local[i].y, 0, 0);
 
     global[i].x = (int32_t)floor(ptpose.x * world->ppm);
     global[i].y = (int32_t)floor(ptpose.y * world->ppm);
@@ -520,6 +564,13 @@ void Model::UnMapFromRoot(unsigned int layer)
 
 void Model::Subscribe(void)
 {
+  // starting and stopping models changes the world, so leave it to
+  // the main thread
+  if (World::InThreadSafeCallback()) {
+    world->DeferSubscription(this, 1);
+    return;
+  }
+
   subs++;
   world->total_subs++;
   world->dirty = true; // need redraw
@@ -533,6 +584,13 @@ void Model::Subscribe(void)
 
 void Model::Unsubscribe(void)
 {
+  // starting and stopping models changes the world, so leave it to
+  // the main thread
+  if (World::InThreadSafeCallback()) {
+    world->DeferSubscription(this, -1);
+    return;
+  }
+
   subs--;
   world->total_subs--;
   world->dirty = true; // need redraw
@@ -568,6 +626,137 @@ const char *Model::PrintWithPose() const
   return txt;
 }
 
+Model *Model::LookupId(uint32_t id)
+{
+  pthread_mutex_lock(&modelsbyid_mutex);
+  std::map<id_t, Model *>::const_iterator it(modelsbyid.find(id));
+  Model *mod(it == modelsbyid.end() ? NULL : it->second);
+  pthread_mutex_unlock(&modelsbyid_mutex);
+  return mod;
+}
+
+Rng Model::GetRng(uint32_t stream) const
+{
+  return GetRng(stream, world->updates);
+}
+
+Rng Model::GetRng(uint32_t stream, uint64_t update) const
+{
+  return Rng(((uint64_t)world->seed << 32) | serial, update, stream);
+}
+
+bool Model::DeferUpdate()
+{
+  sense_pose = GetGlobalPose();
+  sense_update = world->updates;
+
+  if (!lazy || HasPipelinedCallbacks())
+    return false;
+
+  __atomic_store_n(&lazy_state, LAZY_STALE, __ATOMIC_RELEASE);
+  return true;
+}
+
+void Model::SenseIfStale() const
+{
+  if (__atomic_load_n(&lazy_state, __ATOMIC_ACQUIRE) == LAZY_FRESH)
+    return;
+
+  // the first reader senses, any others wait for it
+  int stale(LAZY_STALE);
+  if (__atomic_compare_exchange_n(&lazy_state, &stale, LAZY_SENSING, false, __ATOMIC_ACQUIRE,
+                                  __ATOMIC_ACQUIRE)) {
+    const_cast<Model *>(this)->Sense();
+    __atomic_store_n(&lazy_state, LAZY_FRESH, __ATOMIC_RELEASE);
+    return;
+  }
+
+  while (__atomic_load_n(&lazy_state, __ATOMIC_ACQUIRE) != LAZY_FRESH)
+    sched_yield();
+}
+
+void Model::ShareScan(meters_t range, unsigned int rays, bool ztest, meters_t height)
+{
+  if (rays == 0)
+    return;
+
+  if (parent == NULL) {
+    PRINT_WARN1("model %s has no parent to share a scan with", Token());
+    return;
+  }
+
+  if (parent->own_scan == NULL)
+    parent->own_scan = new SharedScan(parent);
+
+  parent->own_scan->AddUser(this, range, rays, ztest, height);
+  shared_scan = parent->own_scan;
+}
+
+void Model::SaveState(WorldSnapshot &snap) const
+{
+  // subscriptions come first, since restoring them starts up or
+  // shuts down the model, which resets some of the rest
+  snap.Put(subs);
+  snap.Put(pose);
+  snap.Put(map_pose[0]);
+  snap.Put(map_pose[1]);
+  snap.Put(stall);
+  snap.Put(disabled);
+  snap.Put(event_queue_num);
+  snap.Put(last_update);
+  snap.Put(watts);
+  snap.Put(watts_give);
+  snap.Put(watts_take);
+  snap.Put(__atomic_load_n(&lazy_state, __ATOMIC_ACQUIRE));
+  snap.Put(sense_pose);
+  snap.Put(sense_update);
+
+  snap.Put(power_pack != NULL);
+  if (power_pack)
+    power_pack->SaveState(snap);
+
+  snap.PutVector(std::vector<PowerPack *>(pps_charging.begin(), pps_charging.end()));
+}
+
+void Model::RestoreState(const WorldSnapshot &snap, size_t &pos)
+{
+  int n(0);
+  snap.Get(pos, n);
+  while (subs < n)
+    Subscribe();
+  while (subs > n)
+    Unsubscribe();
+
+  snap.Get(pos, pose);
+  snap.Get(pos, map_pose[0]);
+  snap.Get(pos, map_pose[1]);
+  snap.Get(pos, stall);
+  snap.Get(pos, disabled);
+  snap.Get(pos, event_queue_num);
+  snap.Get(pos, last_update);
+  snap.Get(pos, watts);
+  snap.Get(pos, watts_give);
+  snap.Get(pos, watts_take);
+
+  int state(LAZY_FRESH);
+  snap.Get(pos, state);
+  __atomic_store_n(&lazy_state, state, __ATOMIC_RELEASE);
+  snap.Get(pos, sense_pose);
+  snap.Get(pos, sense_update);
+
+  // a model only gains a power pack by loading, so it still has one
+  bool has_pack(false);
+  snap.Get(pos, has_pack);
+  if (has_pack)
+    power_pack->RestoreState(snap, pos);
+
+  std::vector<PowerPack *> charging;
+  snap.GetVector(pos, charging);
+  pps_charging.assign(charging.begin(), charging.end());
+
+  NeedRedraw();
+}
+
 void Model::Startup(void)
 {
   // printf( "Startup model %s\n", this->token );
@@ -576,7 +765,8 @@ void Model::Startup(void)
   // iff we're thread safe, we can use an event queue >0, else 0
   event_queue_num = thread_safe ? world->GetEventQueue(this) : 0;
 
-  world->Enqueue(event_queue_num, interval, this, UpdateWrapper, NULL);
+  // UpdateWrapper() keeps this event going until we are unsubscribed
+  world->EnqueuePeriodic(event_queue_num, interval, this, UpdateWrapper, NULL);
 
   if (FindPowerPack())
     world->EnableEnergy(this);
@@ -591,6 +781,9 @@ void Model::Shutdown(void)
 
   world->DisableEnergy(this);
 
+  // nobody is left to read a deferred update
+  __atomic_store_n(&lazy_state, LAZY_FRESH, __ATOMIC_RELEASE);
+
   // allows data visualizations to be cleared.
   NeedRedraw();
 }
@@ -601,22 +794,83 @@ void Model::Update(void)
 
   last_update = world->sim_time;
 
-  if (subs > 0) // no subscriptions means we don't need to be updated
-    world->Enqueue(event_queue_num, interval, this, UpdateWrapper, NULL);
-
   // if we updated the model then it needs to have its update
   // callback called in series back in the main thread. It's
   // not safe to run user callbacks in a worker thread, as
   // they may make OpenGL calls or unsafe Stage API calls,
   // etc. We queue up the callback into a queue specific to
+  // this thread. Callbacks added as thread-safe are queued
+  // separately, to be called by all threads in parallel once every
+  // model has been updated and moved. A robot's models share a
+  // root, so they all go to the same thread.
 
-  if (!callbacks[Model::CB_UPDATE].empty())
+  const std::set<cb_t> &callset(callbacks[Model::CB_UPDATE]);
+  if (callset.empty())
+    return;
+
+  bool safe(false), unsafe(false);
+  FOR_EACH (it, callset)
+    (it->thread_safe ? safe : unsafe) = true;
+
+  if (safe) {
+    std::vector<std::vector<Model *> > &lists(world->pending_threadsafe_callbacks[event_queue_num]);
+    lists[Root()->id % (world->worker_threads + 1)].push_back(this);
+  }
+  if (unsafe)
     world->pending_update_callbacks[event_queue_num].push(this);
 }
 
-void Model::CallUpdateCallbacks(void)
+// thread CPU time in nsec, for measuring the cost of updates
+static uint64_t thread_nsec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int Model::UpdateWrapper(Model *mod, void *)
+{
+  // the load balancer only needs the costs of models on worker queues
+  if (mod->world->measure_costs && mod->event_queue_num > 0) {
+    const uint64_t start(thread_nsec());
+    mod->Update();
+    mod->cost_sum += thread_nsec() - start;
+    ++mod->cost_count;
+  } else
+    mod->Update();
+
+  return (mod->subs < 1);
+}
+
+bool Model::HasPipelinedCallbacks() const
+{
+  if (!world->pipeline)
+    return false;
+
+  const std::set<cb_t> &callset(callbacks[CB_UPDATE]);
+  FOR_EACH (it, callset)
+    if (it->thread_safe)
+      return true;
+
+  return false;
+}
+
+void Model::CallUpdateCallbacks(bool thread_safe)
 {
-  CallCallbacks(CB_UPDATE);
+  // as CallCallbacks(), but only for callbacks with a matching
+  // thread_safe flag
+  std::vector<cb_t> doomed;
+  std::set<cb_t> &callset(callbacks[CB_UPDATE]);
+
+  FOR_EACH (it, callset)
+    if (it->thread_safe == thread_safe && (it->callback)(this, it->arg))
+      doomed.push_back(*it);
+
+  FOR_EACH (it, doomed) {
+    if (thread_safe)
+      __atomic_sub_fetch(&world->threadsafe_cb_count, 1, __ATOMIC_RELAXED);
+    callset.erase(*it);
+  }
 }
 
 meters_t Model::ModelHeight() const
@@ -678,53 +932,52 @@ Model *Model::TestCollision()
   return hitmod;
 }
 
-void Model::UpdateCharge()
+Model *Model::FindContacts(std::vector<Contact> &contacts)
 {
-  PowerPack *mypp = FindPowerPack();
-  assert(mypp);
+  Model *hitmod(blockgroup.FindContacts(contacts));
 
+  FOR_EACH (it, children) {
+    Model *mod((*it)->FindContacts(contacts));
+    if (hitmod == NULL)
+      hitmod = mod;
+  }
+
+  return hitmod;
+}
+
+void Model::DissipateEnergy(PowerPack *pp)
+{
   if (watts > 0) // dissipation rate
   {
     // consume  energy stored in the power pack
-    mypp->Dissipate(watts * (interval_energy * 1e-6), GetGlobalPose());
+    pp->DissipateLocal(watts * (interval_energy * 1e-6), GetGlobalPose());
   }
+}
 
-  if (watts_give > 0) // transmission to other powerpacks max rate
-  {
-    // detach charger from all the packs charged last time
-    FOR_EACH (it, pps_charging)
-      (*it)->ChargeStop();
-    pps_charging.clear();
-
-    // run through and update all appropriate touchers
-    std::set<Model *> touchers;
-    AppendTouchingModels(touchers);
-
-    FOR_EACH (it, touchers) {
-      Model *toucher = (*it);
-      PowerPack *hispp = toucher->FindPowerPack();
-
-      if (hispp && toucher->watts_take > 0.0) {
-        // printf( "   toucher %s can take up to %.2f wats\n",
-        //		toucher->Token(), toucher->watts_take );
-
-        const watts_t rate = std::min(watts_give, toucher->watts_take);
-        const joules_t amount = rate * interval_energy * 1e-6;
+static bool ltid(const std::pair<Model *, Model *> &a, const std::pair<Model *, Model *> &b)
+{
+  return a.second->GetId() < b.second->GetId();
+}
 
-        // printf ( "moving %.2f joules from %s to %s\n",
-        //		 amount, token, toucher->token );
+void Model::AppendChargeContacts(std::vector<std::pair<Model *, Model *> > &contacts)
+{
+  if (watts_give <= 0) // can't transmit to other powerpacks
+    return;
 
-        // set his charging flag
-        hispp->ChargeStart();
+  std::set<Model *> touchers;
+  AppendTouchingModels(touchers);
 
-        // move some joules from me to him
-        mypp->TransferTo(hispp, amount);
+  const size_t first(contacts.size());
 
-        // remember who we are charging so we can detatch next time
-        pps_charging.push_front(hispp);
-      }
-    }
+  FOR_EACH (it, touchers) {
+    Model *toucher = (*it);
+    if (toucher->watts_take > 0.0 && toucher->FindPowerPack())
+      contacts.push_back(std::make_pair(this, toucher));
   }
+
+  // the set is ordered by pointer, so sort to make the order of
+  // transfers repeatable
+  std::sort(contacts.begin() + first, contacts.end(), ltid);
 }
 
 void Model::UpdateTrail()
@@ -813,6 +1066,9 @@ kg_t Model::GetMassOfChildren() const
 // render all blocks in the group at my global pose and size
 void Model::Map(unsigned int layer)
 {
+  // the blocks render at this pose, so that World::Restore() can
+  // render them at another
+  map_pose[layer] = GetGlobalPose();
   blockgroup.Map(layer);
 }
 
@@ -1220,6 +1476,9 @@ Pose Model::GetGlobalPose() const
 // set the model's pose in the local frame
 void Model::SetPose(const Pose &newpose)
 {
+  // moving a model remaps it in cells other robots may share
+  assert(!World::InThreadSafeCallback());
+
   // if the pose has changed, we need to do some work
   if (pose != newpose) {
     pose = newpose;
@@ -1428,6 +1687,11 @@ void Model::Load()
   trail.resize(trail_length);
   trail_interval = wf->ReadInt(wf_entity, "trail_interval", trail_interval);
 
+  this->lazy = wf->ReadInt(wf_entity, "lazy", lazy);
+
+  if (wf->ReadInt(wf_entity, "log_trajectory", 0))
+    world->Log(this);
+
   this->alwayson = wf->ReadInt(wf_entity, "alwayson", alwayson);
   if (alwayson)
     Subscribe();
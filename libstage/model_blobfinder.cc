@@ -61,6 +61,7 @@ static const unsigned int DEFAULT_BLOBFINDERSCANHEIGHT = 60;
    range 12.0
    fov 3.14159/3.0
    pan 0.0
+   shared_scan 0
 
    # model properties
    size [ 0.0 0.0 0.0 ]
@@ -80,6 +81,12 @@ static const unsigned int DEFAULT_BLOBFINDERSCANHEIGHT = 60;
    resolution
    - range <float>\n
    maximum range of the sensor in meters.
+   - shared_scan <int>\n
+   if non-zero, the image's columns are read from a panoramic scan of
+   this many rays that the sensors on the parent model with shared_scan
+   set take turns to use, traced once per update. Each column sees along
+   the nearest of the scan's rays, so columns narrower than the scan's
+   rays repeat their neighbours.
 
 */
 
@@ -145,6 +152,8 @@ void ModelBlobfinder::Load(void)
   fov = wf->ReadAngle(wf_entity, "fov", fov);
   pan = wf->ReadAngle(wf_entity, "pan", pan);
 
+  ShareScan(range, wf->ReadInt(wf_entity, "shared_scan", 0), false, 0);
+
   if (wf->PropertyExists(wf_entity, "colors")) {
     RemoveAllColors(); // empty the color list to start from scratch
 
@@ -162,12 +171,72 @@ void ModelBlobfinder::Load(void)
   }
 }
 
+void ModelBlobfinder::SaveState(WorldSnapshot &snap) const
+{
+  Model::SaveState(snap);
+
+  snap.Put(blobs.size());
+  FOR_EACH (it, blobs) {
+    snap.Put(it->color.r);
+    snap.Put(it->color.g);
+    snap.Put(it->color.b);
+    snap.Put(it->color.a);
+    snap.Put(it->left);
+    snap.Put(it->top);
+    snap.Put(it->right);
+    snap.Put(it->bottom);
+    snap.Put(it->range);
+  }
+}
+
+void ModelBlobfinder::RestoreState(const WorldSnapshot &snap, size_t &pos)
+{
+  Model::RestoreState(snap, pos);
+
+  size_t n(0);
+  snap.Get(pos, n);
+  blobs.resize(n);
+  FOR_EACH (it, blobs) {
+    snap.Get(pos, it->color.r);
+    snap.Get(pos, it->color.g);
+    snap.Get(pos, it->color.b);
+    snap.Get(pos, it->color.a);
+    snap.Get(pos, it->left);
+    snap.Get(pos, it->top);
+    snap.Get(pos, it->right);
+    snap.Get(pos, it->bottom);
+    snap.Get(pos, it->range);
+  }
+}
+
 void ModelBlobfinder::Update(void)
+{
+  if (!DeferUpdate())
+    Sense();
+
+  Model::Update();
+}
+
+void ModelBlobfinder::Sense(void)
 {
   // generate a scan for post-processing into a blob image
   std::vector<RaytraceResult> samples(scan_width);
 
-  Raytrace(Pose(0, 0, 0, pan), range, fov, blob_match, NULL, false, samples);
+  if (shared_scan) {
+    // as World::Raytrace() does over the field of view, but looking
+    // each ray up in the scan first
+    const Pose gpose(SenseToGlobal(Pose(0, 0, 0, pan)));
+    const double starta(fov / 2.0 - gpose.a);
+    Ray ray(this, gpose, range, blob_match, NULL, false);
+
+    for (unsigned int s(0); s < scan_width; ++s) {
+      ray.origin.a = (s * fov / (double)(scan_width - 1)) - starta;
+      if (!shared_scan->Raytrace(ray, samples[s]))
+        samples[s] = world->Raytrace(ray);
+    }
+  } else
+    world->Raytrace(SenseToGlobal(Pose(0, 0, 0, pan)), range, fov, blob_match, this, NULL, false,
+                    samples);
 
   // now the colors and ranges are filled in - time to do blob detection
   double yRadsPerPixel = fov / scan_height;
@@ -245,8 +314,6 @@ void ModelBlobfinder::Update(void)
     // g_array_append_val( blobs, blob );
     blobs.push_back(blob);
   }
-
-  Model::Update();
 }
 
 void ModelBlobfinder::Startup(void)
@@ -345,8 +412,9 @@ void ModelBlobfinder::Vis::Visualize(Model *mod, Camera *cam)
   glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
 
   // draw the blobs on the screen
-  for (unsigned int s = 0; s < bf->blobs.size(); s++) {
-    Blob *b = &bf->blobs[s];
+  const std::vector<Blob> &blobs(bf->GetBlobs());
+  for (unsigned int s = 0; s < blobs.size(); s++) {
+    const Blob *b = &blobs[s];
     // blobfinder_blob_t* b =
     //&g_array_index( blobs, blobfinder_blob_t, s);
 
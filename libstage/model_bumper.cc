@@ -28,6 +28,7 @@ bumper
   bcount 1
   bpose[0] [ 0 0 0 0 ]
   blength 0.1
+  bcontacts 0
 )
 @endverbatim
 
@@ -51,6 +52,20 @@ Note that the order in the worldfile is ignored.
 - blength[\<transducer index\>] float
   - length in meters of a specific transducer. This is applied after the global
 setting above.
+- bcontacts int
+  - if 1, and the bumper is mounted on a position model, the bumpers
+read the contacts that the position model recorded in its last
+collision test, instead of raytracing: what it touched when it last
+moved, and where other position models bumped into it. A contact
+within half a cell's diagonal of a transducer hits it, at the nearest
+point on the transducer. The position model's collision test then
+visits all its cells, but the transducers cost next to nothing, which
+pays off with several of them. When the position model neither moved
+nor was bumped into, the bumpers raytrace as usual. Unlike rays,
+contacts are felt while the position model is stalled against
+something, since they are found at the pose it tried to move to, and
+are not felt beyond the cells the position model and its descendents
+occupy.
 
 */
 
@@ -79,7 +94,10 @@ ModelBumper::ModelBumper(World *world, Model *parent, const std::string &type)
 
   bumpers = NULL;
   samples = NULL;
+  samples_back = NULL;
   bumper_count = 0;
+  use_contacts = false;
+  contact_host = NULL;
 
   AddVisualizer(&bumpervis, true);
 }
@@ -90,6 +108,8 @@ ModelBumper::~ModelBumper()
     delete[] bumpers;
   if (samples)
     delete[] samples;
+  if (samples_back)
+    delete[] samples_back;
 }
 
 void ModelBumper::Startup(void)
@@ -99,6 +119,13 @@ void ModelBumper::Startup(void)
   PRINT_DEBUG("bumper startup");
 
   this->SetWatts(BUMPER_WATTS);
+
+  if (use_contacts) {
+    for (Model *mod(parent); mod && contact_host == NULL; mod = mod->Parent())
+      contact_host = dynamic_cast<ModelPosition *>(mod);
+    if (contact_host)
+      contact_host->SubscribeContacts();
+  }
 }
 
 void ModelBumper::Shutdown(void)
@@ -107,11 +134,21 @@ void ModelBumper::Shutdown(void)
 
   this->SetWatts(0);
 
+  if (contact_host) {
+    contact_host->UnsubscribeContacts();
+    contact_host = NULL;
+  }
+
   if (this->samples) {
     delete[] samples;
     samples = NULL;
   }
 
+  if (this->samples_back) {
+    delete[] samples_back;
+    samples_back = NULL;
+  }
+
   Model::Shutdown();
 }
 
@@ -119,6 +156,8 @@ void ModelBumper::Load(void)
 {
   Model::Load();
 
+  use_contacts = wf->ReadInt(wf_entity, "bcontacts", use_contacts);
+
   if (wf->PropertyExists(wf_entity, "bcount")) {
     PRINT_DEBUG("Loading bumper array");
 
@@ -161,6 +200,34 @@ static bool bumper_match(Model *candidate, const Model *finder, const void *)
       !finder->IsRelated(candidate));
 }
 
+// the contact nearest the start of the transducer running length
+// meters from pose that lies within radius of it, or NULL, with the
+// point on the transducer nearest it
+static const Contact *find_touch(const Pose &pose, meters_t length, meters_t radius,
+                                 const std::vector<Contact> &contacts, point_t &hit_point)
+{
+  const double c(cos(pose.a)), s(sin(pose.a));
+  const Contact *touch(NULL);
+  meters_t touch_along(0);
+
+  FOR_EACH (it, contacts) {
+    const double dx(it->point.x - pose.x), dy(it->point.y - pose.y);
+    const meters_t along(c * dx + s * dy);
+    if (fabs(c * dy - s * dx) > radius || along < -radius || along > length + radius)
+      continue;
+
+    const meters_t clamped(std::min(std::max(along, 0.0), length));
+    if (touch == NULL || clamped < touch_along) {
+      touch = &*it;
+      touch_along = clamped;
+    }
+  }
+
+  if (touch)
+    hit_point = point_t(pose.x + c * touch_along, pose.y + s * touch_along);
+  return touch;
+}
+
 void ModelBumper::Update(void)
 {
   Model::Update();
@@ -174,6 +241,27 @@ void ModelBumper::Update(void)
   }
   assert(samples);
 
+  // in pipelined mode our callbacks may still be reading the last
+  // samples, so write into the back buffer
+  BumperSample *samples(this->samples);
+  if (HasPipelinedCallbacks()) {
+    if (samples_back == NULL)
+      samples_back = new BumperSample[bumper_count];
+    samples = samples_back;
+  }
+
+  // our host's contacts are related to neither it nor us, so they
+  // all pass bumper_match()
+  const std::vector<Contact> *contacts(contact_host ? contact_host->GetContacts() : NULL);
+  if (contacts && contacts->empty()) {
+    for (unsigned int t = 0; t < bumper_count; t++)
+      samples[t].hit = NULL;
+    return;
+  }
+
+  const Pose gpose(contacts ? LocalToGlobal(Pose()) : Pose());
+  const meters_t radius(sqrt(0.5) / world->Resolution());
+
   for (unsigned int t = 0; t < bumper_count; t++) {
     // change the pose of bumper to act as a sensor rotated of PI/2, positioned
     // at
@@ -183,6 +271,13 @@ void ModelBumper::Update(void)
     bpose.x = bumpers[t].pose.x - bumpers[t].length / 2.0 * cos(bpose.a);
     bpose.y = bumpers[t].pose.y - bumpers[t].length / 2.0 * sin(bpose.a);
 
+    if (contacts) {
+      const Contact *touch(
+          find_touch(gpose + bpose, bumpers[t].length, radius, *contacts, samples[t].hit_point));
+      samples[t].hit = touch ? touch->mod : NULL;
+      continue;
+    }
+
     RaytraceResult ray = Raytrace(bpose, bumpers[t].length, bumper_match, NULL, false);
 
     samples[t].hit = ray.mod;
@@ -192,6 +287,11 @@ void ModelBumper::Update(void)
   }
 }
 
+void ModelBumper::SwapDataBuffers(void)
+{
+  std::swap(samples, samples_back);
+}
+
 void ModelBumper::Print(char *prefix) const
 {
   Model::Print(prefix);
@@ -2,28 +2,40 @@
 using namespace Stg;
 using namespace std;
 
-void Model::AddCallback(callback_type_t type, model_callback_t cb, void *user)
+void Model::AddCallback(callback_type_t type, model_callback_t cb, void *user, bool thread_safe)
 {
+  assert(!World::InThreadSafeCallback());
+
   // callbacks[address].insert( cb_t( cb, user ));
-  callbacks[type].insert(cb_t(cb, user));
+  callbacks[type].insert(cb_t(cb, user, thread_safe && type == CB_UPDATE));
 
   // debug info - record the global number of registered callbacks
   if (type == CB_UPDATE) {
     assert(world->update_cb_count >= 0);
-    world->update_cb_count++;
+    __atomic_add_fetch(&world->update_cb_count, 1, __ATOMIC_RELAXED);
+
+    if (thread_safe)
+      __atomic_add_fetch(&world->threadsafe_cb_count, 1, __ATOMIC_RELAXED);
   }
 }
 
 int Model::RemoveCallback(callback_type_t type, model_callback_t callback)
 {
+  assert(!World::InThreadSafeCallback());
+
   set<cb_t> &callset = callbacks[type];
-  callset.erase(cb_t(callback, NULL));
 
   if (type == CB_UPDATE) {
-    world->update_cb_count--;
+    set<cb_t>::iterator it(callset.find(cb_t(callback, NULL)));
+    if (it != callset.end() && it->thread_safe)
+      __atomic_sub_fetch(&world->threadsafe_cb_count, 1, __ATOMIC_RELAXED);
+
+    __atomic_sub_fetch(&world->update_cb_count, 1, __ATOMIC_RELAXED);
     assert(world->update_cb_count >= 0);
   }
 
+  callset.erase(cb_t(callback, NULL));
+
   // return the number of callbacks remaining for this address. Useful
   // for detecting when there are none.
   return callset.size();
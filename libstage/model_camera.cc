@@ -29,6 +29,11 @@ static const char DEFAULT_GEOM_COLOR[] = "black";
 static const float DEFAULT_HFOV = 70;
 static const float DEFAULT_VFOV = 40;
 
+// what the software renderer shows where no block or floor is seen:
+// the same as the canvas's background
+static const Color SKY_COLOR(0.7, 0.7, 0.8, 1.0);
+static const Color FLOOR_COLOR(1.0, 1.0, 1.0, 1.0);
+
 /**
 @ingroup model
 @defgroup model_camera Camera model
@@ -48,6 +53,7 @@ camera
   range [ 0.2 8.0 ]
   fov [ 70.0 40.0 ]
   pantilt [ 0.0 0.0 ]
+  renderer "gl"
 
   # model properties
   size [ 0.1 0.07 0.05 ]
@@ -70,6 +76,15 @@ value too close to 0.
 - pantilt [ pan:<float> tilt:<float> ]
   angle, in degrees, where the camera is looking. pan is the left-right
 positioning, and tilt is the up-down positioning.
+- renderer "gl" or "cpu"\n
+  how frames are made. "gl" draws the scene with OpenGL and reads
+back the depth and color buffers, so it needs a GUI world. "cpu" ray
+casts through the world's blocks in software, and is used by default
+in headless worlds, where there is no OpenGL context. Software frames
+show each model in its flat color, with the floor white and the
+background as in the GUI. They leave out the camera and the models
+it is mounted on, and since they share no state, cameras using them
+update in parallel on the worker threads.
 */
 
 // calculate the cross product, and store results in the first vertex
@@ -90,17 +105,17 @@ ModelCamera::ModelCamera(World *world, Model *parent, const std::string &type)
     : Model(world, parent, type), _canvas(NULL), _frame_data(NULL), _frame_color_data(NULL),
       _valid_vertexbuf_cache(false), _vertexbuf_cache(NULL), _width(32), _height(32),
       _camera_quads_size(0), _camera_quads(NULL), _camera_colors(NULL), _camera(), _yaw_offset(0.0),
-      _pitch_offset(0.0)
+      _pitch_offset(0.0), _cpu_render(false)
 {
 PRINT_DEBUG2("Constructing ModelCamera %u (%s)\n", id, type.c_str());
 
   WorldGui *world_gui = dynamic_cast<WorldGui *>(world);
 
-  if (world_gui == NULL) {
-    printf("Unable to use Camera Model - it must be run with a GUI world\n");
-    assert(0);
-  }
-  _canvas = world_gui->GetCanvas();
+  // without a GUI there is no OpenGL context to draw with
+  if (world_gui)
+    _canvas = world_gui->GetCanvas();
+  else
+    _cpu_render = true;
 
   _camera.setPitch(90.0);
 
@@ -142,19 +157,33 @@ void ModelCamera::Load(void)
   wf->ReadTuple(wf_entity, "pantilt", 0, 2, "ff", &_yaw_offset, &_pitch_offset);
 
   wf->ReadTuple(wf_entity, "resolution", 0, 2, "ii", &_width, &_height);
+
+  const std::string renderer(wf->ReadString(wf_entity, "renderer", _cpu_render ? "cpu" : "gl"));
+  if (renderer == "cpu")
+    _cpu_render = true;
+  else if (renderer == "gl" && _canvas)
+    _cpu_render = false;
+  else if (renderer == "gl")
+    PRINT_WARN1("camera \"%s\" has no OpenGL context in a headless world, so it renders in software",
+                Token());
+  else
+    PRINT_ERR2("camera \"%s\" has an unknown renderer \"%s\"", Token(), renderer.c_str());
+
+  // software frames use no shared state
+  thread_safe = _cpu_render;
 }
 
 void ModelCamera::Update(void)
 {
-  GetFrame();
+  if (_cpu_render)
+    GetFrameCPU();
+  else
+    GetFrame();
   Model::Update();
 }
 
-bool ModelCamera::GetFrame(void)
+void ModelCamera::AllocateFrame(void)
 {
-  if (_width == 0 || _height == 0)
-    return false;
-
   if (_frame_data == NULL) {
     _frame_data = new GLfloat[_width * _height]; // assumes a max of depth 4
     _frame_color_data = new GLubyte[4 * _width * _height]; // for RGBA
@@ -165,6 +194,14 @@ bool ModelCamera::GetFrame(void)
     _camera_quads = new GLfloat[_camera_quads_size];
     _camera_colors = new GLubyte[_camera_quads_size];
   }
+}
+
+bool ModelCamera::GetFrame(void)
+{
+  if (_width == 0 || _height == 0)
+    return false;
+
+  AllocateFrame();
 
   // TODO overcome issue when glviewport is set LARGER than the window side
   // currently it just clips and draws outside areas black - resulting in bad
@@ -216,6 +253,166 @@ bool ModelCamera::GetFrame(void)
   return true;
 }
 
+// a pixel of a software frame, while its ray is cast
+struct cpu_pixel_t {
+  int index; // in the frame buffers
+  double depth; // depth per meter of the ray's horizontal distance
+  double slope; // height gained per meter of horizontal distance
+  meters_t range; // horizontal distance to the nearest surface seen so far
+  Color color; // of that surface
+};
+
+// the pixels that look in one horizontal direction, and the blocks
+// their ray has met
+struct cpu_ray_t {
+  const Model *camera;
+  meters_t z; // height of the camera
+  meters_t near; // nearest depth shown
+  std::vector<cpu_pixel_t> pixels;
+  std::vector<std::pair<const Block *, meters_t> > seen; // blocks and where they were first met
+};
+
+static bool camera_visit(const Block *block, Model *mod, const Bounds &z, meters_t range, void *arg)
+{
+  cpu_ray_t *ray(static_cast<cpu_ray_t *>(arg));
+
+  // the camera would otherwise see out from inside itself and the
+  // robot it is mounted on
+  if (mod == ray->camera || ray->camera->IsAntecedent(mod))
+    return false;
+
+  // the ray meets a block's outline where it enters the block and
+  // again where it leaves. A pixel that is above or below the block
+  // where it enters, and not where it leaves, sees its top or bottom
+  // in between.
+  meters_t first(range);
+  bool found(false);
+  FOR_EACH (it, ray->seen)
+    if (it->first == block) {
+      first = it->second;
+      found = true;
+      break;
+    }
+  if (!found)
+    ray->seen.push_back(std::make_pair(block, range));
+
+  bool open(false); // true while some pixel could still see something nearer
+  FOR_EACH (it, ray->pixels) {
+    cpu_pixel_t &px(*it);
+    if (px.range <= first)
+      continue;
+
+    const meters_t zr(ray->z + px.slope * range);
+    const meters_t zf(ray->z + px.slope * first);
+    meters_t hit(-1.0);
+
+    if (zr >= z.min && zr <= z.max)
+      hit = range; // a side
+    else if (zf > z.max && zr < z.max)
+      hit = (z.max - ray->z) / px.slope; // the top
+    else if (zf < z.min && zr > z.min)
+      hit = (z.min - ray->z) / px.slope; // the bottom
+
+    if (hit >= 0.0 && hit < px.range && px.depth * hit >= ray->near) {
+      px.range = hit;
+      px.color = mod->GetColor();
+    }
+
+    if (px.range > range)
+      open = true;
+  }
+
+  return !open;
+}
+
+bool ModelCamera::GetFrameCPU(void)
+{
+  if (_width == 0 || _height == 0)
+    return false;
+
+  AllocateFrame();
+
+  const Pose pose(GetGlobalPose());
+  const radians_t heading(parent->GetGlobalPose().a - dtor(_yaw_offset));
+  const radians_t tilt(dtor(_pitch_offset)); // positive looks down
+  const double sint(sin(tilt));
+  const double cost(cos(tilt));
+  const double tanx(tan(dtor(_camera.horizFov()) / 2.0));
+  const double tany(tan(dtor(_camera.vertFov()) / 2.0));
+  const meters_t far(_camera.farClip());
+  const bounds3d_t extent(world->GetExtent());
+
+  cpu_ray_t ray;
+  ray.camera = this;
+  ray.z = pose.z;
+  ray.near = _camera.nearClip();
+  ray.pixels.reserve(_height);
+
+  // when the camera is level, each column of pixels looks in one
+  // horizontal direction and shares a ray. Otherwise each pixel has
+  // its own.
+  const bool level(tilt == 0.0);
+
+  for (int i = 0; i < _width; i++) {
+    // the pixel's direction is (c, a, b) in the camera's frame of
+    // forward, left and up
+    const double a(-tanx * (2.0 * (i + 0.5) / _width - 1.0));
+
+    for (int j = 0; j < _height; j++) {
+      const double b(tany * (2.0 * (j + 0.5) / _height - 1.0));
+      const double c(cost + b * sint);
+      const double horiz(std::max(hypot(c, a), 1e-9));
+
+      cpu_pixel_t px;
+      px.index = i + j * _width;
+      px.depth = 1.0 / horiz;
+      px.slope = (b * cost - sint) / horiz;
+      px.range = far * horiz;
+      px.color = SKY_COLOR;
+
+      const radians_t angle(heading + atan2(a, c));
+
+      // the floor covers the world's extent
+      if (px.slope < 0.0 && pose.z > 0.0) {
+        const meters_t ground(pose.z / -px.slope);
+        const meters_t x(pose.x + ground * cos(angle));
+        const meters_t y(pose.y + ground * sin(angle));
+        if (ground < px.range && px.depth * ground >= ray.near && x >= extent.x.min
+            && x <= extent.x.max && y >= extent.y.min && y <= extent.y.max) {
+          px.range = ground;
+          px.color = FLOOR_COLOR;
+        }
+      }
+
+      ray.pixels.push_back(px);
+
+      if (level && j < _height - 1)
+        continue;
+
+      // cast the ray as far as any of its pixels might see
+      meters_t limit(0.0);
+      FOR_EACH (it, ray.pixels)
+        limit = std::max(limit, it->range);
+
+      ray.seen.clear();
+      world->TraceBlocks(Pose(pose.x, pose.y, pose.z, angle), limit, camera_visit, &ray);
+
+      FOR_EACH (it, ray.pixels) {
+        _frame_data[it->index] = it->depth * it->range;
+
+        GLubyte *color(_frame_color_data + 4 * it->index);
+        color[0] = it->color.r * 255.0 + 0.5;
+        color[1] = it->color.g * 255.0 + 0.5;
+        color[2] = it->color.b * 255.0 + 0.5;
+        color[3] = it->color.a * 255.0 + 0.5;
+      }
+      ray.pixels.clear();
+    }
+  }
+
+  return true;
+}
+
 // TODO create lines outlining camera frustrum, then iterate over each depth
 // measurement and create a square
 void ModelCamera::DataVisualize(Camera *)
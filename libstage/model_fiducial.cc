@@ -45,6 +45,7 @@ fiducial
   range_max_id 5.0
   fov 3.14159
   ignore_zloc 0
+  shared_scan 0
 
   # model properties
   size [ 0.1 0.1 0.1 ]
@@ -71,10 +72,17 @@ checking a fiducial.  Using the default behaviour, a short object would not been
 seen
   by a fiducial finder placed on top of a tall robot.  With this flag set to 1,
 the fiducial finder will see the shorter robot.
+- shared_scan <int>\n
+  default is 0. If non-zero, the lines of sight to fiducials are looked up
+in a panoramic scan of this many rays, traced once per update for all the
+sensors on the parent model that set shared_scan, rather than traced one by
+one. A line of sight follows the scan ray nearest its bearing. The largest
+value set by any of the sensors is used.
  */
 
 ModelFiducial::ModelFiducial(World *world, Model *parent, const std::string &type)
-    : Model(world, parent, type), fiducials(), max_range_anon(8.0), max_range_id(5.0),
+    : Model(world, parent, type), fiducials(), fiducials_back(), max_range_anon(8.0),
+      max_range_id(5.0),
       min_range(0.0), fov(M_PI), heading(0), key(0), ignore_zloc(false)
 {
   // PRINT_DEBUG2( "Constructing ModelFiducial %d (%s)\n",
@@ -106,7 +114,7 @@ static bool fiducial_raytrace_match(Model *candidate, const Model *finder, const
   return (!finder->IsRelated(candidate));
 }
 
-void ModelFiducial::AddModelIfVisible(Model *him)
+void ModelFiducial::AddModelIfVisible(Model *him, std::vector<Fiducial> &found)
 {
   // PRINT_DEBUG2( "Fiducial %s is testing model %s", token, him->Token() );
 
@@ -121,7 +129,7 @@ void ModelFiducial::AddModelIfVisible(Model *him)
     return;
   }
 
-  Pose mypose = this->GetGlobalPose();
+  const Pose &mypose(sense_pose);
 
   // are we within range?
   Pose hispose = him->GetGlobalPose();
@@ -160,25 +168,28 @@ void ModelFiducial::AddModelIfVisible(Model *him)
   // 1. The fiducial is in the field of view of the finder.
   // 2. The fiducial is in range of the finder.
   // At this point the purpose of the ray trace is to start at the finder and
-  // see if there is anything
-  // in between the finder and the fiducial.  If we simply trace out to the
-  // distance we know the finder
-  // is at, then the resulting ray.mod can be one of three things:
+  // see if there is anything in between the finder and the fiducial. We
+  // trace only as far as the far side of his footprint, so the resulting
+  // ray.mod can be one of three things:
   // 1. A pointer to the model we're tracing to.  In this case the model is at
-  // the right Zloc to be
-  //    returned by the ray tracer.
+  //    the right Zloc to be returned by the ray tracer.
   // 2. A pointer to another model that blocked the ray.
   // 3. NULL.  If it's null, then it means that the ray traced to where the
-  // fiducial should be but
-  //    it's zloc was such that the ray didn't hit it.  However, we DO know its
-  //    there, so we can
-  //    return this as a hit.
+  //    fiducial should be but it's zloc was such that the ray didn't hit it.
+  //    However, we DO know its there, so we can return this as a hit.
 
-  // printf( "range %.2f\n", range );
+  const Geom hisgeom(him->GetGeom());
+  const Pose &gp(hisgeom.pose);
+  const Size &gs(hisgeom.size);
+  const meters_t reach(range + sqrt(gp.x * gp.x + gp.y * gp.y) + sqrt(gs.x * gs.x + gs.y * gs.y) / 2.0);
 
-  RaytraceResult result = Raytrace(Pose(0, 0, 0, dtheta),
-                                   max_range_anon, // TODOscan only as far as the object
-                                   fiducial_raytrace_match, NULL, true);
+  const Ray ray(this, SenseToGlobal(Pose(0, 0, 0, dtheta)), std::min(reach, max_range_anon),
+                fiducial_raytrace_match, NULL, true);
+
+  RaytraceResult result;
+  if ((shared_scan == NULL || !shared_scan->Raytrace(ray, result)) &&
+      (!world->fiducial_los_cache || !world->FiducialLos(this, him, ray, result)))
+    result = world->Raytrace(ray);
 
   // TODO
   if (ignore_zloc && result.mod == NULL) // i.e. we didn't hit anything *else*
@@ -196,8 +207,6 @@ void ModelFiducial::AddModelIfVisible(Model *him)
 
   // passed all the tests! record the fiducial hit
 
-  Geom hisgeom(him->GetGeom());
-
   // record where we saw him and what he looked like
   Fiducial fid;
   fid.mod = him;
@@ -220,7 +229,7 @@ void ModelFiducial::AddModelIfVisible(Model *him)
   // PRINT_DEBUG2( "adding %s's value %d to my list of fiducials",
   //			  him->Token(), him->vis.fiducial_return );
 
-  fiducials.push_back(fid);
+  found.push_back(fid);
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -233,63 +242,46 @@ void ModelFiducial::Update(void)
   if (subs < 1)
     return;
 
-  // reset the array of detected fiducials
-  fiducials.clear();
-
-#if (1)
-  // BEGIN EXPERIMENT
-
-  // find two sets of fiducial-bearing models, within sensor range on
-  // the two different axes
-
-  double rng = max_range_anon;
-  Pose gp = GetGlobalPose();
-  Model edge; // dummy model used to find bounds in the sets
-
-  edge.pose = Pose(gp.x - rng, gp.y, 0, 0); // LEFT
-  std::set<Model *, World::ltx>::iterator xmin =
-      world->models_with_fiducials_byx.lower_bound(&edge); // O(log(n))
-
-  edge.pose = Pose(gp.x + rng, gp.y, 0, 0); // RIGHT
-  const std::set<Model *, World::ltx>::iterator xmax =
-      world->models_with_fiducials_byx.upper_bound(&edge);
+  if (!DeferUpdate())
+    Sense();
 
-  edge.pose = Pose(gp.x, gp.y - rng, 0, 0); // BOTTOM
-  std::set<Model *, World::lty>::iterator ymin =
-      world->models_with_fiducials_byy.lower_bound(&edge);
+  Model::Update();
+}
 
-  edge.pose = Pose(gp.x, gp.y + rng, 0, 0); // TOP
-  const std::set<Model *, World::lty>::iterator ymax =
-      world->models_with_fiducials_byy.upper_bound(&edge);
+void ModelFiducial::Sense(void)
+{
+  // in pipelined mode our callbacks may still be reading the last
+  // scan, so write into the back buffer
+  std::vector<Fiducial> &found(HasPipelinedCallbacks() ? fiducials_back : fiducials);
 
-  // put these models into sets keyed on model pointer, rather than position
-  std::set<Model *> horiz, vert;
+  // reset the array of detected fiducials
+  found.clear();
 
-  for (; xmin != xmax; ++xmin)
-    horiz.insert(*xmin);
+#if (1)
+  // BEGIN EXPERIMENT
 
-  for (; ymin != ymax; ++ymin)
-    vert.insert(*ymin);
+  // find the fiducial-bearing models in the grid cells within
+  // sensor range. AddModelIfVisible() checks the actual range.
+  const double rng = max_range_anon;
+  const Pose &gp(sense_pose);
 
-  // the intersection of the sets is all the fiducials close by
   std::vector<Model *> nearby;
-  std::set_intersection(horiz.begin(), horiz.end(), vert.begin(), vert.end(),
-                        std::inserter(nearby, nearby.end()));
+  world->fiducial_grid.Query(gp.x - rng, gp.y - rng, gp.x + rng, gp.y + rng, nearby);
+
+  // report them in an order that is the same in every run
+  if (world->IsDeterministic())
+    std::sort(nearby.begin(), nearby.end(), World::ltid());
 
   //	printf( "cand sz %lu\n", nearby.size() );
 
   // create sets sorted by x and y position
   FOR_EACH (it, nearby)
-    AddModelIfVisible(*it);
+    AddModelIfVisible(*it, found);
 #else
   FOR_EACH (it, world->models_with_fiducials)
-    AddModelIfVisible(*it);
+    AddModelIfVisible(*it, found);
 
 #endif
-
-  // find the range of fiducials within range in X
-
-  Model::Update();
 }
 
 void ModelFiducial::Load(void)
@@ -304,6 +296,10 @@ void ModelFiducial::Load(void)
   max_range_id = wf->ReadLength(wf_entity, "range_max_id", max_range_id);
   fov = wf->ReadAngle(wf_entity, "fov", fov);
   ignore_zloc = wf->ReadInt(wf_entity, "ignore_zloc", ignore_zloc);
+
+  world->FiducialRange(max_range_anon);
+
+  ShareScan(max_range_anon, wf->ReadInt(wf_entity, "shared_scan", 0), true, 0);
 }
 
 void ModelFiducial::DataVisualize(Camera *cam)
@@ -336,7 +332,8 @@ void ModelFiducial::DataVisualize(Camera *cam)
     glLineStipple(1, 0x00FF);
 
     // draw lines to the fiducials
-    FOR_EACH (it, fiducials) {
+    std::vector<Fiducial> &fids(GetFiducials());
+    FOR_EACH (it, fids) {
       Fiducial &fid = *it;
 
       double dx = fid.range * cos(fid.bearing);
@@ -369,9 +366,60 @@ void ModelFiducial::DataVisualize(Camera *cam)
   }
 }
 
+void ModelFiducial::SwapDataBuffers(void)
+{
+  fiducials.swap(fiducials_back);
+}
+
+static void save_fiducials(WorldSnapshot &snap, const std::vector<ModelFiducial::Fiducial> &fids)
+{
+  snap.Put(fids.size());
+  FOR_EACH (it, fids) {
+    snap.Put(it->range);
+    snap.Put(it->bearing);
+    snap.Put(it->geom);
+    snap.Put(it->pose);
+    snap.Put(it->mod);
+    snap.Put(it->id);
+  }
+}
+
+static void restore_fiducials(const WorldSnapshot &snap, size_t &pos,
+                              std::vector<ModelFiducial::Fiducial> &fids)
+{
+  size_t n(0);
+  snap.Get(pos, n);
+  fids.resize(n);
+  FOR_EACH (it, fids) {
+    snap.Get(pos, it->range);
+    snap.Get(pos, it->bearing);
+    snap.Get(pos, it->geom);
+    snap.Get(pos, it->pose);
+    snap.Get(pos, it->mod);
+    snap.Get(pos, it->id);
+  }
+}
+
+void ModelFiducial::SaveState(WorldSnapshot &snap) const
+{
+  Model::SaveState(snap);
+
+  save_fiducials(snap, fiducials);
+  save_fiducials(snap, fiducials_back);
+}
+
+void ModelFiducial::RestoreState(const WorldSnapshot &snap, size_t &pos)
+{
+  Model::RestoreState(snap, pos);
+
+  restore_fiducials(snap, pos, fiducials);
+  restore_fiducials(snap, pos, fiducials_back);
+}
+
 void ModelFiducial::Shutdown(void)
 {
   // PRINT_DEBUG( "fiducial shutdown" );
   fiducials.clear();
+  fiducials_back.clear();
   Model::Shutdown();
 }
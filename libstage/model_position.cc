@@ -115,11 +115,9 @@ ModelPosition::ModelPosition(World *world, Model *parent, const std::string &typ
       // private
       velocity(), goal(0, 0, 0, 0), control_mode(CONTROL_VELOCITY), drive_mode(DRIVE_DIFFERENTIAL),
       localization_mode(LOCALIZATION_GPS),
-      integration_error(drand48() * INTEGRATION_ERROR_MAX_X - INTEGRATION_ERROR_MAX_X / 2.0,
-                        drand48() * INTEGRATION_ERROR_MAX_Y - INTEGRATION_ERROR_MAX_Y / 2.0,
-                        drand48() * INTEGRATION_ERROR_MAX_Z - INTEGRATION_ERROR_MAX_Z / 2.0,
-                        drand48() * INTEGRATION_ERROR_MAX_A - INTEGRATION_ERROR_MAX_A / 2.0),
-      wheelbase(1.0), acceleration_bounds(), velocity_bounds(),
+      integration_error(),
+      wheelbase(1.0), contacts(), contacts_updates(), contact_subs(0), acceleration_bounds(),
+      velocity_bounds(),
       // public
       waypoints(), wpvis(), posevis()
 {
@@ -128,6 +126,14 @@ ModelPosition::ModelPosition(World *world, Model *parent, const std::string &typ
   // assert that Update() is reentrant for this derived model
   thread_safe = false;
 
+  // pick the odometry error from our own stream, so it depends only
+  // on the world's seed
+  Rng rng(GetRng(Rng::INTERNAL));
+  integration_error.x = rng.Uniform(-INTEGRATION_ERROR_MAX_X / 2.0, INTEGRATION_ERROR_MAX_X / 2.0);
+  integration_error.y = rng.Uniform(-INTEGRATION_ERROR_MAX_Y / 2.0, INTEGRATION_ERROR_MAX_Y / 2.0);
+  integration_error.z = rng.Uniform(-INTEGRATION_ERROR_MAX_Z / 2.0, INTEGRATION_ERROR_MAX_Z / 2.0);
+  integration_error.a = rng.Uniform(-INTEGRATION_ERROR_MAX_A / 2.0, INTEGRATION_ERROR_MAX_A / 2.0);
+
   // install sensible velocity and acceleration bounds
   for (int i = 0; i < 3; i++) {
     velocity_bounds[i].min = -1.0;
@@ -280,6 +286,39 @@ void ModelPosition::Load(void)
 }
 
 
+void ModelPosition::SaveState(WorldSnapshot &snap) const
+{
+  Model::SaveState(snap);
+
+  snap.Put(velocity);
+  snap.Put(goal);
+  snap.Put(control_mode);
+  snap.Put(drive_mode);
+  snap.Put(localization_mode);
+  snap.Put(integration_error);
+  snap.Put(est_pose);
+  snap.Put(est_pose_error);
+  snap.Put(est_origin);
+}
+
+void ModelPosition::RestoreState(const WorldSnapshot &snap, size_t &pos)
+{
+  Model::RestoreState(snap, pos);
+
+  snap.Get(pos, velocity);
+  snap.Get(pos, goal);
+  snap.Get(pos, control_mode);
+  snap.Get(pos, drive_mode);
+  snap.Get(pos, localization_mode);
+  snap.Get(pos, integration_error);
+  snap.Get(pos, est_pose);
+  snap.Get(pos, est_pose_error);
+  snap.Get(pos, est_origin);
+
+  // the contacts may be from updates that haven't happened yet
+  contacts_updates[0] = contacts_updates[1] = 0;
+}
+
 void ModelPosition::Update(void)
 {
   PRINT_DEBUG1("[%lu] position update", this->world->SimTimeNow());
@@ -544,6 +583,12 @@ void ModelPosition::Move(void)
   // stash the original pose so we can put things back if we hit
   const Pose startpose(pose);
 
+  // others may have bumped into us already in this update, and those
+  // contacts move with us
+  std::vector<Contact> *found(contact_subs ? &Contacts() : NULL);
+  const size_t bumped(found ? found->size() : 0);
+  const Pose start_gpose(bumped ? GetGlobalPose() : Pose());
+
   pose = newpose; // do the move provisionally - we might undo it below
 
   const unsigned int layer(world->UpdateCount() % 2);
@@ -551,20 +596,93 @@ void ModelPosition::Move(void)
   UnMapWithChildren(layer); // remove from all blocks
   MapWithChildren(layer); // render into new blocks
 
-  if (TestCollision()) // crunch!
+  // a full collision test also finds what we touch, for our
+  // subscribers, such as bumpers
+  Model *hitmod(found ? FindContacts(*found) : TestCollision());
+
+  if (hitmod) // crunch!
   {
+    const Pose hitpose(GetGlobalPose());
+
+    // tell whoever we hit where we did, if they want to know. They
+    // haven't moved, so the points are where they are now.
+    std::vector<Contact> hits;
+    if (found == NULL && ContactRecorder(hitmod))
+      FindContacts(hits);
+    const std::vector<Contact> &shared(found ? *found : hits);
+
+    for (size_t i(found ? bumped : 0); i < shared.size(); ++i) {
+      ModelPosition *recorder(ContactRecorder(shared[i].mod));
+      if (recorder)
+        recorder->Contacts().push_back(Contact(this, shared[i].point));
+    }
+
     // put things back the way they were
     // this is expensive, but it happens _very_ rarely for most people
     pose = startpose;
     UnMapWithChildren(layer);
     MapWithChildren(layer);
 
+    // carry the contacts we found back with us, so that they lie just
+    // inside our edge where we hit
+    if (found)
+      CarryContacts(*found, bumped, hitpose, GetGlobalPose());
+
     SetStall(true);
   } else {
+    if (bumped)
+      CarryContacts(*found, 0, start_gpose, GetGlobalPose());
+
     SetStall(false);
   }
 }
 
+std::vector<Contact> &ModelPosition::Contacts()
+{
+  const unsigned int layer(world->UpdateCount() % 2);
+
+  if (contacts_updates[layer] != world->UpdateCount() + 1) {
+    contacts[layer].clear();
+    contacts_updates[layer] = world->UpdateCount() + 1;
+  }
+
+  return contacts[layer];
+}
+
+void ModelPosition::CarryContacts(std::vector<Contact> &contacts, size_t first, const Pose &from,
+                                  const Pose &to)
+{
+  const double c(cos(to.a - from.a)), s(sin(to.a - from.a));
+
+  for (size_t i(first); i < contacts.size(); ++i) {
+    const double dx(contacts[i].point.x - from.x), dy(contacts[i].point.y - from.y);
+    contacts[i].point = point_t(to.x + c * dx - s * dy, to.y + s * dx + c * dy);
+  }
+}
+
+ModelPosition *ModelPosition::ContactRecorder(Model *mod)
+{
+  for (; mod; mod = mod->Parent()) {
+    ModelPosition *pos(dynamic_cast<ModelPosition *>(mod));
+    if (pos && pos->contact_subs)
+      return pos;
+  }
+
+  return NULL;
+}
+
+const std::vector<Contact> *ModelPosition::GetContacts() const
+{
+  // sensors see the layer that Move() wrote in the last update
+  const uint64_t updates(world->UpdateCount());
+  const unsigned int layer((updates + 1) % 2);
+
+  if (updates == 0 || contacts_updates[layer] != updates)
+    return NULL;
+
+  return &contacts[layer];
+}
+
 void ModelPosition::Startup(void)
 {
   world->active_velocity.insert(this);
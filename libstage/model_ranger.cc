@@ -35,6 +35,8 @@
    fov a
    range [min max]
    noise [range_const range_prop angular]
+   split_samples 1000
+   shared_scan 0
    )
 
    # generic model properties with non-default values
@@ -72,6 +74,16 @@
    angular noise in degrees
    - sview[\<transducer index\>] [float float float]
    - per-transducer version of the sview property. Overrides the common setting.
+   - split_samples int
+   - a sensor with at least this many samples is traced in chunks, which
+   the world's threads that are waiting for others trace at the same time.
+   The readings are the same either way. 0 never splits the sensor.
+   - shared_scan int
+   - if non-zero, the sensor's rays are looked up in a panoramic scan of
+   this many rays from the ranger's parent, traced once per update and
+   shared with the parent's other sensors that set shared_scan. Each
+   sample takes the nearest of the scan's rays, and is traced as usual if
+   the sensor is more than a cell from where the scan starts.
 
 */
 
@@ -86,6 +98,9 @@ using namespace Stg;
 static const watts_t RANGER_WATTSPERSENSOR = 0.2;
 static const Stg::Size RANGER_SIZE(0.15, 0.15, 0.2); // SICK LMS size
 
+// number of samples in each chunk of a split sensor
+static const size_t RANGER_SPLIT_CHUNK(128);
+
 // static const Color RANGER_COLOR( 0,0,1 );
 static const Color RANGER_CONFIG_COLOR(0, 0, 0.5);
 // static const Color RANGER_GEOM_COLOR( 1,0,1 );
@@ -141,6 +156,8 @@ void ModelRanger::LoadSensor(Worldfile *wf, int entity)
   Sensor s;
   s.Load(wf, entity);
   sensors.push_back(s);
+
+  ShareScan(s.range.max, s.shared_rays, true, s.pose.z + s.size.z / 2.0);
 }
 
 void ModelRanger::Sensor::Load(Worldfile *wf, int entity)
@@ -150,6 +167,8 @@ void ModelRanger::Sensor::Load(Worldfile *wf, int entity)
   range.Load(wf, entity, "range");
   fov = wf->ReadAngle(entity, "fov", fov);
   sample_count = wf->ReadInt(entity, "samples", sample_count);
+  split_samples = wf->ReadInt(entity, "split_samples", split_samples);
+  shared_rays = wf->ReadInt(entity, "shared_scan", shared_rays);
 
   wf->ReadTuple(entity, "noise", 0, 3, "lfa", &range_noise_const, &range_noise, &angle_noise);
   color.Load(wf, entity);
@@ -169,52 +188,129 @@ static bool ranger_match(Model *hit, const Model *finder, const void *dummy)
   return ((!hit->IsRelated(finder)) && (sgn(hit->vis.ranger_return) != -1));
 }
 
-// Returns random numbers in range [-1.0, 1.0)
-double simpleNoise()
+void ModelRanger::Update(void)
 {
-  return 2 * (rand() % 1000 * 0.001 - 0.5);
+  if (!DeferUpdate())
+    Sense();
+
+  Model::Update();
 }
 
-#define TWO_PI (M_PI + M_PI)
-// Returns gaussian noise
-// taken from http://en.wikipedia.org/wiki/Box%E2%80%93Muller_transform
-template <class Scalar_t> Scalar_t generateGaussianNoise(Scalar_t variance)
+void ModelRanger::Sense(void)
 {
-  static bool haveSpare = false;
-  static Scalar_t rand1, rand2;
+  // raytrace new range data for all sensors
+  FOR_EACH (it, sensors)
+    it->Update(this);
+}
 
-  if (haveSpare) {
-    haveSpare = false;
-    return sqrt(variance * rand1) * sin(rand2);
-  }
+void ModelRanger::SwapDataBuffers(void)
+{
+  FOR_EACH (it, sensors)
+    it->SwapBuffers();
+}
 
-  haveSpare = true;
+void ModelRanger::SaveState(WorldSnapshot &snap) const
+{
+  Model::SaveState(snap);
+
+  FOR_EACH (it, sensors) {
+    snap.PutVector(it->ranges);
+    snap.PutVector(it->intensities);
+    snap.PutVector(it->bearings);
+    snap.PutVector(it->ranges_back);
+    snap.PutVector(it->intensities_back);
+    snap.PutVector(it->bearings_back);
+  }
+}
 
-  rand1 = rand() / ((Scalar_t)RAND_MAX);
-  if (rand1 < 1e-100)
-    rand1 = 1e-100;
-  rand1 = -2 * log(rand1);
-  rand2 = (rand() / ((Scalar_t)RAND_MAX)) * TWO_PI;
+void ModelRanger::RestoreState(const WorldSnapshot &snap, size_t &pos)
+{
+  Model::RestoreState(snap, pos);
+
+  FOR_EACH (it, sensors) {
+    snap.GetVector(pos, it->ranges);
+    snap.GetVector(pos, it->intensities);
+    snap.GetVector(pos, it->bearings);
+    snap.GetVector(pos, it->ranges_back);
+    snap.GetVector(pos, it->intensities_back);
+    snap.GetVector(pos, it->bearings_back);
+  }
+}
 
-  return sqrt(variance * rand1) * cos(rand2);
+void ModelRanger::Sensor::SwapBuffers()
+{
+  ranges.swap(ranges_back);
+  intensities.swap(intensities_back);
+  bearings.swap(bearings_back);
 }
 
-void ModelRanger::Update(void)
+// a sensor's scan, which any thread can trace a range of samples of
+struct ranger_scan_t {
+  World *world;
+  SharedScan *shared; // the parent's scan, if the sensor uses it
+  Ray ray; // the first sample's ray
+  size_t samples;
+  size_t chunk; // samples per chunk, if split
+  std::vector<double> chunk_headings; // heading of each chunk's first ray
+  double start_angle;
+  double sample_incr;
+  const double *angle_noises; // NULL if there is no angular noise
+  meters_t *ranges;
+  double *intensities;
+  double *bearings;
+};
+
+static void trace_samples(const ranger_scan_t &scan, size_t first, size_t last, double heading)
 {
-  // raytrace new range data for all sensors
-  FOR_EACH (it, sensors)
-    it->Update(this);
+  Ray ray(scan.ray);
+  ray.origin.a = heading;
 
-  Model::Update();
+  // trace the ray, incrementing its heading for each sample
+  for (size_t t(first); t < last; t++) {
+    float savedAngle = ray.origin.a;
+    float distortedAngle = ray.origin.a;
+    if (scan.angle_noises)
+      distortedAngle += scan.angle_noises[t];
+    ray.origin.a = distortedAngle;
+    RaytraceResult res;
+    if (scan.shared == NULL || !scan.shared->Raytrace(ray, res))
+      res = scan.world->Raytrace(ray);
+    ray.origin.a = savedAngle;
+
+    scan.ranges[t] = res.range;
+    scan.intensities[t] = res.mod ? res.mod->vis.ranger_return : 0.0;
+    scan.bearings[t] = scan.start_angle + ((double)t) * scan.sample_incr;
+
+    // point the ray to the next angle:
+    ray.origin.a += scan.sample_incr;
+  }
+}
+
+static void trace_chunk(unsigned int chunk, void *arg)
+{
+  const ranger_scan_t &scan(*static_cast<ranger_scan_t *>(arg));
+  const size_t first(chunk * scan.chunk);
+  trace_samples(scan, first, std::min(first + scan.chunk, scan.samples),
+                scan.chunk_headings[chunk]);
 }
 
 void ModelRanger::Sensor::Update(ModelRanger *mod)
 {
+  // in pipelined mode our callbacks may still be reading the last
+  // scan, so write into the back buffers
+  const bool back(mod->HasPipelinedCallbacks());
+  std::vector<meters_t> &ranges(back ? ranges_back : this->ranges);
+  std::vector<double> &intensities(back ? intensities_back : this->intensities);
+  std::vector<double> &bearings(back ? bearings_back : this->bearings);
+
   // these sizes change very rarely, so this is very cheap
   ranges.resize(sample_count);
   intensities.resize(sample_count);
   bearings.resize(sample_count);
 
+  if (sample_count == 0)
+    return;
+
   // printf( "update sensor, has ranges size %u\n", (unsigned int)ranges.size()
   // );
   // make the first and last rays exactly at the extremes of the FOV
@@ -227,32 +323,73 @@ void ModelRanger::Sensor::Update(ModelRanger *mod)
   Pose rayorg(pose);
   rayorg.a += start_angle;
   rayorg.z += size.z / 2.0;
-  rayorg = mod->LocalToGlobal(rayorg);
+  rayorg = mod->SenseToGlobal(rayorg);
 
   // set up a ray to trace
   Ray ray(mod, rayorg, range.max, ranger_match, NULL, true);
 
-  // trace the ray, incrementing its heading for each sample
-  for (size_t t(0); t < sample_count; t++) {
-    float savedAngle = ray.origin.a;
-    float distortedAngle = ray.origin.a + sample_incr * angle_noise * simpleNoise() * 0.5;
-    ray.origin.a = distortedAngle;
-    const RaytraceResult res = mod->world->Raytrace(ray);
-    ray.origin.a = savedAngle;
+  // each sensor draws noise from its own stream, so the readings
+  // don't depend on which thread updates us. The whole scan's noise
+  // is drawn before tracing, an array for each kind that is turned
+  // on, and added to the ranges afterwards.
+  Rng rng(mod->GetRng(Rng::INTERNAL + (uint32_t)(this - &mod->sensors[0]), mod->sense_update));
 
-    /// Apply noise only if it is in valid range
-    if (res.range < this->range.max)
-      ranges[t] = res.range + res.range * range_noise * simpleNoise()
-                  + generateGaussianNoise(range_noise_const);
-    else
-      ranges[t] = res.range;
+  const size_t kinds((angle_noise != 0.0) + (range_noise != 0.0) + (range_noise_const != 0.0));
+  noise.resize(kinds * sample_count);
 
-    intensities[t] = res.mod ? res.mod->vis.ranger_return : 0.0;
-    bearings[t] = start_angle + ((double)t) * sample_incr;
+  double *angle_noises(noise.empty() ? NULL : &noise[0]);
+  double *range_noises(angle_noises + (angle_noise != 0.0) * sample_count);
+  double *const_noises(range_noises + (range_noise != 0.0) * sample_count);
 
-    // point the ray to the next angle:
-    ray.origin.a += sample_incr;
+  if (angle_noise != 0.0) {
+    const double spread(sample_incr * angle_noise * 0.5);
+    rng.Uniform(angle_noises, sample_count, -spread, spread);
   }
+  if (range_noise != 0.0)
+    rng.Uniform(range_noises, sample_count, -range_noise, range_noise);
+  if (range_noise_const != 0.0)
+    rng.Normal(const_noises, sample_count, sqrt(range_noise_const));
+
+  ranger_scan_t scan;
+  scan.world = mod->world;
+  scan.shared = (shared_rays ? mod->shared_scan : NULL);
+  scan.ray = ray;
+  scan.samples = sample_count;
+  scan.chunk = RANGER_SPLIT_CHUNK;
+  scan.start_angle = start_angle;
+  scan.sample_incr = sample_incr;
+  scan.angle_noises = (angle_noise != 0.0 ? angle_noises : NULL);
+  scan.ranges = &ranges[0];
+  scan.intensities = &intensities[0];
+  scan.bearings = &bearings[0];
+
+  if (split_samples == 0 || sample_count < split_samples)
+    trace_samples(scan, 0, sample_count, ray.origin.a);
+  else {
+    // each ray's heading is rounded to float before the next is
+    // found from it, so step through them all to find where each
+    // chunk starts, as tracing the whole scan would
+    double heading(ray.origin.a);
+    for (size_t t(0); t < sample_count; t++) {
+      if (t % scan.chunk == 0)
+        scan.chunk_headings.push_back(heading);
+      heading = (float)heading;
+      heading += sample_incr;
+    }
+
+    mod->world->ShareWork(trace_chunk, &scan, scan.chunk_headings.size());
+  }
+
+  /// Apply noise only if it is in valid range
+  if (range_noise != 0.0 || range_noise_const != 0.0)
+    for (size_t t(0); t < sample_count; t++)
+      if (ranges[t] < range.max) {
+        const meters_t r(ranges[t]);
+        if (range_noise != 0.0)
+          ranges[t] += r * range_noises[t];
+        if (range_noise_const != 0.0)
+          ranges[t] += const_noises[t];
+      }
 }
 
 std::string ModelRanger::Sensor::String() const
@@ -17,130 +17,308 @@
   @ingroup model
   @defgroup model_wifi Wifi model
 
-  @todo Fill this in
+  The wifi model simulates a radio that finds the other radios whose
+  signal it can receive, and how strong it is.
+
+API: Stg::ModelWifi
+
+<h2>Worldfile properties</h2>
+
+@par Summary and default values
+
+@verbatim
+wifi
+(
+  # wifi properties
+  tx_power 15
+  rx_sensitivity -85
+  frequency 2412
+  path_loss "log_distance"
+  exponent 3.0
+  ref_distance 1.0
+  wall_loss 5.0
+  range_max 0
+)
+@endverbatim
+
+@par Details
+
+- tx_power <float>\n
+  the transmit power, in dBm.
+- rx_sensitivity <float>\n
+  the weakest signal that is received, in dBm.
+- frequency <float>\n
+  the carrier frequency, in MHz.
+- path_loss <string>\n
+  how the signal weakens with distance: "free_space", by the Friis
+equation, or "log_distance", which follows free space out to
+ref_distance and falls off with the given exponent beyond it.
+- exponent <float>\n
+  the path loss exponent of the log-distance model: 2 is free space,
+around 3 suits an office, and up to 6 a cluttered building.
+- ref_distance <float>\n
+  the range in meters beyond which the log-distance model applies.
+- wall_loss <float>\n
+  the attenuation in dB of each wall between two radios. Walls are
+runs of cells holding obstacles that no position model carries. See
+the world option wifi_wall_cache.
+- range_max <float>\n
+  if non-zero, the longest link in meters, however strong the signal.
+
+A radio is on while the model is subscribed. Each update, it lists a
+link to each other radio that is on and whose signal it receives at
+rx_sensitivity or above, that is, whose tx_power less the path loss
+and the loss through walls is at least that. Neighbours are looked up
+in a grid of the radios, so only those within radio range are tested,
+and the walls are only counted for them.
+ */
 
-  <h2>Worldfile properties</h2>
+#include "option.hh"
+#include "stage.hh"
+#include "worldfile.hh"
+using namespace Stg;
 
-  @todo Fill this in
+#include <math.h>
 
- */
+static const watts_t WIFI_WATTS = 2.5; // wifi power consumption
 
-#include "gui.h"
-#include <sys/time.h>
+Option ModelWifi::showLinks("Wifi links", "show_wifi", "", true, NULL);
 
-// Number pulled directly from my ass
-#define STG_WIFI_WATTS 2.5
+ModelWifi::ModelWifi(World *world, Model *parent, const std::string &type)
+    : Model(world, parent, type), links(), links_back(), tx_power(15.0), rx_sensitivity(-85.0),
+      frequency(2412.0), path_loss(PATHLOSS_LOG_DISTANCE), exponent(3.0), ref_distance(1.0),
+      wall_loss(5.0), range_max(0)
+{
+  PRINT_DEBUG2("Constructing ModelWifi %u (%s)\n", id, type.c_str());
 
-//#define DEBUG
+  // assert that Update() is reentrant for this derived model
+  thread_safe = true;
 
-#include "stage_internal.h"
+  // wifi doesn't take up any physical space
+  this->ClearBlocks();
 
-// defined in model.c
-int _model_update(model_t *mod, void *unused);
+  Geom geom;
+  geom.Zero();
+  SetGeom(geom);
 
-// standard callbacks
-extern "C" {
+  RegisterOption(&showLinks);
+}
 
-// declare functions used as callbacks
-static int wifi_update(model_t *mod, void *unused);
-static int wifi_startup(model_t *mod, void *unused);
-static int wifi_shutdown(model_t *mod, void *unused);
-static int wifi_load(model_t *mod, void *unused);
+ModelWifi::~ModelWifi(void)
+{
+}
 
-// implented by the gui in some other file
-void gui_wifi_init(model_t *mod);
+// the free space path loss in dB at range meters and frequency MHz
+static double free_space_loss(meters_t range, double frequency)
+{
+  return 20.0 * log10(range) + 20.0 * log10(frequency) - 27.55;
+}
 
-int wifi_init(model_t *mod)
+double ModelWifi::PathLossAt(meters_t range) const
 {
-  // we don't consume any power until subscribed
-  mod->watts = 0.0;
+  // the far field starts about a wavelength out
+  range = std::max(range, 300.0 / frequency);
 
-  // override the default methods; these will be called by the simualtion
-  // engine
-  model_add_callback(mod, &mod->startup, wifi_startup, NULL);
-  model_add_callback(mod, &mod->shutdown, wifi_shutdown, NULL);
-  model_add_callback(mod, &mod->load, wifi_load, NULL);
+  if (path_loss == PATHLOSS_FREE_SPACE || range <= ref_distance)
+    return free_space_loss(range, frequency);
 
-  // sensible wifi defaults; it doesn't take up any physical space
-  Geom geom;
-  geom.pose.x = 0.0;
-  geom.pose.y = 0.0;
-  geom.pose.a = 0.0;
-  geom.size.x = 0.0;
-  geom.size.y = 0.0;
-  model_set_geom(mod, &geom);
+  return free_space_loss(ref_distance, frequency) + 10.0 * exponent * log10(range / ref_distance);
+}
 
-  // wifi is invisible
-  model_set_obstacle_return(mod, 0);
-  model_set_laser_return(mod, LaserTransparent);
-  model_set_blob_return(mod, 0);
-  model_set_color(mod, (color_t)0);
+meters_t ModelWifi::RangeForLoss(double loss) const
+{
+  const meters_t range(pow(10.0, (loss - free_space_loss(1.0, frequency)) / 20.0));
 
-  gui_wifi_init(mod);
+  if (path_loss == PATHLOSS_FREE_SPACE || range <= ref_distance)
+    return range;
 
-  return 0;
+  return ref_distance
+         * pow(10.0, (loss - free_space_loss(ref_distance, frequency)) / (10.0 * exponent));
 }
 
-int wifi_update(model_t *mod, void *unused)
+void ModelWifi::Load(void)
 {
-  // no work to do if we're unsubscribed
-  if (mod->subs < 1)
-    return 0;
+  Model::Load();
+
+  tx_power = wf->ReadFloat(wf_entity, "tx_power", tx_power);
+  rx_sensitivity = wf->ReadFloat(wf_entity, "rx_sensitivity", rx_sensitivity);
+  frequency = wf->ReadFloat(wf_entity, "frequency", frequency);
+
+  if (wf->PropertyExists(wf_entity, "path_loss")) {
+    const std::string &model_str = wf->ReadString(wf_entity, "path_loss", "log_distance");
+
+    if (model_str == "free_space")
+      path_loss = PATHLOSS_FREE_SPACE;
+    else if (model_str == "log_distance")
+      path_loss = PATHLOSS_LOG_DISTANCE;
+    else
+      PRINT_ERR1("invalid wifi path loss model specified: \"%s\" - should be "
+                 "one of: \"free_space\" or \"log_distance\". Using \"log_distance\" as "
+                 "default.",
+                 model_str.c_str());
+  }
+
+  exponent = wf->ReadFloat(wf_entity, "exponent", exponent);
+  ref_distance = wf->ReadLength(wf_entity, "ref_distance", ref_distance);
+  wall_loss = wf->ReadFloat(wf_entity, "wall_loss", wall_loss);
+  range_max = wf->ReadLength(wf_entity, "range_max", range_max);
+}
 
-  puts("wifi_update");
+void ModelWifi::Startup(void)
+{
+  Model::Startup();
 
-  // Retrieve current configuration
-  wifi_config_t cfg;
-  memcpy(&cfg, mod->cfg, sizeof(cfg));
+  PRINT_DEBUG("wifi startup");
 
-  // Retrieve current geometry
-  Geom geom;
-  model_get_geom(mod, &geom);
+  this->SetWatts(WIFI_WATTS);
 
-  // get the sensor's pose in global coords
-  Pose pz;
-  memcpy(&pz, &geom.pose, sizeof(pz));
-  model_local_to_global(mod, &pz);
+  // the range at which a radio like us hears us
+  meters_t range(RangeForLoss(tx_power - rx_sensitivity));
+  if (range_max > 0)
+    range = std::min(range, range_max);
 
-  // We'll store current data here
-  wifi_data_t data;
+  // switch the radio on
+  world->WifiRange(range, tx_power);
+  world->wifi_grid.Insert(this);
+}
 
-  // DO RADIO PROPAGATION HERE, and fill in the data structure
+void ModelWifi::Shutdown(void)
+{
+  PRINT_DEBUG("wifi shutdown");
 
-  // publish the new stuff
-  model_set_data(mod, &data, sizeof(data));
+  world->wifi_grid.Remove(this);
 
-  // inherit standard update behaviour
-  _model_update(mod, NULL);
+  this->SetWatts(0);
 
-  return 0; // ok
+  links.clear();
+  links_back.clear();
+
+  Model::Shutdown();
 }
 
-int wifi_startup(model_t *mod, void *unused)
+void ModelWifi::Update(void)
 {
-  PRINT_DEBUG("wifi startup");
-  model_add_callback(mod, &mod->startup, wifi_startup, NULL);
-  model_set_watts(mod, STG_WIFI_WATTS);
-  return 0; // ok
+  if (subs < 1)
+    return;
+
+  if (!DeferUpdate())
+    Sense();
+
+  Model::Update();
 }
 
-int wifi_shutdown(model_t *mod, void *unused)
+void ModelWifi::Sense(void)
 {
-  PRINT_DEBUG("wifi shutdown");
-  model_remove_callback(mod, &mod->startup, wifi_startup);
-  model_set_watts(mod, 0);
-  return 0; // ok
+  // in pipelined mode our callbacks may still be reading the last
+  // links, so write into the back buffer
+  std::vector<Link> &found(HasPipelinedCallbacks() ? links_back : links);
+
+  found.clear();
+
+  // no radio is loud enough to be heard from further away than this
+  meters_t range(RangeForLoss(world->wifi_power_max - rx_sensitivity));
+  if (range_max > 0)
+    range = std::min(range, range_max);
+
+  const Pose &gp(sense_pose);
+
+  std::vector<Model *> nearby;
+  world->wifi_grid.Query(gp.x - range, gp.y - range, gp.x + range, gp.y + range, nearby);
+
+  // report them in an order that is the same in every run
+  std::sort(nearby.begin(), nearby.end(), World::ltid());
+
+  FOR_EACH (it, nearby) {
+    ModelWifi *peer(static_cast<ModelWifi *>(*it));
+    if (peer == this)
+      continue;
+
+    const Pose pp(peer->GetGlobalPose());
+    const meters_t dist(hypot(pp.x - gp.x, pp.y - gp.y));
+    if (dist > range)
+      continue;
+
+    // the signal through free air, which walls only weaken, so we
+    // count them only if it is strong enough
+    const double rssi(peer->tx_power - PathLossAt(dist));
+    if (rssi < rx_sensitivity)
+      continue;
+
+    Link link;
+    link.peer = peer;
+    link.range = dist;
+    link.walls = wall_loss > 0 ? world->WifiWalls(point_t(gp.x, gp.y), point_t(pp.x, pp.y)) : 0;
+    link.rssi = rssi - link.walls * wall_loss;
+
+    if (link.rssi >= rx_sensitivity)
+      found.push_back(link);
+  }
+}
+
+void ModelWifi::DataVisualize(Camera *cam)
+{
+  (void)cam; // avoid warning about unused var
+
+  if (!showLinks)
+    return;
+
+  PushColor(0, 0.5, 1, 0.4); // light blue, with a bit of alpha
+
+  // draw lines to the radios we hear
+  std::vector<Link> &found(GetLinks());
+  glBegin(GL_LINES);
+  FOR_EACH (it, found) {
+    const Pose lp(GlobalToLocal(it->peer->GetGlobalPose()));
+    glVertex2f(0, 0);
+    glVertex2f(lp.x, lp.y);
+  }
+  glEnd();
+
+  PopColor();
 }
 
-int wifi_load(model_t *mod, void *unused)
+void ModelWifi::SwapDataBuffers(void)
 {
-  wifi_config_t cfg;
+  links.swap(links_back);
+}
 
-  // TODO: read wifi params from the world file
+static void save_links(WorldSnapshot &snap, const std::vector<ModelWifi::Link> &links)
+{
+  snap.Put(links.size());
+  FOR_EACH (it, links) {
+    snap.Put(it->peer);
+    snap.Put(it->range);
+    snap.Put(it->walls);
+    snap.Put(it->rssi);
+  }
+}
+
+static void restore_links(const WorldSnapshot &snap, size_t &pos,
+                          std::vector<ModelWifi::Link> &links)
+{
+  size_t n(0);
+  snap.Get(pos, n);
+  links.resize(n);
+  FOR_EACH (it, links) {
+    snap.Get(pos, it->peer);
+    snap.Get(pos, it->range);
+    snap.Get(pos, it->walls);
+    snap.Get(pos, it->rssi);
+  }
+}
 
-  model_set_cfg(mod, &cfg, sizeof(cfg));
+void ModelWifi::SaveState(WorldSnapshot &snap) const
+{
+  Model::SaveState(snap);
 
-  return 0;
+  save_links(snap, links);
+  save_links(snap, links_back);
 }
 
-} // ends extern "C"
+void ModelWifi::RestoreState(const WorldSnapshot &snap, size_t &pos)
+{
+  Model::RestoreState(snap, pos);
+
+  restore_links(snap, pos, links);
+  restore_links(snap, pos, links_back);
+}
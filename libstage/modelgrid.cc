@@ -0,0 +1,487 @@
+/*
+  modelgrid.cc
+  sparse uniform grid of models by position or footprint, for finding
+  nearby models.
+*/
+
+#include "stage.hh"
+using namespace Stg;
+
+// models whose footprints cover more cells than this along either
+// axis are kept in the large list rather than in each of their cells
+static const int SPAN_MAX(4);
+
+ModelGrid::ModelGrid(meters_t cell_size, bool footprints)
+    : cell_size(cell_size), footprints(footprints), cells(), large(), where(), placed(0)
+{
+}
+
+point_int_t ModelGrid::CellOf(meters_t x, meters_t y) const
+{
+  return point_int_t((int)floor(x / cell_size), (int)floor(y / cell_size));
+}
+
+ModelGrid::Span ModelGrid::SpanOf(const Model *mod) const
+{
+  const Pose gp(mod->GetGlobalPose());
+  Span span;
+
+  if (!footprints) {
+    span.lo = span.hi = CellOf(gp.x, gp.y);
+    return span;
+  }
+
+  // the bounding box of the rotated rectangle of the model's geom
+  const Geom &geom(mod->GetGeom());
+  const Pose center(gp + geom.pose);
+  const double c(fabs(cos(center.a))), s(fabs(sin(center.a)));
+  const meters_t hx((c * geom.size.x + s * geom.size.y) / 2.0);
+  const meters_t hy((s * geom.size.x + c * geom.size.y) / 2.0);
+
+  span.lo = CellOf(center.x - hx, center.y - hy);
+  span.hi = CellOf(center.x + hx, center.y + hy);
+  span.large = span.hi.x - span.lo.x >= SPAN_MAX || span.hi.y - span.lo.y >= SPAN_MAX;
+  return span;
+}
+
+void ModelGrid::Place(Model *mod, const Span &span)
+{
+  if (span.large) {
+    large.push_back(mod);
+    return;
+  }
+
+  for (int x(span.lo.x); x <= span.hi.x; ++x)
+    for (int y(span.lo.y); y <= span.hi.y; ++y)
+      cells[point_int_t(x, y)].push_back(Entry(mod, span.lo));
+}
+
+void ModelGrid::Unplace(Model *mod, const Span &span)
+{
+  if (span.large) {
+    EraseAll(mod, large);
+    return;
+  }
+
+  for (int x(span.lo.x); x <= span.hi.x; ++x)
+    for (int y(span.lo.y); y <= span.hi.y; ++y) {
+      std::map<point_int_t, std::vector<Entry> >::iterator cit(cells.find(point_int_t(x, y)));
+      std::vector<Entry> &entries(cit->second);
+
+      for (size_t i(0); i < entries.size(); ++i)
+        if (entries[i].mod == mod) {
+          entries[i] = entries.back();
+          entries.pop_back();
+          break;
+        }
+
+      if (entries.empty())
+        cells.erase(cit);
+    }
+}
+
+void ModelGrid::Insert(Model *mod)
+{
+  if (where.find(mod) == where.end())
+    where[mod] = Span();
+}
+
+void ModelGrid::Remove(Model *mod)
+{
+  std::map<Model *, Span>::iterator it(where.find(mod));
+  if (it == where.end())
+    return;
+
+  if (!(it->second == Span()))
+    --placed;
+  Unplace(mod, it->second);
+  where.erase(it);
+}
+
+void ModelGrid::Refresh()
+{
+  FOR_EACH (it, where) {
+    const Span span(SpanOf(it->first));
+
+    if (span == it->second)
+      continue;
+
+    if (it->second == Span())
+      ++placed;
+    Unplace(it->first, it->second);
+    Place(it->first, span);
+    it->second = span;
+  }
+}
+
+bool ModelGrid::Visit(meters_t xmin, meters_t ymin, meters_t xmax, meters_t ymax,
+                      visitor_t func, void *arg) const
+{
+  FOR_EACH (it, large)
+    if ((*func)(*it, arg))
+      return true;
+
+  const point_int_t lo(CellOf(xmin, ymin)), hi(CellOf(xmax, ymax));
+
+  // with a box much larger than the cells, it is faster to look at
+  // every non-empty cell than to look up every cell in the box
+  const double area((hi.x - lo.x + 1.0) * (hi.y - lo.y + 1.0));
+
+  if (area > cells.size()) {
+    FOR_EACH (it, cells) {
+      const point_int_t &cell(it->first);
+      if (cell.x < lo.x || cell.x > hi.x || cell.y < lo.y || cell.y > hi.y)
+        continue;
+
+      // report a model only from the first of its cells in the box
+      FOR_EACH (eit, it->second)
+        if (cell.x == std::max(eit->lo.x, lo.x) && cell.y == std::max(eit->lo.y, lo.y)
+            && (*func)(eit->mod, arg))
+          return true;
+    }
+    return false;
+  }
+
+  for (int x(lo.x); x <= hi.x; ++x)
+    for (int y(lo.y); y <= hi.y; ++y) {
+      std::map<point_int_t, std::vector<Entry> >::const_iterator it(
+          cells.find(point_int_t(x, y)));
+      if (it == cells.end())
+        continue;
+
+      FOR_EACH (eit, it->second)
+        if (x == std::max(eit->lo.x, lo.x) && y == std::max(eit->lo.y, lo.y)
+            && (*func)(eit->mod, arg))
+          return true;
+    }
+
+  return false;
+}
+
+bool ModelGrid::VisitAll(visitor_t func, void *arg) const
+{
+  FOR_EACH (it, large)
+    if ((*func)(*it, arg))
+      return true;
+
+  FOR_EACH (it, cells)
+    FOR_EACH (eit, it->second)
+      if (it->first == eit->lo && (*func)(eit->mod, arg))
+        return true;
+
+  return false;
+}
+
+static bool append_model(Model *mod, void *arg)
+{
+  static_cast<std::vector<Model *> *>(arg)->push_back(mod);
+  return false;
+}
+
+void ModelGrid::Query(meters_t xmin, meters_t ymin, meters_t xmax, meters_t ymax,
+                      std::vector<Model *> &out) const
+{
+  Visit(xmin, ymin, xmax, ymax, append_model, &out);
+}
+
+void ModelGrid::SetCellSize(meters_t size)
+{
+  if (size <= 0 || size == cell_size)
+    return;
+
+  cell_size = size;
+  cells.clear();
+  large.clear();
+  placed = 0;
+
+  FOR_EACH (it, where)
+    it->second = Span();
+}
+
+// spatial queries over the world's model grid
+
+void World::RefreshModelGrid() const
+{
+  if (__atomic_load_n(&model_grid_updates, __ATOMIC_ACQUIRE) == updates + 1)
+    return;
+
+  pthread_mutex_lock(&model_grid_mutex);
+  if (model_grid_updates != updates + 1) {
+    __atomic_store_n(&model_grid_queried, true, __ATOMIC_RELAXED);
+    model_grid.Refresh();
+    __atomic_store_n(&model_grid_updates, updates + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&model_grid_mutex);
+}
+
+// the rectangle of a model's geom in global coordinates
+class Footprint {
+public:
+  point_t center;
+  double c, s;
+  meters_t hx, hy;
+
+  explicit Footprint(const Model *mod)
+  {
+    const Geom &geom(mod->GetGeom());
+    const Pose p(mod->GetGlobalPose() + geom.pose);
+    center = point_t(p.x, p.y);
+    c = cos(p.a);
+    s = sin(p.a);
+    hx = geom.size.x / 2.0;
+    hy = geom.size.y / 2.0;
+  }
+
+  // the point in the rectangle's frame
+  point_t Local(const point_t &pt) const
+  {
+    const double dx(pt.x - center.x), dy(pt.y - center.y);
+    return point_t(c * dx + s * dy, -s * dx + c * dy);
+  }
+
+  meters_t Distance(const point_t &pt) const
+  {
+    const point_t l(Local(pt));
+    return hypot(std::max(fabs(l.x) - hx, 0.0), std::max(fabs(l.y) - hy, 0.0));
+  }
+
+  bool Contains(const point_t &pt) const
+  {
+    const point_t l(Local(pt));
+    return fabs(l.x) <= hx && fabs(l.y) <= hy;
+  }
+
+  // corners in order around the rectangle
+  point_t Corner(int i) const
+  {
+    const double lx((i == 0 || i == 3) ? -hx : hx);
+    const double ly(i < 2 ? -hy : hy);
+    return point_t(center.x + c * lx - s * ly, center.y + s * lx + c * ly);
+  }
+};
+
+// add mod to out, kept in order of ID with at most max entries, so
+// that the ones kept do not depend on the order they were found in
+static void insert_by_id(Model *mod, Model **out, size_t count, size_t max)
+{
+  size_t i(std::min(count, max));
+  if (i == max && (max == 0 || out[max - 1]->GetId() < mod->GetId()))
+    return;
+  if (i == max)
+    --i;
+  for (; i > 0 && out[i - 1]->GetId() > mod->GetId(); --i)
+    out[i] = out[i - 1];
+  out[i] = mod;
+}
+
+class RadiusQuery {
+public:
+  point_t pt;
+  meters_t range;
+  Model **out;
+  size_t max, count;
+  model_filter_t filter;
+  const void *arg;
+};
+
+static bool visit_radius(Model *mod, void *arg)
+{
+  RadiusQuery *q(static_cast<RadiusQuery *>(arg));
+  if (Footprint(mod).Distance(q->pt) > q->range)
+    return false;
+  if (q->filter && !(*q->filter)(mod, q->arg))
+    return false;
+  insert_by_id(mod, q->out, q->count++, q->max);
+  return false;
+}
+
+size_t World::ModelsInRadius(const point_t &pt, meters_t range, Model **out, size_t max,
+                             model_filter_t filter, const void *arg) const
+{
+  RefreshModelGrid();
+
+  RadiusQuery q;
+  q.pt = pt;
+  q.range = range;
+  q.out = out;
+  q.max = max;
+  q.count = 0;
+  q.filter = filter;
+  q.arg = arg;
+
+  model_grid.Visit(pt.x - range, pt.y - range, pt.x + range, pt.y + range, visit_radius, &q);
+  return q.count;
+}
+
+class NearestQuery {
+public:
+  point_t pt;
+  size_t k, count, seen;
+  Model **out;
+  meters_t *ranges;
+  model_filter_t filter;
+  const void *arg;
+};
+
+static bool visit_nearest(Model *mod, void *arg)
+{
+  NearestQuery *q(static_cast<NearestQuery *>(arg));
+  ++q->seen;
+
+  if (q->filter && !(*q->filter)(mod, q->arg))
+    return false;
+
+  // insert into the k nearest so far, ties going to the lower ID
+  const meters_t r(Footprint(mod).Distance(q->pt));
+  size_t i(q->count);
+  if (i == q->k) {
+    if (q->k == 0 || r > q->ranges[i - 1]
+        || (r == q->ranges[i - 1] && q->out[i - 1]->GetId() < mod->GetId()))
+      return false;
+    --i;
+  } else
+    ++q->count;
+
+  for (; i > 0
+         && (q->ranges[i - 1] > r
+             || (q->ranges[i - 1] == r && q->out[i - 1]->GetId() > mod->GetId()));
+       --i) {
+    q->out[i] = q->out[i - 1];
+    q->ranges[i] = q->ranges[i - 1];
+  }
+  q->out[i] = mod;
+  q->ranges[i] = r;
+  return false;
+}
+
+size_t World::NearestModels(const point_t &pt, size_t k, Model **out, meters_t *ranges,
+                            model_filter_t filter, const void *arg) const
+{
+  RefreshModelGrid();
+
+  // somewhere to keep the distances if the caller doesn't want them
+  meters_t local[64];
+  std::vector<meters_t> heap;
+  if (!ranges) {
+    if (k > 64) {
+      heap.resize(k);
+      ranges = &heap[0];
+    } else
+      ranges = local;
+  }
+
+  NearestQuery q;
+  q.pt = pt;
+  q.k = k;
+  q.out = out;
+  q.ranges = ranges;
+  q.filter = filter;
+  q.arg = arg;
+
+  // search ever larger squares until they hold the k nearest. Every
+  // model within r of the point is in the square, so the results are
+  // final once the kth is within r, or the square holds every model
+  // placed in the grid. Models added since the last refresh are in no
+  // cell, so they can't be counted on to turn up.
+  const size_t total(model_grid.Placed());
+  for (meters_t r(model_grid.GetCellSize());; r *= 2.0) {
+    q.count = q.seen = 0;
+    model_grid.Visit(pt.x - r, pt.y - r, pt.x + r, pt.y + r, visit_nearest, &q);
+
+    if ((q.count == k && (k == 0 || ranges[k - 1] <= r)) || q.seen >= total)
+      return q.count;
+  }
+}
+
+class PolygonQuery {
+public:
+  const point_t *pts;
+  size_t n;
+  Model **out;
+  size_t max, count;
+  model_filter_t filter;
+  const void *arg;
+};
+
+// even-odd rule
+static bool polygon_contains(const point_t *pts, size_t n, const point_t &pt)
+{
+  bool inside(false);
+  for (size_t i(0), j(n - 1); i < n; j = i++)
+    if ((pts[i].y > pt.y) != (pts[j].y > pt.y)
+        && pt.x < (pts[j].x - pts[i].x) * (pt.y - pts[i].y) / (pts[j].y - pts[i].y) + pts[i].x)
+      inside = !inside;
+  return inside;
+}
+
+static double cross(const point_t &o, const point_t &a, const point_t &b)
+{
+  return (a.x - o.x) * (b.y - o.y) - (a.y - o.y) * (b.x - o.x);
+}
+
+static bool segments_cross(const point_t &a, const point_t &b, const point_t &c, const point_t &d)
+{
+  const double d1(cross(c, d, a)), d2(cross(c, d, b)), d3(cross(a, b, c)), d4(cross(a, b, d));
+  return ((d1 > 0) != (d2 > 0)) && ((d3 > 0) != (d4 > 0));
+}
+
+static bool polygon_overlaps(const point_t *pts, size_t n, const Footprint &fp)
+{
+  point_t corners[4];
+  for (int i(0); i < 4; ++i) {
+    corners[i] = fp.Corner(i);
+    if (polygon_contains(pts, n, corners[i]))
+      return true;
+  }
+
+  for (size_t i(0); i < n; ++i)
+    if (fp.Contains(pts[i]))
+      return true;
+
+  for (size_t i(0), j(n - 1); i < n; j = i++)
+    for (int c(0); c < 4; ++c)
+      if (segments_cross(pts[j], pts[i], corners[c], corners[(c + 1) % 4]))
+        return true;
+
+  return false;
+}
+
+static bool visit_polygon(Model *mod, void *arg)
+{
+  PolygonQuery *q(static_cast<PolygonQuery *>(arg));
+  if (!polygon_overlaps(q->pts, q->n, Footprint(mod)))
+    return false;
+  if (q->filter && !(*q->filter)(mod, q->arg))
+    return false;
+  insert_by_id(mod, q->out, q->count++, q->max);
+  return false;
+}
+
+size_t World::ModelsInPolygon(const point_t *pts, size_t n, Model **out, size_t max,
+                              model_filter_t filter, const void *arg) const
+{
+  if (n < 3)
+    return 0;
+
+  RefreshModelGrid();
+
+  point_t lo(pts[0]), hi(pts[0]);
+  for (size_t i(1); i < n; ++i) {
+    lo.x = std::min(lo.x, pts[i].x);
+    lo.y = std::min(lo.y, pts[i].y);
+    hi.x = std::max(hi.x, pts[i].x);
+    hi.y = std::max(hi.y, pts[i].y);
+  }
+
+  PolygonQuery q;
+  q.pts = pts;
+  q.n = n;
+  q.out = out;
+  q.max = max;
+  q.count = 0;
+  q.filter = filter;
+  q.arg = arg;
+
+  model_grid.Visit(lo.x, lo.y, hi.x, hi.y, visit_polygon, &q);
+  return q.count;
+}
@@ -14,6 +14,17 @@ joules_t PowerPack::global_input = 0.0;
 joules_t PowerPack::global_capacity = 0.0;
 joules_t PowerPack::global_dissipated = 0.0;
 
+// add to one of the global totals, which packs in worlds updated in
+// parallel share
+static void add_global(joules_t &total, joules_t amount)
+{
+  joules_t old, sum;
+  __atomic_load(&total, &old, __ATOMIC_RELAXED);
+  do
+    sum = old + amount;
+  while (!__atomic_compare_exchange(&total, &old, &sum, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
 PowerPack::PowerPack(Model *mod)
     : event_vis(2.0 * std::max(fabs(ceil(mod->GetWorld()->GetExtent().x.max)),
                                fabs(floor(mod->GetWorld()->GetExtent().x.min))),
@@ -25,7 +36,7 @@ PowerPack::PowerPack(Model *mod)
       stored_vis(0, 142, 200, 40, 1200, Color(0, 1, 0), Color(0, 0, 0, 0.5), "energy stored",
                  "energy_stored"),
       mod(mod), stored(0.0), capacity(0.0), charging(false), dissipated(0.0), last_time(0),
-      last_joules(0.0), last_watts(0.0)
+      last_joules(0.0), last_watts(0.0), owed_stored(0.0), owed_input(0.0), owed_dissipated(0.0)
 {
   // tell the world about this new pp
   mod->world->AddPowerPack(this);
@@ -154,7 +165,7 @@ void PowerPack::Add(joules_t j)
 {
   joules_t amount = std::min(RemainingCapacity(), j);
   stored += amount;
-  global_stored += amount;
+  add_global(global_stored, amount);
 
   if (amount > 0)
     charging = true;
@@ -164,14 +175,14 @@ void PowerPack::Subtract(joules_t j)
 {
   if (stored < 0) // infinte supply!
   {
-    global_input += j; // record energy entering the system
+    add_global(global_input, j); // record energy entering the system
     return;
   }
 
   joules_t amount = std::min(stored, j);
 
   stored -= amount;
-  global_stored -= amount;
+  add_global(global_stored, -amount);
 }
 
 void PowerPack::TransferTo(PowerPack *dest, joules_t amount)
@@ -198,14 +209,14 @@ void PowerPack::TransferTo(PowerPack *dest, joules_t amount)
 
 void PowerPack::SetCapacity(joules_t cap)
 {
-  global_capacity -= capacity;
+  add_global(global_capacity, -capacity);
   capacity = cap;
-  global_capacity += capacity;
+  add_global(global_capacity, capacity);
 
   if (stored > cap) {
-    global_stored -= stored;
+    add_global(global_stored, -stored);
     stored = cap;
-    global_stored += stored;
+    add_global(global_stored, stored);
   }
 }
 
@@ -226,9 +237,9 @@ joules_t PowerPack::GetDissipated() const
 
 void PowerPack::SetStored(joules_t j)
 {
-  global_stored -= stored;
+  add_global(global_stored, -stored);
   stored = j;
-  global_stored += stored;
+  add_global(global_stored, stored);
 }
 
 void PowerPack::Dissipate(joules_t j)
@@ -237,7 +248,7 @@ void PowerPack::Dissipate(joules_t j)
 
   Subtract(amount);
   dissipated += amount;
-  global_dissipated += amount;
+  add_global(global_dissipated, amount);
 
   output_vis.AppendValue(amount);
   stored_vis.AppendValue(stored);
@@ -249,6 +260,70 @@ void PowerPack::Dissipate(joules_t j, const Pose &p)
   event_vis.Accumulate(p.x, p.y, j);
 }
 
+void PowerPack::DissipateLocal(joules_t j, const Pose &p)
+{
+  // as Dissipate(), but touching only this pack
+  joules_t amount = (stored < 0) ? j : std::min(stored, j);
+
+  if (stored < 0) // infinite supply!
+    owed_input += amount;
+  else {
+    stored -= amount;
+    owed_stored -= amount;
+  }
+
+  dissipated += amount;
+  owed_dissipated += amount;
+
+  output_vis.AppendValue(amount);
+  stored_vis.AppendValue(stored);
+
+  event_vis.Accumulate(p.x, p.y, j);
+}
+
+void PowerPack::CommitGlobals()
+{
+  add_global(global_stored, owed_stored);
+  add_global(global_input, owed_input);
+  add_global(global_dissipated, owed_dissipated);
+
+  owed_stored = owed_input = owed_dissipated = 0.0;
+}
+
+void PowerPack::SaveState(WorldSnapshot &snap) const
+{
+  snap.Put(stored);
+  snap.Put(capacity);
+  snap.Put(charging);
+  snap.Put(dissipated);
+  snap.Put(last_time);
+  snap.Put(last_joules);
+  snap.Put(last_watts);
+}
+
+void PowerPack::RestoreState(const WorldSnapshot &snap, size_t &pos)
+{
+  joules_t j;
+
+  snap.Get(pos, j);
+  add_global(global_stored, j - stored);
+  stored = j;
+
+  snap.Get(pos, j);
+  add_global(global_capacity, j - capacity);
+  capacity = j;
+
+  snap.Get(pos, charging);
+
+  snap.Get(pos, j);
+  add_global(global_dissipated, j - dissipated);
+  dissipated = j;
+
+  snap.Get(pos, last_time);
+  snap.Get(pos, last_joules);
+  snap.Get(pos, last_watts);
+}
+
 //------------------------------------------------------------------------------
 // Dissipation Visualizer class
 
@@ -269,6 +344,10 @@ void PowerPack::DissipationVis::Visualize(Model *mod, Camera *cam)
 {
   (void)cam; // avoid warning about unused var
 
+  // packs may accumulate in parallel, so the global peak is updated here
+  if (peak_value > global_peak_value)
+    global_peak_value = peak_value;
+
   // go into world coordinates
 
   glPushMatrix();
@@ -307,10 +386,6 @@ void PowerPack::DissipationVis::Accumulate(meters_t x, meters_t y, joules_t amou
   joules_t &j = cells[ix + (iy * columns)];
 
   j += amount;
-  if (j > peak_value) {
+  if (j > peak_value)
     peak_value = j;
-
-    if (peak_value > global_peak_value)
-      global_peak_value = peak_value;
-  }
 }
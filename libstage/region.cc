@@ -54,6 +54,16 @@ void SuperRegion::RemoveBlock()
   --count;
 }
 
+point_int_t SuperRegion::CellPosition(const Cell *cell) const
+{
+  const Region *r(cell->region);
+  const int32_t ri(r - regions);
+  const int32_t ci(cell - &r->cells[0]);
+
+  return point_int_t((origin.x << SRBITS) + ((ri % SUPERREGIONWIDTH) << RBITS) + ci % REGIONWIDTH,
+                     (origin.y << SRBITS) + ((ri / SUPERREGIONWIDTH) << RBITS) + ci / REGIONWIDTH);
+}
+
 void SuperRegion::DrawOccupancy(void) const
 {
   // printf( "SR origin (%d,%d) this %p\n", origin.x, origin.y, this );
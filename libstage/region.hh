@@ -47,13 +47,9 @@ private:
   std::vector<Block *> blocks[2];
 
 public:
-  Cell() : blocks(), region(NULL)
-  {
-    // prevent frequent memory allocations
-    blocks[0].reserve(8);
-    blocks[1].reserve(8);
-    /* nothing to do */
-  }
+  // a region's cells are created together, and most stay empty, so
+  // the block lists only allocate memory once a block is added
+  Cell() : blocks(), region(NULL) {}
 
   void RemoveBlock(Block *b, unsigned int index);
   void AddBlock(Block *b, unsigned int index);
@@ -114,6 +110,9 @@ public:
   inline void RemoveBlock();
 
   const point_int_t &GetOrigin() const { return origin; }
+
+  /** Returns the bitmap coordinates of a cell in one of our regions. */
+  point_int_t CellPosition(const Cell *cell) const;
 }; // class SuperRegion;
 
 } // namespace Stg
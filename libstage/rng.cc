@@ -0,0 +1,179 @@
+/*
+  rng.cc
+  counter-based pseudo-random number streams: Philox4x32-10, with
+  normal numbers by the ziggurat method of Marsaglia and Tsang.
+*/
+
+#include "stage.hh"
+using namespace Stg;
+
+// Philox4x32 multipliers and Weyl sequence key increments
+static const uint32_t PHILOX_M0(0xD2511F53);
+static const uint32_t PHILOX_M1(0xCD9E8D57);
+static const uint32_t PHILOX_W0(0x9E3779B9);
+static const uint32_t PHILOX_W1(0xBB67AE85);
+static const unsigned int PHILOX_ROUNDS(10);
+
+// number of blocks generated together, as lanes of a vector
+static const size_t LANES(Rng::BATCH / 4);
+
+// the ziggurat's layers, the start of its tail, and the layers' area
+static const unsigned int ZIG_LAYERS(128);
+static const double ZIG_R(3.442619855899);
+static const double ZIG_V(9.91256303526217e-3);
+
+// the low bits of a value choose the layer and the rest are a signed
+// position in it, so the two are independent
+static const unsigned int ZIG_BITS(7);
+static const double ZIG_SCALE(16777216.0); // 2^(32 - ZIG_BITS - 1)
+
+// for each layer, the width as a multiple of ZIG_SCALE, the bound
+// below which a position is inside the distribution without further
+// tests, and the density at its top edge
+static struct Ziggurat {
+  double w[ZIG_LAYERS];
+  int32_t k[ZIG_LAYERS];
+  double f[ZIG_LAYERS];
+
+  Ziggurat()
+  {
+    double d(ZIG_R), t(ZIG_R);
+    const double q(ZIG_V / exp(-0.5 * d * d));
+
+    k[0] = (int32_t)((d / q) * ZIG_SCALE);
+    k[1] = 0;
+    w[0] = q / ZIG_SCALE;
+    w[ZIG_LAYERS - 1] = d / ZIG_SCALE;
+    f[0] = 1.0;
+    f[ZIG_LAYERS - 1] = exp(-0.5 * d * d);
+
+    for (unsigned int i(ZIG_LAYERS - 2); i >= 1; --i) {
+      d = sqrt(-2.0 * log(ZIG_V / d + exp(-0.5 * d * d)));
+      k[i + 1] = (int32_t)((d / t) * ZIG_SCALE);
+      t = d;
+      f[i] = exp(-0.5 * d * d);
+      w[i] = d / ZIG_SCALE;
+    }
+  }
+} zig;
+
+Rng::Rng(uint64_t k, uint64_t counter_hi, uint32_t stream) : used(BATCH)
+{
+  key[0] = (uint32_t)k;
+  key[1] = (uint32_t)(k >> 32);
+  counter[0] = 0;
+  counter[1] = stream;
+  counter[2] = (uint32_t)counter_hi;
+  counter[3] = (uint32_t)(counter_hi >> 32);
+  memset(block, 0, sizeof(block));
+}
+
+void Rng::Blocks(uint32_t *out, size_t n)
+{
+  for (size_t b(0); b < n; b += LANES) {
+    const size_t lanes(std::min(LANES, n - b));
+
+    // structure of arrays, so each round is a vector operation over
+    // the lanes
+    uint32_t c0[LANES], c1[LANES], c2[LANES], c3[LANES];
+    for (size_t l(0); l < LANES; ++l) {
+      c0[l] = counter[0] + (uint32_t)l;
+      c1[l] = counter[1];
+      c2[l] = counter[2];
+      c3[l] = counter[3];
+    }
+
+    uint32_t k0(key[0]), k1(key[1]);
+    for (unsigned int r(0); r < PHILOX_ROUNDS; ++r) {
+      for (size_t l(0); l < LANES; ++l) {
+        const uint64_t p0((uint64_t)PHILOX_M0 * c0[l]);
+        const uint64_t p1((uint64_t)PHILOX_M1 * c2[l]);
+        c0[l] = (uint32_t)(p1 >> 32) ^ c1[l] ^ k0;
+        c1[l] = (uint32_t)p1;
+        c2[l] = (uint32_t)(p0 >> 32) ^ c3[l] ^ k1;
+        c3[l] = (uint32_t)p0;
+      }
+      k0 += PHILOX_W0;
+      k1 += PHILOX_W1;
+    }
+
+    for (size_t l(0); l < lanes; ++l) {
+      uint32_t *o(out + 4 * (b + l));
+      o[0] = c0[l];
+      o[1] = c1[l];
+      o[2] = c2[l];
+      o[3] = c3[l];
+    }
+
+    counter[0] += (uint32_t)lanes;
+  }
+}
+
+uint32_t Rng::Uint32()
+{
+  // a whole batch costs the same as a block
+  if (used == BATCH) {
+    Blocks(block, LANES);
+    used = 0;
+  }
+  return block[used++];
+}
+
+double Rng::Normal(double stddev)
+{
+  for (;;) {
+    const uint32_t bits(Uint32());
+    const unsigned int i(bits & (ZIG_LAYERS - 1));
+    const int32_t pos((int32_t)bits >> ZIG_BITS);
+    const double x(pos * zig.w[i]);
+
+    // almost always inside the layer's rectangle
+    if (std::abs(pos) < zig.k[i])
+      return stddev * x;
+
+    // the base layer holds the tail
+    if (i == 0) {
+      double tx, ty;
+      do {
+        tx = -log(1.0 - Uniform()) / ZIG_R;
+        ty = -log(1.0 - Uniform());
+      } while (ty + ty < tx * tx);
+      return stddev * (pos > 0 ? ZIG_R + tx : -ZIG_R - tx);
+    }
+
+    // the edge of a layer, under the curve or not
+    if (zig.f[i] + Uniform() * (zig.f[i - 1] - zig.f[i]) < exp(-0.5 * x * x))
+      return stddev * x;
+  }
+}
+
+void Rng::Uniform(double *out, size_t n, double lo, double hi)
+{
+  const double scale((hi - lo) * (1.0 / 4294967296.0));
+  size_t i(0);
+
+  // use up the current batch first, to keep to the stream's order
+  while (i < n && used < BATCH)
+    out[i++] = lo + scale * block[used++];
+
+  uint32_t buf[4 * LANES];
+  while (n - i >= 4) {
+    const size_t blocks(std::min(LANES, (n - i) / 4));
+    Blocks(buf, blocks);
+    for (size_t j(0); j < 4 * blocks; ++j)
+      out[i + j] = lo + scale * buf[j];
+    i += 4 * blocks;
+  }
+
+  // start a new batch for the rest, leaving its remainder for later
+  while (i < n)
+    out[i++] = Uniform(lo, hi);
+}
+
+void Rng::Normal(double *out, size_t n, double stddev)
+{
+  // one value in about a hundred needs more than one number from the
+  // stream, so each is drawn in turn. The calls are inlined here.
+  for (size_t i(0); i < n; ++i)
+    out[i] = Normal(stddev);
+}
@@ -0,0 +1,226 @@
+/*
+  sharedscan.cc
+  a panoramic scan shared by the sensors mounted on a model: each ray
+  is traced once per update, when a sensor first needs it, and each
+  sensor picks its own results from it.
+*/
+
+#include <float.h>
+#include <sched.h>
+
+#include "stage.hh"
+using namespace Stg;
+
+// the number of hits kept for each ray. Most rays stop at a wall
+// within the first two or three.
+static const unsigned int SHARED_SCAN_HITS(8);
+
+// how a ray ended: at its full range, at a block that stops every
+// user's ray, or after SHARED_SCAN_HITS hits, with more beyond
+static const uint8_t SCAN_RANGE(0);
+static const uint8_t SCAN_BLOCKED(1);
+static const uint8_t SCAN_FULL(2);
+
+// a ray being traced
+struct scan_ray_t {
+  const Model *root; // the host's root: its whole tree is invisible to the users
+  Bounds band; // the heights the users' rays are at
+  SharedScan::Hit *hits;
+  uint8_t count;
+  uint8_t end;
+};
+
+SharedScan::SharedScan(Model *host)
+    : host(host), users(), heights(), range(0), rays(0), hits(), hit_counts(), ends(), ray_stamps(),
+      origin(), band(), stamp(0)
+{
+  pthread_mutex_init(&mutex, NULL);
+}
+
+SharedScan::~SharedScan()
+{
+  FOR_EACH (it, users)
+    (*it)->shared_scan = NULL;
+
+  pthread_mutex_destroy(&mutex);
+}
+
+void SharedScan::AddUser(Model *user, meters_t range, unsigned int rays, bool ztest,
+                         meters_t height)
+{
+  const size_t u(std::find(users.begin(), users.end(), user) - users.begin());
+  if (u == users.size()) {
+    users.push_back(user);
+    heights.push_back(Bounds(1, 0));
+  }
+
+  if (ztest) {
+    Bounds &h(heights[u]);
+    h = (h.min > h.max ? Bounds(height, height) :
+                         Bounds(std::min(h.min, height), std::max(h.max, height)));
+  }
+
+  this->range = std::max(this->range, range);
+  this->rays = std::max(this->rays, rays);
+
+  hits.resize(this->rays * SHARED_SCAN_HITS);
+  hit_counts.resize(this->rays);
+  ends.resize(this->rays);
+  ray_stamps.resize(this->rays);
+  Invalidate();
+}
+
+void SharedScan::RemoveUser(Model *user)
+{
+  const size_t u(std::find(users.begin(), users.end(), user) - users.begin());
+  if (u < users.size()) {
+    users.erase(users.begin() + u);
+    heights.erase(heights.begin() + u);
+  }
+  Invalidate();
+}
+
+void SharedScan::Invalidate()
+{
+  __atomic_store_n(&stamp, 0, __ATOMIC_RELEASE);
+  FOR_EACH (it, ray_stamps)
+    __atomic_store_n(&*it, 0, __ATOMIC_RELEASE);
+}
+
+static bool scan_visit(const Block *block, Model *mod, const Bounds &z, meters_t range, void *arg)
+{
+  scan_ray_t &ray(*static_cast<scan_ray_t *>(arg));
+
+  if (mod->Root() == ray.root)
+    return false;
+
+  // a block in several cells is met first in the nearest
+  for (uint8_t h(0); h < ray.count; ++h)
+    if (ray.hits[h].block == block)
+      return false;
+
+  if (ray.count == SHARED_SCAN_HITS) {
+    ray.end = SCAN_FULL;
+    return true;
+  }
+
+  SharedScan::Hit &hit(ray.hits[ray.count++]);
+  hit.block = block;
+  hit.mod = mod;
+  hit.z = z;
+  hit.range = range;
+
+  // nothing behind a block that rangers see and that covers the
+  // height of every user's rays can be seen by any of them
+  if (sgn(mod->vis.ranger_return) != -1 && z.min <= ray.band.min && z.max >= ray.band.max) {
+    ray.end = SCAN_BLOCKED;
+    return true;
+  }
+
+  return false;
+}
+
+void SharedScan::Refresh(uint64_t update)
+{
+  if (__atomic_load_n(&stamp, __ATOMIC_ACQUIRE) == update + 1)
+    return;
+
+  pthread_mutex_lock(&mutex);
+
+  if (stamp != update + 1) {
+    // the scan starts where the first user is mounted. The band is
+    // left empty if no user tests heights, so any block covers it.
+    origin = users[0]->GetGlobalPose() + users[0]->geom.pose;
+
+    band = Bounds(DBL_MAX, -DBL_MAX);
+    for (size_t u(0); u < users.size(); ++u)
+      if (heights[u].min <= heights[u].max) {
+        const meters_t z(users[u]->GetGlobalPose().z + users[u]->geom.pose.z);
+        band.min = std::min(band.min, z + heights[u].min);
+        band.max = std::max(band.max, z + heights[u].max);
+      }
+
+    __atomic_store_n(&stamp, update + 1, __ATOMIC_RELEASE);
+  }
+
+  pthread_mutex_unlock(&mutex);
+}
+
+void SharedScan::TraceRay(unsigned int r, uint64_t update)
+{
+  const uint64_t done(2 * update + 2);
+  const uint64_t busy(done + 1);
+
+  uint64_t state(__atomic_load_n(&ray_stamps[r], __ATOMIC_ACQUIRE));
+  if (state == done)
+    return;
+
+  // the first user to need the ray traces it, any others wait for it
+  if (state != busy && __atomic_compare_exchange_n(&ray_stamps[r], &state, busy, false,
+                                                   __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+    scan_ray_t ray;
+    ray.root = host->Root();
+    ray.band = band;
+    ray.hits = &hits[r * SHARED_SCAN_HITS];
+    ray.count = 0;
+    ray.end = SCAN_RANGE;
+
+    host->world->TraceBlocks(Pose(origin.x, origin.y, origin.z, origin.a + r * 2.0 * M_PI / rays),
+                             range, scan_visit, &ray);
+
+    hit_counts[r] = ray.count;
+    ends[r] = ray.end;
+    __atomic_store_n(&ray_stamps[r], done, __ATOMIC_RELEASE);
+    return;
+  }
+
+  while (__atomic_load_n(&ray_stamps[r], __ATOMIC_ACQUIRE) != done)
+    sched_yield();
+}
+
+bool SharedScan::Raytrace(const Ray &ray, RaytraceResult &result)
+{
+  // a lazy user reading its data in a later update traces its own
+  // rays, leaving the scan for those sensing in this one
+  if (ray.mod->sense_update != host->world->updates || ray.range > range || rays == 0)
+    return false;
+
+  Refresh(ray.mod->sense_update);
+
+  // the scan only stands in for rays from within a cell of its origin
+  if (hypot(ray.origin.x - origin.x, ray.origin.y - origin.y) > 1.0 / host->world->ppm)
+    return false;
+
+  const double step(2.0 * M_PI / rays);
+  int r((int)floor(normalize(ray.origin.a - origin.a) / step + 0.5));
+  if (r < 0)
+    r += rays;
+  r %= rays;
+
+  TraceRay(r, ray.mod->sense_update);
+
+  const Hit *hit(&hits[r * SHARED_SCAN_HITS]);
+  bool beyond(false);
+  for (uint8_t h(0); h < hit_counts[r]; ++h, ++hit) {
+    if (hit->range > ray.range) {
+      beyond = true;
+      break;
+    }
+
+    if (ray.ztest && (ray.origin.z < hit->z.min || ray.origin.z > hit->z.max))
+      continue;
+
+    if ((*ray.func)(hit->mod, ray.mod, ray.arg)) {
+      result = RaytraceResult(ray.origin, hit->mod, hit->mod->GetColor(), hit->range);
+      return true;
+    }
+  }
+
+  // a ray that was stopped early may have hit something for this
+  // user beyond the hits we kept
+  if (!beyond && ends[r] != SCAN_RANGE)
+    return false;
+
+  result = RaytraceResult(ray.origin, NULL, Color(), ray.range);
+  return true;
+}
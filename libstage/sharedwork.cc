@@ -0,0 +1,82 @@
+/*
+  sharedwork.cc
+  splitting a single model's work into chunks that the world's idle
+  threads help with, so one big sensor doesn't hold up an update.
+*/
+
+#include <sched.h>
+
+#include "barrier.hh"
+#include "stage.hh"
+using namespace Stg;
+
+void World::ShareWork(chunk_func_t func, void *arg, unsigned int chunks)
+{
+  SharedWork work = { func, arg, chunks, 0, 0 };
+
+  if (tick_barrier && chunks > 1) {
+    pthread_mutex_lock(&shared_work_mutex);
+    shared_work.push_back(&work);
+    __atomic_store_n(&shared_work_count, shared_work.size(), __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&shared_work_mutex);
+
+    // threads that have been waiting a while are asleep
+    tick_barrier->Wake();
+  }
+
+  // take our share of the chunks, which is all of them if nobody helps
+  for (;;) {
+    const unsigned int c(__atomic_fetch_add(&work.next, 1, __ATOMIC_ACQ_REL));
+    if (c >= chunks)
+      break;
+    (*func)(c, arg);
+    __atomic_add_fetch(&work.done, 1, __ATOMIC_RELEASE);
+  }
+
+  if (tick_barrier && chunks > 1) {
+    // every chunk is claimed, so take the work down, then wait for
+    // the helpers to finish theirs
+    pthread_mutex_lock(&shared_work_mutex);
+    EraseAll(&work, shared_work);
+    __atomic_store_n(&shared_work_count, shared_work.size(), __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&shared_work_mutex);
+
+    while (__atomic_load_n(&work.done, __ATOMIC_ACQUIRE) < chunks)
+      sched_yield();
+  }
+}
+
+bool World::HelpWithWork(void *arg)
+{
+  World *world(static_cast<World *>(arg));
+
+  // checked on every spin at the barrier, so keep it cheap
+  if (__atomic_load_n(&world->shared_work_count, __ATOMIC_ACQUIRE) == 0)
+    return false;
+
+  SharedWork *work(NULL);
+  unsigned int c(0);
+
+  // claim a chunk while the work can't be taken down
+  pthread_mutex_lock(&world->shared_work_mutex);
+  FOR_EACH (it, world->shared_work) {
+    if (__atomic_load_n(&(*it)->next, __ATOMIC_ACQUIRE) >= (*it)->chunks)
+      continue;
+    c = __atomic_fetch_add(&(*it)->next, 1, __ATOMIC_ACQ_REL);
+    if (c < (*it)->chunks) {
+      work = *it;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&world->shared_work_mutex);
+
+  if (work == NULL)
+    return false;
+
+  (*work->func)(c, work->arg);
+
+  // the last we touch the work: the thread that shared it may return
+  // as soon as it sees this
+  __atomic_add_fetch(&work->done, 1, __ATOMIC_RELEASE);
+  return true;
+}
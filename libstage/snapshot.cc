@@ -0,0 +1,148 @@
+/*
+  snapshot.cc
+  copying a world's simulation state into memory and putting it back,
+  for resetting the same world many times.
+*/
+
+#include "stage.hh"
+using namespace Stg;
+
+void World::Snapshot(WorldSnapshot &snap) const
+{
+  snap.world = this;
+  snap.data.clear();
+
+  snap.Put(updates);
+  snap.Put(sim_time);
+
+  // each model's state is preceded by its size, so that Restore() can
+  // compare it with the model's state then
+  snap.Put(models.size());
+  FOR_EACH (it, models) {
+    snap.Put(*it);
+    snap.Put((*it)->id);
+
+    const size_t at(snap.data.size());
+    snap.Put(size_t(0));
+    (*it)->SaveState(snap);
+
+    const size_t len(snap.data.size() - at - sizeof(size_t));
+    memcpy(&snap.data[at], &len, sizeof(len));
+  }
+
+  FOR_EACH (it, event_queues)
+    it->Save(snap);
+
+  // in pipelined mode, the models whose thread-safe callbacks are
+  // called during the next update
+  FOR_EACH (qit, pipelined_callbacks)
+    FOR_EACH (tit, *qit)
+      snap.PutVector(*tit);
+}
+
+bool World::Restore(const WorldSnapshot &snap)
+{
+  if (snap.world != this) {
+    PRINT_ERR1("snapshot was not taken from world %s", Token());
+    return false;
+  }
+
+  size_t pos(0);
+  uint64_t snap_updates(0);
+  usec_t snap_time(0);
+  snap.Get(pos, snap_updates);
+  snap.Get(pos, snap_time);
+
+  // check the models all still exist before changing anything
+  size_t nmodels(0);
+  snap.Get(pos, nmodels);
+  const size_t models_pos(pos);
+
+  for (size_t m(0); m < nmodels; ++m) {
+    Model *mod(NULL);
+    uint32_t id(0);
+    size_t len(0);
+    snap.Get(pos, mod);
+    snap.Get(pos, id);
+    snap.Get(pos, len);
+    pos += len;
+
+    if (!models.count(mod) || mod->id != id) {
+      PRINT_ERR1("model %u in the snapshot no longer exists", id);
+      return false;
+    }
+  }
+
+  // restore the models whose state differs from the snapshot's
+  std::vector<Model *> changed;
+  std::vector<Pose> old_map_poses;
+  WorldSnapshot now;
+
+  pos = models_pos;
+  for (size_t m(0); m < nmodels; ++m) {
+    Model *mod(NULL);
+    uint32_t id(0);
+    size_t len(0);
+    snap.Get(pos, mod);
+    snap.Get(pos, id);
+    snap.Get(pos, len);
+
+    // states are put a scalar at a time, without padding, so equal
+    // values have equal bytes
+    now.data.clear();
+    mod->SaveState(now);
+    if (now.data.size() == len && memcmp(&now.data[0], &snap.data[pos], len) == 0) {
+      pos += len;
+      continue;
+    }
+
+    changed.push_back(mod);
+    old_map_poses.push_back(mod->map_pose[0]);
+    old_map_poses.push_back(mod->map_pose[1]);
+
+    const size_t end(pos + len);
+    mod->RestoreState(snap, pos);
+    assert(pos == end);
+    (void)end;
+  }
+
+  // now that every pose is restored, render each layer that has
+  // changed where it was. The blocks' heights come from the last
+  // layer rendered, so finish with the one at the current pose.
+  for (size_t c(0); c < changed.size(); ++c) {
+    Model *mod(changed[c]);
+    const unsigned int last(mod->map_pose[0] == mod->GetGlobalPose() ? 0 : 1);
+
+    for (unsigned int i(0); i < 2; ++i) {
+      const unsigned int layer(i == 0 ? 1 - last : last);
+      if (mod->map_pose[layer] != old_map_poses[2 * c + layer]) {
+        mod->blockgroup.UnMap(layer);
+        mod->blockgroup.Map(layer);
+      }
+    }
+  }
+
+  // the events last, since subscribing and unsubscribing models
+  // queues and cancels their updates
+  updates = snap_updates;
+  sim_time = snap_time;
+
+  FOR_EACH (it, event_queues)
+    it->Restore(snap, pos);
+
+  FOR_EACH (qit, pipelined_callbacks)
+    FOR_EACH (tit, *qit)
+      snap.GetVector(pos, *tit);
+  assert(pos == snap.Size());
+
+  // the model grid was refreshed for an update that is yet to come,
+  // and so may the shared scans and line of sight segments have been
+  model_grid_updates = 0;
+  los_segments_updates = 0;
+  FOR_EACH (it, models)
+    if ((*it)->own_scan)
+      (*it)->own_scan->Invalidate();
+
+  dirty = true;
+  return true;
+}
@@ -487,6 +487,80 @@ public:
   bool operator==(const point_int_t &other) const { return ((x == other.x) && (y == other.y)); }
 };
 
+/** A model found sharing a bitmap cell with the blocks of a moving
+    model, as recorded by ModelPosition::Move(). */
+class Contact {
+public:
+  Model *mod; ///< the model touched
+  point_t point; ///< the center of the shared cell, in global coordinates
+
+  Contact(Model *mod, const point_t &point) : mod(mod), point(point) {}
+};
+
+/** A stream of pseudo-random numbers from the counter-based Philox4x32-10
+generator (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3",
+SC 2011). Each block of four 32-bit numbers is a pure function of a
+64-bit key and a 128-bit counter, so there is no shared state to lock,
+any number of streams can be drawn from in parallel, and a stream's
+values don't depend on what any other thread does. Get one for the
+current update from Model::GetRng().
+*/
+class Rng {
+public:
+  /** Streams from this one up are used by Stage's own models, so they
+      never produce the same numbers as a controller's. */
+  static const uint32_t INTERNAL = 0x80000000U;
+
+  /** A stream of values for the given key, where counter_hi and
+      stream form the fixed part of the counter. */
+  Rng(uint64_t key, uint64_t counter_hi, uint32_t stream);
+
+  /** Returns uniformly distributed bits. */
+  uint32_t Uint32();
+
+  /** Returns a number uniformly distributed in [0,1). */
+  double Uniform() { return Uint32() * (1.0 / 4294967296.0); }
+
+  /** Returns a number uniformly distributed in [lo,hi). */
+  double Uniform(double lo, double hi) { return lo + (hi - lo) * Uniform(); }
+
+  /** Returns a normally distributed number with mean 0 and the given
+      standard deviation, by the ziggurat method. */
+  double Normal(double stddev = 1.0);
+
+  /** Fill out[0..n-1] with numbers uniformly distributed in
+      [lo,hi). Faster than calling Uniform() n times: the blocks are
+      generated in batches that the compiler can vectorize. Continues
+      the stream where Uint32() left off, and vice versa. */
+  void Uniform(double *out, size_t n, double lo, double hi);
+
+  /** Fill out[0..n-1] with normally distributed numbers with mean 0
+      and the given standard deviation. The same numbers as calling
+      Normal() n times, but without the calls. */
+  void Normal(double *out, size_t n, double stddev);
+
+  /** Continue the stream from the given block of 4 values. Each
+      block depends only on its counter, so this is as cheap as
+      drawing the next one. */
+  void Seek(uint32_t block_num)
+  {
+    counter[0] = block_num;
+    used = BATCH;
+  }
+
+  /** Number of values generated at a time. */
+  static const unsigned int BATCH = 32;
+
+private:
+  uint32_t key[2];
+  uint32_t counter[4]; ///< counter[0] counts blocks, the rest are fixed
+  uint32_t block[BATCH]; ///< the current batch of output
+  unsigned int used; ///< values of block already returned
+
+  /** Fill n blocks of 4 values into out, continuing the stream. */
+  void Blocks(uint32_t *out, size_t n);
+};
+
 /** create an array of 4 points containing the corners of a unit
       square.  */
 point_t *unit_square_points_create();
@@ -568,6 +642,20 @@ int polys_from_image_file(const std::string &filename, std::vector<std::vector<p
   */
 typedef bool (*ray_test_func_t)(Model *candidate, const Model *finder, const void *arg);
 
+/** Called by World::ShareWork() for each chunk of the work, with the
+chunk's number. */
+typedef void (*chunk_func_t)(unsigned int chunk, void *arg);
+
+/** Called for each block met by World::TraceBlocks(), with the block,
+the model it belongs to, its extent in z and the distance along the
+ray to the cell it was met in. Return true to stop the ray. */
+typedef bool (*block_visit_func_t)(const Block *block, Model *mod, const Bounds &z, meters_t range,
+                                   void *arg);
+
+/** Filter for spatial queries such as World::ModelsInRadius(): return
+true to include the model in the results. */
+typedef bool (*model_filter_t)(const Model *mod, const void *arg);
+
 /// STL container iterator macros - __typeof is a gcc extension, so
 /// this could be an issue one day.
 #define VAR(V, init) __typeof(init) V = (init)
@@ -725,29 +813,247 @@ public:
   bool ztest;
 };
 
+/** A panoramic scan from a model, shared by the sensors mounted on
+it that ask for one with the worldfile property shared_scan. Each ray
+is traced at most once per update, when a sensor first needs it, and
+keeps the first few models it meets in order, so each sensor can pick
+the first its own predicate accepts instead of tracing the ray again. */
+class SharedScan {
+public:
+  explicit SharedScan(Model *host);
+  ~SharedScan();
+
+  /** Share the scan with a child of the host, which traces rays of
+up to range meters and asks for a scan of at least rays rays. If
+ztest is true, its rays only hit blocks at height meters above its
+origin; a user with rays at several heights is added for each. */
+  void AddUser(Model *user, meters_t range, unsigned int rays, bool ztest, meters_t height);
+
+  /** Remove a user added by AddUser(). */
+  void RemoveUser(Model *user);
+
+  /** Find the result World::Raytrace() would give for ray, whose mod
+is a user, from the nearest of the scan's rays. Returns false if the
+scan can't tell, in which case the caller traces the ray itself. */
+  bool Raytrace(const Ray &ray, RaytraceResult &result);
+
+  /** Forget the last scan, as when the world is restored from a
+snapshot. */
+  void Invalidate();
+
+  /** A block met by one of the scan's rays, with the distance to the
+cell it was met in. */
+  class Hit {
+  public:
+    const Block *block;
+    Model *mod;
+    Bounds z;
+    meters_t range;
+  };
+
+private:
+  Model *host;
+  std::vector<Model *> users;
+  std::vector<Bounds> heights; ///< each user's ray heights above its origin, empty if none
+  meters_t range; ///< the users' longest range
+  unsigned int rays; ///< the most rays any user asked for
+
+  /** Each ray's hits, up to SHARED_SCAN_HITS of them, and how it
+ended: one of the SCAN_ constants in sharedscan.cc. */
+  std::vector<Hit> hits;
+  std::vector<uint8_t> hit_counts;
+  std::vector<uint8_t> ends;
+
+  /** The update each ray was traced in, as twice the update count plus
+2, plus 1 while it is being traced. Accessed atomically. */
+  std::vector<uint64_t> ray_stamps;
+
+  Pose origin; ///< the origin and heading of the first ray
+  Bounds band; ///< the heights of the users' rays
+  uint64_t stamp; ///< the update origin and band were found for, plus 1. Accessed atomically.
+  pthread_mutex_t mutex;
+
+  /** Find the scan's origin and band for this update, unless they
+have been already. */
+  void Refresh(uint64_t update);
+
+  /** Trace ray r for this update, unless it has been already. */
+  void TraceRay(unsigned int r, uint64_t update);
+};
+
 // defined in stage_internal.hh
 class Region;
 class SuperRegion;
 class BlockGroup;
 class PowerPack;
+class Barrier;
 
-class LogEntry {
-  usec_t timestamp;
-  Model *mod;
-  Pose pose;
+class ModelPosition;
 
+/** Records the trajectories of selected models to a binary file: each
+update, their global poses, their velocities if they are position
+models, whether they are stalled and the energy stored in their power
+packs. The updates are gathered into blocks, which a writer thread
+compresses and appends to the file while the next block fills, so
+recording costs the simulation little more than copying the values.
+
+The file starts with TrajectoryLog::MAGIC. Each block is a
+BlockHeader followed by its data: the times of its ticks (usec_t),
+columns of global x, y, z and a, of velocity x, y, z and a in the
+model's own frame, and of stored joules as doubles, the IDs of its
+models (uint32_t), and a column of stall flags as bytes. Each column
+holds the first model's values for every tick, then the second's, and
+so on. The data is compressed
+with zlib if the header's size and raw_size differ. The file ends
+with a BlockIndex for each block and an IndexTrailer, which
+TrajectoryReader uses to find a time window without reading the other
+blocks. Values are in the byte order of the machine that wrote them.
+*/
+class TrajectoryLog {
 public:
-  LogEntry(usec_t timestamp, Model *mod);
+  TrajectoryLog();
+  ~TrajectoryLog();
+
+  /** Start recording to a new file, ticks updates to a block,
+compressing them if compress is true. Returns false if the file can't
+be opened, or another log in this process is recording it. */
+  bool Open(const std::string &filename, unsigned int ticks, bool compress);
+
+  /** Write out the updates recorded so far and the index, and close
+the file. Does nothing if the log isn't open. */
+  void Close();
+
+  bool IsOpen() const { return file != NULL; }
+
+  /** Record mod's trajectory from the next update on. */
+  void Add(Model *mod);
+
+  /** Stop recording mod's trajectory. */
+  void Remove(Model *mod);
+
+  /** Record the state of the models at simulated time now. Called by
+the world at the end of each update. */
+  void Record(usec_t now);
+
+  /** Wait until the writer has written every block handed to it. */
+  void Flush();
+
+  /** Forget the file without writing any more to it, in a process
+forked from the one recording, which has no writer thread. */
+  void Detach();
+
+  /** Returns filename with suffix inserted before its extension, if
+it has one, to name the log of another world recording the same
+models. */
+  static std::string Suffixed(const std::string &filename, const std::string &suffix);
 
-  /** A log of all LogEntries ever created */
-  static std::vector<LogEntry> log;
+  static const char MAGIC[8]; ///< the first bytes of the file
+  static const unsigned int COLUMNS = 9; ///< the number of columns of doubles
 
-  /** Returns the number of logged entries */
-  static size_t Count() { return log.size(); }
-  /** Clear the log */
-  static void Clear() { log.clear(); }
-  /** Print the log on stdout */
-  static void Print();
+  /** Precedes each block's data in the file. */
+  class BlockHeader {
+  public:
+    uint32_t ticks; ///< the number of updates recorded
+    uint32_t models; ///< the number of models recorded
+    uint64_t size; ///< the size of the data that follows, as stored
+    uint64_t raw_size; ///< the size of the data before compression
+  };
+
+  /** The times recorded in a block, and where it starts in the file. */
+  class BlockIndex {
+  public:
+    usec_t first; ///< the time of the block's first tick
+    usec_t last; ///< the time of its last tick
+    uint64_t offset; ///< the offset of its BlockHeader
+  };
+
+  /** The last bytes of the file, locating the index. */
+  class IndexTrailer {
+  public:
+    uint64_t offset; ///< the offset of the first BlockIndex
+    uint64_t count; ///< the number of blocks
+    char magic[8]; ///< MAGIC again, to show the file is complete
+  };
+
+private:
+  /** The updates recorded into one block. Values are stored as in
+the file, with room for a full block of ticks for each model. */
+  class Block {
+  public:
+    unsigned int ticks;
+    std::vector<usec_t> times;
+    std::vector<uint32_t> ids;
+    std::vector<double> values; ///< COLUMNS columns of models x capacity values
+    std::vector<uint8_t> stalls;
+  };
+
+  FILE *file;
+  std::string path; ///< the real path of the file
+  unsigned int capacity; ///< ticks to a block
+  bool compress;
+
+  /** The models recorded, by ID, and each as a position model or
+NULL. */
+  std::vector<Model *> models;
+  std::vector<ModelPosition *> positions;
+  bool models_changed; ///< the models have changed since the filling block started
+
+  Block blocks[2];
+  Block *filling; ///< the block being recorded into
+  Block *pending; ///< the block handed to the writer, until it is written
+
+  pthread_t writer;
+  pthread_mutex_t mutex; ///< guards pending and closing
+  pthread_cond_t cond; ///< signals changes to pending and closing
+  bool closing; ///< tells the writer to finish
+
+  /** Written by the writer, and read by Close() once it has finished */
+  std::vector<BlockIndex> index;
+  uint64_t offset; ///< the size of the file so far
+  bool failed; ///< a write failed, and has been reported
+
+  /** Hand the filling block to the writer, once it has written the
+last one, and start filling the other. */
+  void HandOff();
+  void Write(const Block &block);
+  static void *writer_entry(void *log);
+};
+
+/** Reads the files written by TrajectoryLog. */
+class TrajectoryReader {
+public:
+  TrajectoryReader();
+  ~TrajectoryReader();
+
+  /** Read the index of a trajectory file. Returns false if the file
+can't be read. A file that wasn't closed has no index, so its blocks
+are found by skipping from one header to the next. */
+  bool Open(const std::string &filename);
+  void Close();
+
+  /** A model's state at one update. */
+  class Sample {
+  public:
+    usec_t time;
+    uint32_t id;
+    Pose pose;
+    Velocity velocity;
+    bool stall;
+    joules_t energy;
+  };
+
+  /** Append the samples recorded between start and end inclusive, in
+the order they were recorded and by model ID within each update,
+reading only the blocks that overlap the window. Returns false if the
+file is damaged. */
+  bool Read(usec_t start, usec_t end, std::vector<Sample> &samples);
+
+  /** The blocks in the file. */
+  const std::vector<TrajectoryLog::BlockIndex> &GetIndex() const { return index; }
+
+private:
+  FILE *file;
+  std::vector<TrajectoryLog::BlockIndex> index;
 };
 
 class CtrlArgs {
@@ -758,6 +1064,187 @@ public:
   CtrlArgs(std::string w, std::string c) : worldfile(w), cmdline(c) {}
 };
 
+/** A sparse uniform grid of square cells, for finding the models near
+a point without looking at all of them. Each model is in the cells
+overlapped by its footprint (the rectangle of its geom in the plane,
+in global coordinates), or just the cell of its origin if footprints
+is false. Models are placed by Refresh(), which only touches the cells
+of models that have changed cells. Models whose footprint covers many
+cells are kept in a separate list instead, and visited by every
+query. */
+class ModelGrid {
+public:
+  ModelGrid(meters_t cell_size, bool footprints);
+
+  /** Called for each model found by Visit(). Return true to stop. */
+  typedef bool (*visitor_t)(Model *mod, void *arg);
+
+  /** Add a model. It is placed in the grid at the next Refresh(). */
+  void Insert(Model *mod);
+
+  /** Remove a model, if it is in the grid. */
+  void Remove(Model *mod);
+
+  /** Move the models that have changed cells since the last call. */
+  void Refresh();
+
+  /** Call func once for each model in the cells that overlap the box
+      [xmin,xmax] x [ymin,ymax], as of the last Refresh(), until it
+      returns true. These may lie up to a cell outside the box. Does
+      not allocate memory. Returns true if func stopped the visit. */
+  bool Visit(meters_t xmin, meters_t ymin, meters_t xmax, meters_t ymax, visitor_t func,
+             void *arg) const;
+
+  /** Call func once for each model in the grid, until it returns
+      true. Returns true if func stopped the visit. */
+  bool VisitAll(visitor_t func, void *arg) const;
+
+  /** Append to out the models found by Visit() for the box. */
+  void Query(meters_t xmin, meters_t ymin, meters_t xmax, meters_t ymax,
+             std::vector<Model *> &out) const;
+
+  /** Returns the number of models in the grid. */
+  size_t Size() const { return where.size(); }
+
+  /** Returns the number of models placed in the cells by the last
+      Refresh(), which Visit() can find. */
+  size_t Placed() const { return placed; }
+
+  /** Change the size of the cells, emptying them until the next
+      Refresh(). */
+  void SetCellSize(meters_t size);
+  meters_t GetCellSize() const { return cell_size; }
+
+private:
+  meters_t cell_size;
+  bool footprints;
+
+  /** The cells a model covers, inclusive. */
+  class Span {
+  public:
+    point_int_t lo, hi;
+    bool large; ///< true if the model is in the large list instead
+    Span() : lo(), hi(-1, -1), large(false) {}
+    bool operator==(const Span &other) const
+    {
+      return lo == other.lo && hi == other.hi && large == other.large;
+    }
+  };
+
+  /** A model in a cell, with the first cell of its span, so that
+      queries can report models that cover several cells only once. */
+  class Entry {
+  public:
+    Model *mod;
+    point_int_t lo;
+    Entry(Model *mod, const point_int_t &lo) : mod(mod), lo(lo) {}
+  };
+
+  /** The models in each non-empty cell. */
+  std::map<point_int_t, std::vector<Entry> > cells;
+
+  /** Models whose footprints cover too many cells to put in them. */
+  std::vector<Model *> large;
+
+  /** The span of each model. Unplaced models have an empty span. */
+  std::map<Model *, Span> where;
+
+  /** The number of models in where with a span that isn't empty. */
+  size_t placed;
+
+  point_int_t CellOf(meters_t x, meters_t y) const;
+  Span SpanOf(const Model *mod) const;
+  void Place(Model *mod, const Span &span);
+  void Unplace(Model *mod, const Span &span);
+};
+
+/** Defined only for true, so that WorldSnapshot fails to compile if
+asked to copy the bytes of a class. */
+template <bool scalar> class ScalarOnly;
+template <> class ScalarOnly<true> {};
+
+/** A compact binary copy of a world's simulation state, taken by
+    World::Snapshot() and put back by World::Restore(). It refers to
+    models, and to callback functions and their arguments, by address,
+    so it is only good for the world it was taken from, in the process
+    that took it. */
+class WorldSnapshot {
+public:
+  WorldSnapshot() : world(NULL), data() {}
+
+  /** Returns the world the snapshot was taken from, or NULL if none. */
+  const World *GetWorld() const { return world; }
+
+  /** Returns the size of the snapshot in bytes. */
+  size_t Size() const { return data.size(); }
+
+  /** Append the bytes of a value of a scalar type: a number, enum or
+pointer. Classes are put a field at a time, so that a snapshot holds
+no padding and Restore() can compare states byte by byte. */
+  template <class T> void Put(const T &val)
+  {
+    (void)sizeof(ScalarOnly<!__is_class(T) && !__is_union(T)>);
+    const uint8_t *p(reinterpret_cast<const uint8_t *>(&val));
+    data.insert(data.end(), p, p + sizeof(T));
+  }
+
+  void Put(const Pose &pose)
+  {
+    Put(pose.x);
+    Put(pose.y);
+    Put(pose.z);
+    Put(pose.a);
+  }
+
+  void Put(const Velocity &vel) { Put(static_cast<const Pose &>(vel)); }
+
+  /** Append a vector of scalars, after their number. */
+  template <class T> void PutVector(const std::vector<T> &vals)
+  {
+    (void)sizeof(ScalarOnly<!__is_class(T) && !__is_union(T)>);
+    Put(vals.size());
+    if (!vals.empty()) {
+      const uint8_t *p(reinterpret_cast<const uint8_t *>(&vals[0]));
+      data.insert(data.end(), p, p + vals.size() * sizeof(T));
+    }
+  }
+
+  /** Read a value written by Put() at pos, and move pos past it. */
+  template <class T> void Get(size_t &pos, T &val) const
+  {
+    (void)sizeof(ScalarOnly<!__is_class(T) && !__is_union(T)>);
+    memcpy(&val, &data[pos], sizeof(T));
+    pos += sizeof(T);
+  }
+
+  void Get(size_t &pos, Pose &pose) const
+  {
+    Get(pos, pose.x);
+    Get(pos, pose.y);
+    Get(pos, pose.z);
+    Get(pos, pose.a);
+  }
+
+  void Get(size_t &pos, Velocity &vel) const { Get(pos, static_cast<Pose &>(vel)); }
+
+  /** Read a vector written by PutVector() at pos, and move pos past it. */
+  template <class T> void GetVector(size_t &pos, std::vector<T> &vals) const
+  {
+    (void)sizeof(ScalarOnly<!__is_class(T) && !__is_union(T)>);
+    size_t n(0);
+    Get(pos, n);
+    vals.resize(n);
+    if (n > 0)
+      memcpy(&vals[0], &data[pos], n * sizeof(T));
+    pos += n * sizeof(T);
+  }
+
+private:
+  friend class World;
+  const World *world;
+  std::vector<uint8_t> data;
+};
+
 class ModelPosition;
 
 /// %World class
@@ -766,7 +1253,10 @@ public:
   friend class Block;
   friend class Model; // allow access to private members
   friend class ModelFiducial;
+  friend class ModelCamera;
+  friend class ModelWifi;
   friend class Canvas;
+  friend class SharedScan;
   friend class WorkerThread;
 
 public:
@@ -779,6 +1269,20 @@ private:
   static std::set<World *> world_set; ///< all the worlds that exist
   static bool quit_all; ///< quit all worlds ASAP
   static void UpdateCb(World *world);
+
+  static bool parallel_worlds; ///< iff true, UpdateAll() updates headless worlds in parallel
+  static std::vector<World *> worlds_order; ///< the worlds UpdateAll() shares out between threads
+  static std::vector<char> worlds_quit; ///< per world, true if its last Update() returned true
+  static unsigned int worlds_threads; ///< the number of threads updating worlds, including the main thread
+  static Barrier *worlds_barrier; ///< where the threads updating worlds meet
+
+  /** UpdateAll() for parallel worlds. */
+  static bool UpdateAllParallel();
+
+  /** Update the share of worlds_order that thread t owns. */
+  static void UpdateWorlds(unsigned int t);
+
+  static void *worlds_thread_entry(void *t);
   static unsigned int next_id; ///<initially zero, used to allocate unique sequential world ids
 
   bool destroy;
@@ -797,31 +1301,139 @@ private:
 avoids searching the whole world for fiducials. */
   std::vector<Model *> models_with_fiducials;
 
-  struct ltx {
-    bool operator()(const Model *a, const Model *b) const;
-  };
-
-  struct lty {
-    bool operator()(const Model *a, const Model *b) const;
-  };
+  /** The models with fiducials by position, for quickly finding
+nearby fiducials. Refreshed at the start of each update. */
+  ModelGrid fiducial_grid;
 
-  /** maintain a set of models with fiducials sorted by pose.x, for
-quickly finding nearby fidcucials */
-  std::set<Model *, ltx> models_with_fiducials_byx;
-
-  /** maintain a set of models with fiducials sorted by pose.y, for
-quickly finding nearby fidcucials */
-  std::set<Model *, lty> models_with_fiducials_byy;
+  /** If true, the fiducial grid's cells are as large as the longest
+fiducial sensor range. */
+  bool fiducial_grid_auto;
+  meters_t fiducial_range_max; ///< the longest fiducial sensor range so far
 
   /** Add a model to the set of models with non-zero fiducials, if not already there. */
   void FiducialInsert(Model *mod)
   {
     FiducialErase(mod); // make sure it's not there already
     models_with_fiducials.push_back(mod);
+    fiducial_grid.Insert(mod);
   }
 
   /** Remove a model from the set of models with non-zero fiducials, if it exists. */
-  void FiducialErase(Model *mod) { EraseAll(mod, models_with_fiducials); }
+  void FiducialErase(Model *mod)
+  {
+    EraseAll(mod, models_with_fiducials);
+    fiducial_grid.Remove(mod);
+  }
+
+  /** Called by fiducial sensors with their range, to size the
+fiducial grid's cells to suit. */
+  void FiducialRange(meters_t range);
+
+  /** If true, fiducial sensors look up their line of sight to other
+robots in los_segments before tracing it themselves. */
+  bool fiducial_los_cache;
+
+  /** The line of sight from one robot's origin towards another's at
+one height, which stands in for the lines of sight between their
+fiducial sensors and fiducials at that height in both directions. */
+  class LosSegment {
+  public:
+    RaytraceResult result; ///< the first model met from the near robot
+    meters_t length; ///< the distance between the origins
+    meters_t reach; ///< the distance traced, to just past the far robot's footprint
+    meters_t from_reach; ///< how far the near robot's footprint reaches from its origin
+    int from_cover; ///< 1 if all the near robot's blocks cover the height, 0 if none do, else -1
+  };
+
+  /** The IDs of a segment's two robots, lowest first, and its height. */
+  typedef std::pair<std::pair<uint32_t, uint32_t>, meters_t> los_key_t;
+
+  /** The segments traced in this update. */
+  std::map<los_key_t, LosSegment> los_segments;
+  uint64_t los_segments_updates; ///< value of updates the segments were traced in, plus one
+  pthread_mutex_t los_segments_mutex; ///< serializes concurrent fiducial sensors
+
+  /** Find the result World::Raytrace() would give for ray, from the
+fiducial sensor finder towards him, from the segment between their
+robots' origins, tracing it if neither robot's sensors have this
+update. Returns false if the segment can't stand in for the ray. */
+  bool FiducialLos(Model *finder, Model *him, const Ray &ray, RaytraceResult &result);
+
+  /** For LosSegment::from_cover: 1 if all of mod's blocks cover
+height z, 0 if none do, else -1, as they do if any of its
+descendants have blocks. */
+  static int LosCover(Model *mod, meters_t z);
+
+  /** The wifi models that are switched on, by position, for quickly
+finding the ones in radio range. Refreshed at the start of each
+update. Its cells are as large as the longest radio range. */
+  ModelGrid wifi_grid;
+  meters_t wifi_range_max; ///< the longest radio range so far
+  double wifi_power_max; ///< the highest transmit power of any wifi model so far, in dBm
+
+  /** The number of walls between the centers of two cells of
+wifi_walls_cell meters, the lowest first, found by WifiWalls(). */
+  class WallCount {
+  public:
+    point_int_t from, to;
+    unsigned int walls;
+    bool valid; ///< false until the slot is first filled
+  };
+
+  /** WallCounts by a hash of their cells. A count overwrites any
+other that hashes to the same slot. Allocated when first needed. */
+  std::vector<WallCount> wifi_walls;
+  meters_t wifi_walls_cell; ///< the size of the cells, or 0 not to cache walls
+  pthread_mutex_t wifi_walls_mutex; ///< serializes concurrent wifi models
+
+  /** The cells that held walls when WifiWalls() first traced them:
+a bit for each cell of each region holding walls, row by row. */
+  std::vector<uint64_t> wifi_wall_cells;
+  /** For each region in the box around the walls, row by row, the
+offset of its bits in wifi_wall_cells, or -1 if it has no walls. */
+  std::vector<int32_t> wifi_wall_regions;
+  point_int_t wifi_wall_origin; ///< the lowest region in the box, in region coordinates
+  point_int_t wifi_wall_size; ///< the size of the box, in regions
+  bool wifi_wall_cells_mapped; ///< true once wifi_wall_cells is filled in
+
+  /** Fills in wifi_wall_cells from the blocks of the walls. */
+  void MapWifiWalls();
+
+  /** Returns the number of runs of cells in wifi_wall_cells on the
+manhattan path from a to b. */
+  unsigned int CountWifiWalls(const point_t &a, const point_t &b) const;
+
+  /** Called by wifi models as they switch on, with the range at which
+a model like them can hear them, and their transmit power in dBm. */
+  void WifiRange(meters_t range, double power);
+
+  /** Returns the number of walls between a and b for radio signals:
+runs of cells holding obstacles that no position model carries. If
+the world option wifi_wall_cache is set, the count is between the
+centers of the cache cells that hold a and b, and is looked up in
+wifi_walls, or traced once and stored there. */
+  unsigned int WifiWalls(const point_t &a, const point_t &b);
+
+  /** All the models but the ground by footprint, for the spatial
+queries. Once a query has been made, the main thread refreshes it in
+each update as soon as the models have moved, before any callbacks
+are called. Otherwise it is refreshed by the first query in each
+update. */
+  mutable ModelGrid model_grid;
+  mutable uint64_t model_grid_updates; ///< value of updates at the last refresh, plus one
+  mutable bool model_grid_queried; ///< a query has been made, so Update() refreshes the grid
+  mutable pthread_mutex_t model_grid_mutex; ///< serializes refreshes by concurrent queries
+
+  std::map<std::string, double> metrics; ///< named values reported by controllers
+  mutable pthread_mutex_t metrics_mutex; ///< serializes reports from thread-safe callbacks
+
+  /** Records the trajectories of the models passed to Log(). */
+  TrajectoryLog trajectory;
+  mutable unsigned int clones; ///< the number of clones made, for naming their logs
+
+  /** Bring the model grid up to date with this update's poses, if a
+query has not already done so. */
+  void RefreshModelGrid() const;
   /// Defines what all World::Load(*) methods have in common. Called after initial setup.
   void LoadWorldPostHook();
 
@@ -831,12 +1443,36 @@ quickly finding nearby fidcucials */
   unsigned int show_clock_interval; ///< updates between clock outputs
 
   //--- thread sync ----
-  pthread_mutex_t sync_mutex; ///< protect the worker thread management stuff
-  unsigned int threads_working; ///< the number of worker threads not yet finished
-  pthread_cond_t threads_start_cond; ///< signalled to unblock worker threads
-  pthread_cond_t threads_done_cond; ///< signalled by last worker thread to unblock main thread
+  /** The main thread and all worker threads meet here at the start
+      and end of each update. */
+  Barrier *tick_barrier;
+  std::vector<pthread_t> workers; ///< the worker threads, for StopWorkers() to join
+  bool stop_workers; ///< iff true, the workers exit at the start of the next update
   int total_subs; ///< the total number of subscriptions to all models
-  unsigned int worker_threads; ///< the number of worker threads to use
+  unsigned int worker_threads; ///< the number of worker threads in use
+  unsigned int max_worker_threads; ///< the number of worker threads started
+
+  /** Non-zero for each worker thread that is not in use. Indexed by
+      thread number, where the main thread is 0. */
+  std::vector<int> parked;
+  pthread_mutex_t park_mutex; ///< protects parked for sleeping workers
+  pthread_cond_t park_cond; ///< signalled when workers are unparked
+  bool unpark; ///< iff true, wake parked workers at the start of the next update
+  /** Non-zero for each worker thread that is to park before it first
+      meets the others. Set before the workers are started. */
+  std::vector<int> start_parked;
+
+  /** Work split into chunks by ShareWork(), for any thread to help with. */
+  struct SharedWork {
+    chunk_func_t func;
+    void *arg;
+    unsigned int chunks; ///< the number of chunks
+    unsigned int next; ///< the next chunk to claim
+    unsigned int done; ///< the number of chunks finished
+  };
+  std::vector<SharedWork *> shared_work; ///< work with chunks left to claim
+  unsigned int shared_work_count; ///< size of shared_work, for checking without the lock
+  pthread_mutex_t shared_work_mutex; ///< protects shared_work
 
 protected:
   std::list<std::pair<world_callback_t, void *> >
@@ -854,6 +1490,8 @@ protected:
   std::map<point_int_t, SuperRegion *> superregions;
 
   uint64_t updates; ///< the number of simulated time steps executed so far
+  uint32_t seed; ///< seed of the models' random number streams
+  uint32_t models_made; ///< the number of models made in this world, numbering them
   Worldfile *wf; ///< If set, points to the worldfile used to create this world
 
   void CallUpdateCallbacks(); ///< Call all calbacks in cb_list, removing any that return true;
@@ -883,9 +1521,13 @@ the end of a complete update step */
 AddUpdateCallback is not automatically freed. */
   int RemoveUpdateCallback(world_callback_t cb, void *user);
 
-  /** Log the state of a Model */
+  /** Record mod's trajectory each update, if the world option
+trajectory_log names a file to record to. */
   void Log(Model *mod);
 
+  /** Stop recording mod's trajectory. */
+  void UnLog(Model *mod);
+
   /** hint that the world needs to be redrawn if a GUI is attached */
   void NeedRedraw() { dirty = true; }
   /** Special model for the floor of the world */
@@ -946,6 +1588,20 @@ grid pixels */
                 const Model *model, const void *arg, const bool ztest,
                 std::vector<RaytraceResult> &results);
 
+  /** Follow a horizontal ray from gpose for range meters, calling
+func for every block in every cell it passes through, nearest first,
+until func returns true. Unlike Raytrace(), which stops at the first
+block that matches, this lets the caller see the blocks behind and
+below it, as the CPU camera does. */
+  void TraceBlocks(const Pose &gpose, meters_t range, block_visit_func_t func, void *arg);
+
+  /** Count the runs of consecutive cells on the line from a to b
+that hold a block for which func returns true, as Raytrace() calls
+it with finder and arg, whatever the blocks' heights. A ray from a
+crosses that many walls on its way to b. */
+  unsigned int CountCrossings(const point_t &a, const point_t &b, const ray_test_func_t func,
+                              const Model *finder, const void *arg);
+
   /** Enlarge the bounding volume to include this point */
   inline void Extend(point3_t pt);
 
@@ -970,8 +1626,10 @@ should quit */
 
   class Event {
   public:
-    Event(usec_t time, Model *mod, model_callback_t cb, void *arg)
-        : time(time), mod(mod), cb(cb), arg(arg)
+    Event() : time(0), mod(NULL), cb(NULL), arg(NULL), period(0) {}
+
+    Event(usec_t time, Model *mod, model_callback_t cb, void *arg, usec_t period = 0)
+        : time(time), mod(mod), cb(cb), arg(arg), period(period)
     {
     }
 
@@ -979,18 +1637,134 @@ should quit */
     Model *mod; ///< model to pass into callback
     model_callback_t cb;
     void *arg;
+    usec_t period; ///< if non-zero, the event recurs this long after it fires
 
     /** order by time. Break ties by value of Model*, then cb*.
 @param event to compare with this one. */
     bool operator<(const Event &other) const;
   };
 
-  /** Queue of pending simulation events for the main thread to handle. */
-  std::vector<std::priority_queue<Event> > event_queues;
+  /** A hierarchical timing wheel of Events, keyed by world update
+(tick). Nearly all events fall within a few ticks of now, so
+inserting and removing them is O(1) instead of the O(log n) of a
+heap. Events in the same tick are handled in time order, then in
+the order they were queued. */
+  class EventQueue {
+  public:
+    EventQueue();
+
+    /** Set the simulated time per tick. Events already queued are
+re-sorted into the wheel. */
+    void SetTickInterval(usec_t usec);
+
+    /** Add an event to the queue. */
+    void Push(const Event &ev);
+
+    /** Handle all events due at or before time now. Recurring
+events are queued again unless their callback returns non-zero. */
+    void Consume(usec_t now);
+
+    /** Remove all events for the given models, appending them to
+out. */
+    void Extract(const std::set<Model *> &mods, std::vector<Event> &out);
+
+    bool Empty() const { return count == 0; }
+    size_t Size() const { return count; }
+
+    /** Append the queue's contents to a snapshot. */
+    void Save(WorldSnapshot &snap) const;
+
+    /** Replace the queue's contents with those saved in a snapshot
+at pos, and move pos past them. */
+    void Restore(const WorldSnapshot &snap, size_t &pos);
+
+  private:
+    static const unsigned int WHEELBITS = 8;
+    static const uint64_t WHEELSIZE = 1 << WHEELBITS;
+    static const uint64_t WHEELMASK = WHEELSIZE - 1;
+
+    usec_t tick_interval;
+    uint64_t current; ///< the tick being handled, or the last one handled
+    size_t count; ///< total number of queued events
+
+    /** one slot for each of the next WHEELSIZE ticks */
+    std::vector<std::vector<Event> > near_wheel;
+    /** one slot for each of the next WHEELSIZE blocks of WHEELSIZE ticks */
+    std::vector<std::vector<Event> > far_wheel;
+    /** events beyond the far wheel */
+    std::priority_queue<Event> overflow;
+
+    uint64_t Tick(usec_t time) const { return (time + tick_interval - 1) / tick_interval; }
+    void Insert(const Event &ev);
+    /** Move events from the far wheel and the overflow into reach of
+the near wheel, on entering a new block of ticks. */
+    void Cascade();
+    void ConsumeSlot(std::vector<Event> &slot, usec_t now);
+
+    /** Append events to a snapshot, after their number. */
+    static void SaveEvents(WorldSnapshot &snap, const std::vector<Event> &events);
+
+    /** Read events saved by SaveEvents() at pos, and move pos past
+them. */
+    static void RestoreEvents(const WorldSnapshot &snap, size_t &pos, std::vector<Event> &events);
+  };
+
+  /** Queues of pending simulation events. The main thread handles
+queue 0, worker threads the others. */
+  std::vector<EventQueue> event_queues;
 
   /** Queue of pending simulation events for the main thread to handle. */
   std::vector<std::queue<Model *> > pending_update_callbacks;
 
+  /** Models with thread-safe CB_UPDATE callbacks to call, indexed
+by the queue that updated them and then by the thread that will call
+them. All models with the same root are assigned to the same thread,
+so the callbacks of one robot are never called concurrently. */
+  std::vector<std::vector<std::vector<Model *> > > pending_threadsafe_callbacks;
+
+  /** Number of thread-safe CB_UPDATE callbacks registered. If
+non-zero, the worker threads stay for a third phase of each
+World::Update() to call them. */
+  int threadsafe_cb_count;
+
+  /** Copy of (threadsafe_cb_count > 0) taken by the main thread
+before each update, so that all threads agree on the phases. */
+  bool threadsafe_callbacks_phase;
+
+  /** If true, thread-safe update callbacks are pipelined: those due
+at one update are called during the next, in parallel with sensing,
+so their commands take effect an update later. */
+  bool pipeline;
+
+  /** If true, the results of an update don't depend on the number of
+threads or on which thread updates which model. */
+  bool deterministic;
+
+  /** In pipelined mode, the thread-safe callbacks from the last
+update, being called during this one. Laid out as
+pending_threadsafe_callbacks. */
+  std::vector<std::vector<std::vector<Model *> > > pipelined_callbacks;
+
+  /** Call the thread-safe update callbacks assigned to the given
+thread, where the main thread is 0. */
+  void CallThreadSafeCallbacks(unsigned int thread_num);
+
+  /** Returns true in a thread that is calling thread-safe update
+callbacks, which may not change anything shared with other robots. */
+  static bool InThreadSafeCallback();
+
+  /** Subscription changes made by thread-safe callbacks, as a model
+and +1 or -1, for the main thread to apply once they are done. */
+  std::vector<std::pair<Model *, int> > deferred_subs;
+  pthread_mutex_t deferred_subs_mutex; ///< serializes concurrent callbacks
+
+  /** Queue a Subscribe() (change +1) or Unsubscribe() (-1) of mod
+made by a thread-safe callback. */
+  void DeferSubscription(Model *mod, int change);
+
+  /** Apply the deferred_subs, in model ID order. */
+  void ApplyDeferredSubs();
+
   /** Create a new simulation event to be handled in the future.
 
 @param queue_num Specify which queue the event should be on. The main
@@ -1004,15 +1778,80 @@ called at the specified time.
   */
   void Enqueue(unsigned int queue_num, usec_t delay, Model *mod, model_callback_t cb, void *arg)
   {
-    event_queues[queue_num].push(Event(sim_time + delay, mod, cb, arg));
+    event_queues[queue_num].Push(Event(sim_time + delay, mod, cb, arg));
+  }
+
+  /** Create a simulation event that recurs every period
+microseconds, starting one period from now, until its callback
+returns non-zero. This is cheaper than having the callback
+Enqueue() itself each time. */
+  void EnqueuePeriodic(unsigned int queue_num, usec_t period, Model *mod, model_callback_t cb,
+                       void *arg)
+  {
+    assert(period > 0);
+    event_queues[queue_num].Push(Event(sim_time + period, mod, cb, arg, period));
   }
 
   /** Set of models that require energy calculations at each World::Update(). */
   std::set<Model *> active_energy;
-  void EnableEnergy(Model *m) { active_energy.insert(m); }
-  void DisableEnergy(Model *m) { active_energy.erase(m); }
-  /** Set of models that require their positions to be recalculated at each World::Update(). */
-  std::set<ModelPosition *> active_velocity;
+  void EnableEnergy(Model *m)
+  {
+    active_energy.insert(m);
+    energy_dirty = true;
+  }
+  void DisableEnergy(Model *m)
+  {
+    active_energy.erase(m);
+    energy_dirty = true;
+  }
+
+  /** Models in active_energy that draw on the same power pack. Each
+group is handled by a single thread, so no locking is needed. */
+  class EnergyGroup {
+  public:
+    PowerPack *pp;
+    std::vector<Model *> mods;
+    /** (giver, taker) pairs of touching models that can exchange
+energy, found in parallel and applied in series, in order. */
+    std::vector<std::pair<Model *, Model *> > contacts;
+
+    explicit EnergyGroup(PowerPack *pp) : pp(pp), mods(), contacts() {}
+  };
+
+  /** active_energy grouped by power pack, in model ID order */
+  std::vector<EnergyGroup> energy_groups;
+  bool energy_dirty; ///< iff true, energy_groups must be rebuilt
+
+  /** Copy of whether there are enough active_energy models to
+account for them in parallel, taken by the main thread before each
+update as for threadsafe_callbacks_phase. */
+  bool energy_phase;
+
+  /** Rebuild energy_groups from active_energy. */
+  void GroupEnergyModels();
+
+  /** Dissipate energy and find charging contacts for this thread's
+share of the energy groups, where the main thread is 0. */
+  void AccountEnergy(unsigned int thread_num);
+
+  /** Commit dissipation to the global totals and transfer energy
+between the contacts found by AccountEnergy(), in group order. Must
+be called in the main thread. */
+  void TransferEnergy();
+  /** Orders models by ID, which unlike their addresses is the same
+in every run. */
+  struct ltid {
+    bool operator()(const Model *a, const Model *b) const;
+    bool operator()(const std::pair<Model *, int> &a, const std::pair<Model *, int> &b) const
+    {
+      return (*this)(a.first, b.first);
+    }
+  };
+
+  /** Set of models that require their positions to be recalculated
+at each World::Update(), in ID order since moving them in a different
+order can resolve collisions differently. */
+  std::set<ModelPosition *, ltid> active_velocity;
 
   /** The amount of simulated time to run for each call to Update() */
   usec_t sim_interval;
@@ -1026,13 +1865,124 @@ called at the specified time.
   void ConsumeQueue(unsigned int queue_num);
 
   /** returns an event queue index number for a model to use for
-updates */
-  unsigned int GetEventQueue(Model *mod) const;
+updates: the worker queue with the least estimated load. */
+  unsigned int GetEventQueue(Model *mod);
+
+  /** If true, reassign thread-safe models to worker queues by their
+measured update cost, rather than leaving them where they started. */
+  bool load_balance;
+
+  /** Number of updates between load balancing passes. */
+  uint64_t load_balance_interval;
+
+  /** If true, print the estimated load of each queue after each
+load balancing pass. */
+  bool show_load;
+
+  /** If true, models time their Update() calls. Set by the main
+thread between updates, during each measurement window. */
+  bool measure_costs;
+
+  /** Estimated CPU time per world update of the models on each
+queue, in nsec. */
+  std::vector<double> queue_loads;
+
+  /** Load assumed for models whose cost has not been measured: the
+mean of the last measurements, initially 1. */
+  double default_model_load;
+
+  /** Estimated CPU time per world update of a model, in nsec. */
+  double ModelLoad(const Model *mod) const;
+
+  /** Open or close the cost measurement window and reassign models
+to queues as needed. Called by the main thread between updates. */
+  void BalanceLoad();
+
+  /** Update the model cost estimates and, if the load has become
+unbalanced or force is true, reassign the subscribed thread-safe
+models to worker queues. */
+  void AssignQueues(bool force);
+
+  /** Assign mods to worker queues, heaviest first, each to the queue
+with the least load so far, adding those that change queue to
+moved. */
+  void Reassign(std::vector<Model *> &mods, std::set<Model *> &moved);
+
+  /** Move the pending events of the moved models to their queues. */
+  void MoveEvents(const std::set<Model *> &moved);
+
+  /** If true, the number of worker threads in use is chosen by timing
+updates with different numbers of them. */
+  bool auto_threads;
+
+  /** The numbers of worker threads tried by the tuner, and the wall
+time per simulated second measured with each. */
+  std::vector<unsigned int> tune_counts;
+  std::vector<double> tune_times;
+
+  unsigned int tune_trial; ///< index into tune_counts of the current trial
+  uint64_t tune_start; ///< the update at which the current trial started
+  double tune_wall; ///< wall time spent updating in the current trial, in nsec
+  unsigned int tuned_models; ///< subscribed thread-safe models when last tuned
+
+  /** Time the updates, trying each of tune_counts in turn, then use
+the fastest until the number of subscribed thread-safe models changes
+significantly. Called by the main thread at the end of each update,
+with the wall time it took in nsec. */
+  void TuneThreads(double update_nsec);
+
+  /** Returns the number of subscribed thread-safe models. */
+  unsigned int CountParallelModels() const;
+
+  /** Start a new round of tuning trials. */
+  void StartTuning();
+
+  /** Use n worker threads from the next update on, moving models off
+the queues of threads that are parked. Called by the main thread
+between updates. */
+  void SetWorkerThreads(unsigned int n);
+
+  /** Use no more than n worker threads from now on, leaving the rest
+parked for good. Retunes if the number of threads is "auto". */
+  void LimitWorkerThreads(unsigned int n);
+
+  /** Returns true if worker thread t is parked. */
+  bool IsParked(unsigned int t) const { return __atomic_load_n(&parked[t], __ATOMIC_ACQUIRE); }
+
+  /** Called by worker thread t when it finds itself parked. Sleeps
+until the main thread needs it again. */
+  void Park(unsigned int t);
+
+  /** Start the worker threads, each parked or not as parked[] says,
+with a new barrier for them and the main thread to meet at, which
+spins forever if spin is true. */
+  void StartWorkers(bool spin);
+
+  /** Have the worker threads exit, wait for them, and delete the
+barrier. Called by the main thread between updates. */
+  void StopWorkers();
+
+  /** Wake the workers that have just been brought back into use. */
+  void UnparkWorkers();
+
+  /** Run a chunk of shared work, if there is any, returning true if
+there was. Called by threads waiting at the tick barrier, with the
+world as arg. */
+  static bool HelpWithWork(void *world);
 
 public:
   /** returns true when time to quit, false otherwise */
   static bool UpdateAll();
 
+  /** If true, UpdateAll() updates headless worlds at the same time,
+on up to one thread per CPU core, and limits each world's worker
+threads to its share of the cores. Update callbacks of different
+worlds may then be called at the same time, so controllers used in
+several worlds must not share state between them. Defaults to
+false. */
+  static void SetParallelWorlds(bool parallel) { parallel_worlds = parallel; }
+  static bool GetParallelWorlds() { return parallel_worlds; }
+
   /** run all worlds.
  *  If only non-gui worlds were created, UpdateAll() is
  *  repeatedly called.
@@ -1054,6 +2004,33 @@ NULL if there is none. */
 class returns false, but subclasses can override this
 behaviour. */
   virtual bool IsGUI() const { return false; }
+
+  /** Returns true if thread-safe update callbacks are called one
+update late, in parallel with the next update. */
+  bool IsPipelined() const { return pipeline; }
+
+  /** Returns true if the results don't depend on the number of
+threads. */
+  bool IsDeterministic() const { return deterministic; }
+
+  /** Returns the estimated CPU time per update of the models on each
+event queue, in nsec, as of the last load balancing pass. Queue 0
+belongs to the main thread and is not balanced. */
+  const std::vector<double> &GetQueueLoads() const { return queue_loads; }
+
+  /** Returns the number of worker threads in use. With "threads auto"
+this changes as the world is tuned. */
+  unsigned int GetWorkerThreads() const { return worker_threads; }
+
+  /** Call func(chunk, arg) for each chunk from 0 to chunks-1, and
+return once they are all done. The chunks may be run at the same time
+by any of this world's threads that are waiting for the others at the
+time, such as the workers during the main thread's queue, or threads
+that have finished their own queue. May be called from any thread
+while the world updates, for work that would otherwise hold the
+others up. */
+  void ShareWork(chunk_func_t func, void *arg, unsigned int chunks);
+
   /** Open the file at the specified location, create a Worldfile
 object, read the file and configure the world from the
 contents, creating models as necessary. The created object
@@ -1076,6 +2053,21 @@ will fail), although includes (and even paths in general, e. g., for
 */
   virtual bool Load(std::istream &world_content, const std::string &worldfile_path = std::string());
 
+  /** Create a new, independent world from this one's worldfile,
+without reading or parsing it again: the clone has a copy of the
+parsed file, and the models it loads share the polygons traced from
+bitmaps with this world's. The clone starts as this world was loaded
+(or last saved), not as it is now. Its models are made in the same
+order as this world's, so their random number streams are the same
+as this world's with the same seed: give each clone a seed of its own
+with SetSeed() to vary them. Each clone runs its own controllers and worker threads, so use
+World::SetParallelWorlds() to share the cores between many clones. A
+clone of a WorldGui is a plain World, without a window. If the
+worldfile sets trajectory_log, the clone records to a file of its own,
+named with "-clone" and its number inserted before the extension.
+Returns NULL if this world has not been loaded. */
+  World *Clone() const;
+
   virtual void UnLoad();
 
   virtual void Reload();
@@ -1084,6 +2076,31 @@ will fail), although includes (and even paths in general, e. g., for
 filename.  @param Filename to save as. */
   virtual bool Save(const char *filename);
 
+  /** Copy the simulation state into snap, replacing what it held:
+the time, the queued events and, for each model, its pose,
+subscriptions, power pack and whatever state its type adds, such as
+a position model's velocity or a sensor's data. Call between
+updates, from the thread that calls Update(). */
+  void Snapshot(WorldSnapshot &snap) const;
+
+  /** Put the world back into the state saved in snap, which must
+have been taken from this world. Only the models whose state has
+changed since are touched, so restoring is cheap when little has
+happened. Models created since the snapshot are left alone, and
+controllers' own state is not saved, so they must reset themselves.
+Call between updates, from the thread that calls Update(). Returns
+false, changing nothing, if a model in the snapshot no longer exists. */
+  bool Restore(const WorldSnapshot &snap);
+
+  /** Fork the process, for the child to carry on the simulation from
+here, sharing the loaded world with the parent copy-on-write. The
+child gets worker threads of its own, since only the calling thread
+survives fork(). Returns as fork() does: the child's process ID in the
+parent, 0 in the child, or -1 on failure. Call between updates, from
+the thread that calls Update(), and not while World::UpdateAll()
+updates worlds in parallel, whose threads the child would lack. */
+  pid_t Fork();
+
   /** Run one simulation timestep. Advances the simulation clock,
 executes all simulation updates due at the current time, then
 queues up future events. */
@@ -1110,12 +2127,54 @@ discrete raytracing model */
 nonexistent */
   Model *GetModel(const std::string &name) const;
 
+  /** Find the models whose footprints (the rectangles of their
+geoms in the plane) are within range meters of a point. Writes at
+most max of them to out, in order of ID, and returns how many there
+are in all. Models for which filter(mod, arg) returns false are left
+out. Poses are sampled once per update, once the models have moved.
+The first query ever made builds the grid the queries use, which
+allocates memory; from the next update on, the world refreshes the
+grid itself before calling callbacks, so queries from thread-safe
+update callbacks then allocate nothing. */
+  size_t ModelsInRadius(const point_t &pt, meters_t range, Model **out, size_t max,
+                        model_filter_t filter = NULL, const void *arg = NULL) const;
+
+  /** Find the k models whose footprints are nearest to a point,
+nearest first, writing them to out and their distances to ranges if
+it is not NULL. Returns how many were found, which is fewer than k
+only if there are fewer models. A model added since the grid was last
+refreshed is found from the next update on. Ties go to the lower ID. Like
+ModelsInRadius(), except that it allocates room for the distances if
+ranges is NULL and k is more than 64. */
+  size_t NearestModels(const point_t &pt, size_t k, Model **out, meters_t *ranges = NULL,
+                       model_filter_t filter = NULL, const void *arg = NULL) const;
+
+  /** Find the models whose footprints overlap a polygon of n
+vertices. Writes at most max of them to out, in order of ID, and
+returns how many there are in all. */
+  size_t ModelsInPolygon(const point_t *pts, size_t n, Model **out, size_t max,
+                         model_filter_t filter = NULL, const void *arg = NULL) const;
+
   /** Returns a const reference to the set of models in the world. */
   const std::set<Model *> GetAllModels() const { return models; }
   /** Return the 3D bounding box of the world, in meters */
   const bounds3d_t &GetExtent() const { return extent; }
   /** Return the number of times the world has been updated. */
   uint64_t GetUpdateCount() const { return updates; }
+  /** Return the seed of the models' random number streams. */
+  uint32_t GetSeed() const { return seed; }
+  /** Change the seed of the models' random number streams, from the
+next update on. Gives a forked child a future of its own. */
+  void SetSeed(uint32_t s) { seed = s; }
+
+  /** Record a named value, such as a count of pucks collected, for
+whoever runs the simulation to pick up: stage-batch writes them out
+with each run's results. Replaces any earlier value of the same
+name. May be called from thread-safe callbacks. */
+  void SetMetric(const std::string &name, double value);
+
+  /** Returns a copy of the values recorded with SetMetric(). */
+  std::map<std::string, double> GetMetrics() const;
   /// Register an Option for pickup by the GUI
   void RegisterOption(Option *opt);
 
@@ -1182,6 +2241,11 @@ after constructing the block.*/
   /** Returns the first model that shares a bitmap cell with this model */
   Model *TestCollision();
 
+  /** Like TestCollision(), but visits every cell, appending a Contact
+      for each block of an unrelated model found, whether or not it
+      would collide. */
+  Model *FindContacts(std::vector<Contact> &contacts);
+
   void Load(Worldfile *wf, int entity);
 
   void Rasterize(uint8_t *data, unsigned int width, unsigned int height, meters_t cellwidth,
@@ -1227,6 +2291,9 @@ private:
 with a block in this group, or NULL, if none are detected. */
   Model *TestCollision();
 
+  /** Like TestCollision(), but appends the contacts of every block. */
+  Model *FindContacts(std::vector<Contact> &contacts);
+
   /** Renders all blocks into the bitmap at the indicated layer.*/
   void Map(unsigned int layer);
   /** Removes all blocks from the bitmap at the indicated layer.*/
@@ -1594,6 +2661,11 @@ protected:
   joules_t last_joules;
   watts_t last_watts;
 
+  // changes to the global totals held back by DissipateLocal()
+  joules_t owed_stored;
+  joules_t owed_input;
+  joules_t owed_dissipated;
+
 public:
   static joules_t global_stored;
   static joules_t global_capacity;
@@ -1645,6 +2717,22 @@ argument string, or NULL */
 
   /** Lose energy as work or heat, and record the event */
   void Dissipate(joules_t j, const Pose &p);
+
+  /** As Dissipate( j, p ), but the changes to the static global
+totals are held back until CommitGlobals(), so that different packs
+can dissipate in parallel. */
+  void DissipateLocal(joules_t j, const Pose &p);
+
+  /** Add the changes held back by DissipateLocal() to the global
+totals. */
+  void CommitGlobals();
+
+  /** Append the pack's state to a snapshot, for Model::SaveState(). */
+  void SaveState(WorldSnapshot &snap) const;
+
+  /** Read back the state saved by SaveState() at pos, and move pos
+past it, correcting the global totals. */
+  void RestoreState(const WorldSnapshot &snap, size_t &pos);
 };
 
 /// %Model class
@@ -1660,6 +2748,7 @@ class Model : public Ancestor {
   friend class PowerPack;
   friend class Ray;
   friend class ModelFiducial;
+  friend class SharedScan;
 
 private:
   /** the number of models instatiated - used to assign unique sequential IDs */
@@ -1669,6 +2758,9 @@ private:
   /** records if this model has been mapped into the world bitmap*/
   bool mapped;
 
+  /** the global pose at which each layer was last mapped */
+  Pose map_pose[2];
+
   std::vector<Option *> drawOptions;
   const std::vector<Option *> &getOptions() const { return drawOptions; }
 protected:
@@ -1689,10 +2781,18 @@ public:
   public:
     model_callback_t callback;
     void *arg;
+    /** if true, the callback may be called in a worker thread */
+    bool thread_safe;
 
-    cb_t(model_callback_t cb, void *arg) : callback(cb), arg(arg) {}
-    cb_t(world_callback_t cb, void *arg) : callback(NULL), arg(arg) { (void)cb; }
-    cb_t() : callback(NULL), arg(NULL) {}
+    cb_t(model_callback_t cb, void *arg, bool thread_safe = false)
+        : callback(cb), arg(arg), thread_safe(thread_safe)
+    {
+    }
+    cb_t(world_callback_t cb, void *arg) : callback(NULL), arg(arg), thread_safe(false)
+    {
+      (void)cb;
+    }
+    cb_t() : callback(NULL), arg(NULL), thread_safe(false) {}
     /** for placing in a sorted container */
     bool operator<(const cb_t &other) const
     {
@@ -1792,13 +2892,31 @@ offset of its local coordinate system wrt that its parent. */
 
   /** unique process-wide identifier for this model */
   uint32_t id;
+  /** the order this model was made in its world, which keys its
+      random number streams, so that they don't depend on what else
+      the process has loaded */
+  uint32_t serial;
   usec_t interval; ///< time between updates in usec
   usec_t interval_energy; ///< time between updates of powerpack in usec
   usec_t last_update; ///< time of last update in us
+
+  /** Iff true, a sensor model's Update() only records the pose and
+time to sense from, and the sensing is done when the data is next
+read. Set by the worldfile property lazy. */
+  bool lazy;
+
+  /** Whether a lazy model's data is up to date: one of the LAZY_
+constants in model.cc. Accessed atomically. */
+  mutable int lazy_state;
+
   bool log_state; ///< iff true, model state is logged
   meters_t map_resolution;
   kg_t mass;
 
+  /** The scan shared by those of our children that asked for one
+with shared_scan, or NULL. We own it. */
+  SharedScan *own_scan;
+
   /** Pointer to the parent of this model, possibly NULL. */
   Model *parent;
 
@@ -1839,6 +2957,9 @@ initially NULL. */
 
   bool rebuild_displaylist; ///< iff true, regenerate block display list before redraw
   std::string say_string; ///< if non-empty, this string is displayed in the GUI
+  Pose sense_pose; ///< our global pose at the last update, which Sense() works from
+  uint64_t sense_update; ///< the world's update count at the last update, for Sense()'s noise
+  SharedScan *shared_scan; ///< our parent's scan, if we share it, or NULL
 
   bool stack_children; ///< whether child models should be stacked on top of this model or not
 
@@ -1886,6 +3007,12 @@ allow parallel Updates(). */
   unsigned int event_queue_num;
   bool used; ///< TRUE iff this model has been returned by GetUnusedModelOfType()
 
+  /** Estimated thread CPU time taken by Update(), in nsec, as last
+measured by the world's load balancer. Zero if never measured. */
+  double update_cost;
+  uint64_t cost_sum; ///< CPU time spent in Update() in the current measurement window
+  unsigned int cost_count; ///< number of updates in the current measurement window
+
   watts_t watts; ///< power consumed by this model
 
   /** If >0, this model can transfer energy to models that have
@@ -1970,6 +3097,11 @@ collision with, or NULL if no collision exists.  Recursively
 calls TestCollision() on all descendents. */
   Model *TestCollision();
 
+  /** Like TestCollision(), but also appends to contacts every block
+of an unrelated model that shares a cell with us or our descendents,
+obstacle or not, as Block::FindContacts() does. */
+  Model *FindContacts(std::vector<Contact> &contacts);
+
   void Map(unsigned int layer);
 
   /** Call Map on all layers */
@@ -2012,16 +3144,76 @@ by pose, in local coords */
     return world->Raytrace(LocalToGlobal(pose), range, fov, func, this, arg, ztest, results);
   }
 
-  virtual void UpdateCharge();
-
-  static int UpdateWrapper(Model *mod, void *)
-  {
-    mod->Update();
-    return 0;
-  }
-
-  /** Calls CallCallback( CB_UPDATE ) */
-  void CallUpdateCallbacks(void);
+  /** Draw this model's power for one energy interval from pp, which
+is its FindPowerPack(). May be called in parallel for models with
+different packs. */
+  void DissipateEnergy(PowerPack *pp);
+
+  /** If this model can give energy, append a (this, toucher) pair for
+each touching model that can take it, ordered by toucher ID. Reads
+only the occupancy layer that Move() has finished writing, so it may
+be called in parallel after the move phase. */
+  void AppendChargeContacts(std::vector<std::pair<Model *, Model *> > &contacts);
+
+  /** Periodic update event handler. Returns non-zero to cancel the
+event once the model has no subscriptions, since then it doesn't
+need to be updated. */
+  static int UpdateWrapper(Model *mod, void *);
+
+  /** Calls the CB_UPDATE callbacks that were added with the given
+thread_safe flag, removing any that return true. */
+  void CallUpdateCallbacks(bool thread_safe);
+
+  /** Called by sensor models at the start of Update() to record the
+pose and time to sense from. Returns true if the model is lazy, in
+which case Update() should leave the sensing to Sense(), which
+SenseIfStale() calls when the data is next read. Unread data is never
+generated. Lazy models sense in Update() anyway in pipelined worlds
+with thread-safe callbacks, which read the data while the next update
+runs. */
+  bool DeferUpdate();
+
+  /** Called by sensor models before returning their data, to bring it
+up to date by calling Sense() if the last update was deferred. Safe to
+call from several threads at once. */
+  void SenseIfStale() const;
+
+  /** Share our parent's SharedScan, creating it if we are the first,
+for rays of up to range meters, tested against blocks' heights at
+height above our origin if ztest is true. Sensor models call this
+from Load() with the value of their worldfile property shared_scan:
+the number of rays to scan. 0 leaves things as they are. */
+  void ShareScan(meters_t range, unsigned int rays, bool ztest, meters_t height);
+
+  /** Generate sensor data as of sense_pose and sense_update. When
+called in a later update, the rest of the world is as it is now. */
+  virtual void Sense() {}
+
+  /** Like LocalToGlobal(), but from sense_pose rather than our current
+pose. */
+  Pose SenseToGlobal(const Pose &pose) const { return (sense_pose + geom.pose) + pose; }
+
+  /** Returns true if the world is pipelined and this model has
+thread-safe update callbacks, which will read its data while it is
+next updated. Such models should write new data into a back buffer
+in Update(), to be published by SwapDataBuffers(). */
+  bool HasPipelinedCallbacks() const;
+
+  /** In pipelined mode, publish the data written by the last
+Update(). Called in the main thread between updates. Models that
+are updated in worker threads (thread_safe is set) must override
+this, since their pipelined callbacks would otherwise see their data
+change while they read it. */
+  virtual void SwapDataBuffers() {}
+
+  /** Append the model's simulation state to a snapshot. Types with
+more state save it after calling their parent's SaveState(). */
+  virtual void SaveState(WorldSnapshot &snap) const;
+
+  /** Read back the state saved by SaveState() at pos, and move pos
+past it. Does not map the model at the restored pose: World::Restore()
+does that afterwards. */
+  virtual void RestoreState(const WorldSnapshot &snap, size_t &pos);
 
   meters_t ModelHeight() const;
 
@@ -2088,7 +3280,7 @@ public:
   /** Return a human-readable string describing the model's pose */
   std::string PoseString() { return pose.String(); }
   /** Look up a model pointer by a unique model ID */
-  static Model *LookupId(uint32_t id) { return modelsbyid[id]; }
+  static Model *LookupId(uint32_t id);
   /** Constructor */
   Model(World *world, Model *parent = NULL, const std::string &type = "model",
         const std::string &name = "");
@@ -2100,10 +3292,13 @@ public:
   Model()
       : mapped(false), alwayson(false), blockgroup(*this), boundary(false), data_fresh(false),
         disabled(true), friction(0), has_default_block(false), id(0), interval(0),
-        interval_energy(0), last_update(0), log_state(false), map_resolution(0), mass(0),
-        parent(NULL), power_pack(NULL), rebuild_displaylist(false), stack_children(true),
+        interval_energy(0), last_update(0), lazy(false), lazy_state(0), log_state(false),
+        map_resolution(0), mass(0), own_scan(NULL), parent(NULL), power_pack(NULL),
+        rebuild_displaylist(false), sense_pose(), sense_update(0), shared_scan(NULL),
+        stack_children(true),
         stall(false), subs(0), thread_safe(false), trail_index(0), event_queue_num(0), used(false),
-        watts(0), watts_give(0), watts_take(0), wf(NULL), wf_entity(0), world(NULL), world_gui(NULL)
+        update_cost(0), cost_sum(0), cost_count(0), watts(0), watts_give(0), watts_take(0),
+        wf(NULL), wf_entity(0), world(NULL), world_gui(NULL)
   {
   }
 
@@ -2199,10 +3394,12 @@ model has no parent */
   /** get the pose of a model in the global CS */
   Pose GetGlobalPose() const;
 
-  /** subscribe to a model's data */
+  /** subscribe to a model's data. From a thread-safe update
+callback this takes effect once the update's thread-safe callbacks
+have returned. */
   void Subscribe();
 
-  /** unsubscribe from a model's data */
+  /** unsubscribe from a model's data, deferred like Subscribe() */
   void Unsubscribe();
 
   /** set the pose of model in global coordinates */
@@ -2233,6 +3430,19 @@ matching key can detect this model as a fiducial. */
   Color GetColor() const { return color; }
   /** return a model's unique process-wide identifier */
   uint32_t GetId() const { return id; }
+
+  /** Returns a random number stream for this model in the current
+update, keyed by the world's seed, the order we were made in the
+world and the update count. The
+same stream number gives the same numbers every time in an update, so
+draw everything needed in an update from one Rng object, and use
+different streams for independent uses. Streams from Rng::INTERNAL up
+are reserved for Stage. Safe to call from any thread. */
+  Rng GetRng(uint32_t stream = 0) const;
+
+  /** Returns the random number stream that GetRng() returned in the
+given update. */
+  Rng GetRng(uint32_t stream, uint64_t update) const;
   /** Get the total mass of a model and it's children recursively */
   kg_t GetTotalMass() const;
 
@@ -2276,9 +3486,23 @@ system.  */
 indicated model method is called, and passed the user
 data.  @param cb Pointer the function to be called.  @param
 user Pointer to arbitrary user data, passed to the callback
-when called.
+when called. @param thread_safe If true, a CB_UPDATE callback
+may be called in a worker thread, in parallel with the update
+callbacks of other robots (i.e. models with a different Root()). The
+thread-safe callbacks of one robot are called in series. This is
+safe for controllers that only
+read and command the models of their own robot and share no
+state with other robots (note that all callers of random() share
+one sequence, unlike the streams from GetRng()). Commanding means
+setting speeds and other per-model settings: Subscribe() and
+Unsubscribe() take effect only once all the thread-safe callbacks
+of the update have returned, and SetPose(), AddCallback() and
+RemoveCallback() may not be called at all (debug builds assert
+this). Other callbacks are called in series in the main
+thread. The flag is ignored for other callback types.
   */
-  void AddCallback(callback_type_t type, model_callback_t cb, void *user);
+  void AddCallback(callback_type_t type, model_callback_t cb, void *user,
+                   bool thread_safe = false);
 
   int RemoveCallback(callback_type_t type, model_callback_t callback);
 
@@ -2297,6 +3521,10 @@ pose specified in the model's local coordinate system */
   /** Return a vector of global pixels corresponding to a vector of local points. */
   std::vector<point_int_t> LocalToPixels(const std::vector<point_t> &local) const;
 
+  /** As LocalToPixels(), as if the model were at global pose gpose. */
+  std::vector<point_int_t> LocalToPixels(const std::vector<point_t> &local,
+                                         const Pose &gpose) const;
+
   /** Return the 2d point in world coordinates of a 2d point
 specified in the model's local coordinate system */
   point_t LocalToGlobal(const point_t &pt) const;
@@ -2374,16 +3602,27 @@ public:
   virtual void Startup();
   virtual void Shutdown();
   virtual void Update();
+  virtual void Sense();
   virtual void Load();
+  virtual void SaveState(WorldSnapshot &snap) const;
+  virtual void RestoreState(const WorldSnapshot &snap, size_t &pos);
 
   /** Returns a non-mutable const reference to the detected blob
 data. Use this if you don't need to modify the model's
 internal data, e.g. if you want to copy it into a new
 vector.*/
-  const std::vector<Blob> &GetBlobs() const { return blobs; }
+  const std::vector<Blob> &GetBlobs() const
+  {
+    SenseIfStale();
+    return blobs;
+  }
   /** Returns a mutable reference to the model's internal detected
 blob data. Use this with caution, if at all. */
-  std::vector<Blob> &GetBlobsMutable() { return blobs; }
+  std::vector<Blob> &GetBlobsMutable()
+  {
+    SenseIfStale();
+    return blobs;
+  }
   /** Start finding blobs with this color.*/
   void AddColor(Color col);
 
@@ -2534,6 +3773,15 @@ protected:
   virtual void Shutdown();
   virtual void Update();
   virtual void Print(char *prefix) const;
+  virtual void SwapDataBuffers();
+
+  /** samples being written by Update() in pipelined mode */
+  BumperSample *samples_back;
+
+  /** if true, bumpers on a moving ModelPosition read its contacts
+instead of raytracing */
+  bool use_contacts;
+  ModelPosition *contact_host; ///< the model whose contacts we read
 
   class BumperVis : public Visualizer {
   public:
@@ -2567,15 +3815,20 @@ public:
 
 private:
   /// if neighbor is visible, add him to the fiducial scan
-  void AddModelIfVisible(Model *him);
+  void AddModelIfVisible(Model *him, std::vector<Fiducial> &found);
 
   virtual void Update();
+  virtual void Sense();
   virtual void DataVisualize(Camera *cam);
+  virtual void SwapDataBuffers();
+  virtual void SaveState(WorldSnapshot &snap) const;
+  virtual void RestoreState(const WorldSnapshot &snap, size_t &pos);
 
   static Option showData;
   static Option showFov;
 
   std::vector<Fiducial> fiducials;
+  std::vector<Fiducial> fiducials_back; ///< written by Update() in pipelined mode
 
 public:
   ModelFiducial(World *world, Model *parent, const std::string &type);
@@ -2594,10 +3847,15 @@ public:
   /// fiducial detector?
 
   /** Access the dectected fiducials. C++ style. */
-  std::vector<Fiducial> &GetFiducials() { return fiducials; }
+  std::vector<Fiducial> &GetFiducials()
+  {
+    SenseIfStale();
+    return fiducials;
+  }
   /** Access the dectected fiducials, C style. */
   Fiducial *GetFiducials(unsigned int *count)
   {
+    SenseIfStale();
     if (count)
       *count = fiducials.size();
     return &fiducials[0];
@@ -2638,29 +3896,48 @@ public:
     double range_noise; //< variance for range readings
     double range_noise_const; //< variance for constant noise (not depending on range)
     unsigned int sample_count;
+    unsigned int split_samples; //< scans this long are shared between threads, unless zero
+    unsigned int shared_rays; //< rays in our parent's shared scan, or zero to trace our own
     Color color;
 
     std::vector<meters_t> ranges;
     std::vector<double> intensities;
     std::vector<double> bearings;
 
+    // written by Update() in pipelined mode, then swapped with the above
+    std::vector<meters_t> ranges_back;
+    std::vector<double> intensities_back;
+    std::vector<double> bearings_back;
+
+    std::vector<double> noise; // a scan's noise, drawn in bulk by Update()
+
     Sensor()
         : pose(0, 0, 0, 0), size(0.02, 0.02, 0.02), // teeny transducer
           range(0.0, 5.0), fov(0.1), angle_noise(0.0), range_noise(0.0), range_noise_const(0.0),
-          sample_count(1), color(Color(0, 0, 1, 0.15)), ranges(), intensities(), bearings()
+          sample_count(1), split_samples(1000), shared_rays(0), color(Color(0, 0, 1, 0.15)), ranges(), intensities(), bearings(),
+          ranges_back(), intensities_back(), bearings_back(), noise()
     {
     }
 
     void Update(ModelRanger *rgr);
+    void SwapBuffers();
     void Visualize(Vis *vis, ModelRanger *rgr) const;
     std::string String() const;
     void Load(Worldfile *wf, int entity);
   };
 
   /** returns a const reference to a vector of range and reflectance samples */
-  const std::vector<Sensor> &GetSensors() const { return sensors; }
+  const std::vector<Sensor> &GetSensors() const
+  {
+    SenseIfStale();
+    return sensors;
+  }
   /** returns a mutable reference to a vector of range and reflectance samples */
-  std::vector<Sensor> &GetSensorsMutable() { return sensors; }
+  std::vector<Sensor> &GetSensorsMutable()
+  {
+    SenseIfStale();
+    return sensors;
+  }
   void LoadSensor(Worldfile *wf, int entity);
 
 private:
@@ -2670,6 +3947,10 @@ protected:
   virtual void Startup();
   virtual void Shutdown();
   virtual void Update();
+  virtual void Sense();
+  virtual void SwapDataBuffers();
+  virtual void SaveState(WorldSnapshot &snap) const;
+  virtual void RestoreState(const WorldSnapshot &snap, size_t &pos);
 };
 
 // BLINKENLIGHT MODEL ----------------------------------------------------
@@ -2726,10 +4007,19 @@ private:
   double _yaw_offset; // position camera is mounted at
   double _pitch_offset;
 
+  bool _cpu_render; // iff true, frames are ray cast in software instead of drawn with OpenGL
+
+  /// Allocate the frame buffers, if not already done
+  void AllocateFrame();
+
   /// Take a screenshot from the camera's perspective. return: true for sucess, and data is
   /// available via FrameDepth() / FrameColor()
   bool GetFrame();
 
+  /// As GetFrame(), but ray cast through the world's blocks without
+  /// OpenGL, so it works in headless worlds and on worker threads
+  bool GetFrameCPU();
+
 public:
   ModelCamera(World *world, Model *parent, const std::string &type);
 
@@ -2797,6 +4087,25 @@ private:
   Velocity integration_error; ///< errors to apply in simple odometry model
   double wheelbase;
 
+  /** The contacts found by Move() in each bitmap layer, and the value
+of updates when they were found, plus one. */
+  std::vector<Contact> contacts[2];
+  uint64_t contacts_updates[2];
+  unsigned int contact_subs; ///< the number of SubscribeContacts() calls
+
+  /** Returns the contacts being recorded in this update, emptying
+them first if they are from an earlier one. */
+  std::vector<Contact> &Contacts();
+
+  /** Move the points of contacts from first on with us, from global
+pose from to global pose to. */
+  static void CarryContacts(std::vector<Contact> &contacts, size_t first, const Pose &from,
+                            const Pose &to);
+
+  /** Returns the model at or above mod that records contacts, or
+NULL. */
+  static ModelPosition *ContactRecorder(Model *mod);
+
 public:
   /** Set the min and max acceleration in all 4 DOF */
   Bounds acceleration_bounds[4];
@@ -2820,6 +4129,21 @@ frame. */
 
   /** Get (a copy of) the model's odometry integration error. */
   Velocity GetOdomError() const { return integration_error; }
+
+  /** Make Move() record the models it finds touching us, at the cost
+of a full collision test, until a matching UnsubscribeContacts(). */
+  void SubscribeContacts() { ++contact_subs; }
+  void UnsubscribeContacts() { --contact_subs; }
+
+  /** Returns the contacts recorded in the last update: those Move()
+found, with their points carried back to our pose if we stalled, and
+those of other position models that bumped into us, with the bumper
+as their model. These
+match the bitmap layer sensors see in this update. Returns NULL if
+nothing was recorded, because we neither moved nor were bumped into,
+or nobody subscribed. */
+  const std::vector<Contact> *GetContacts() const;
+
   /** Specify a point in space. Arrays of Waypoints can be attached to
 Models and visualized. */
   class Waypoint {
@@ -2884,6 +4208,8 @@ protected:
   virtual void Shutdown();
   virtual void Update();
   virtual void Load();
+  virtual void SaveState(WorldSnapshot &snap) const;
+  virtual void RestoreState(const WorldSnapshot &snap, size_t &pos);
 };
 
 // ACTUATOR MODEL --------------------------------------------------------
@@ -2939,6 +4265,67 @@ the goal pose */
   point3_t GetAxis() const { return axis; }
 };
 
+// WIFI MODEL --------------------------------------------------------
+
+/// %ModelWifi class
+class ModelWifi : public Model {
+public:
+  /** Define how the signal weakens with distance */
+  typedef enum { PATHLOSS_FREE_SPACE, PATHLOSS_LOG_DISTANCE } PathLoss;
+
+  /** A wifi model whose signal we receive above our sensitivity */
+  class Link {
+  public:
+    ModelWifi *peer; ///< the transmitting model
+    meters_t range; ///< the distance to it
+    unsigned int walls; ///< the number of walls between us
+    double rssi; ///< the received signal strength, in dBm
+  };
+
+protected:
+  virtual void Startup();
+  virtual void Shutdown();
+  virtual void Update();
+  virtual void Sense();
+  virtual void DataVisualize(Camera *cam);
+  virtual void SwapDataBuffers();
+  virtual void SaveState(WorldSnapshot &snap) const;
+  virtual void RestoreState(const WorldSnapshot &snap, size_t &pos);
+
+  static Option showLinks;
+
+  std::vector<Link> links;
+  std::vector<Link> links_back; ///< written by Update() in pipelined mode
+
+public:
+  ModelWifi(World *world, Model *parent, const std::string &type);
+  virtual ~ModelWifi();
+
+  virtual void Load();
+
+  double tx_power; ///< transmit power, in dBm
+  double rx_sensitivity; ///< the weakest signal we receive, in dBm
+  double frequency; ///< carrier frequency, in MHz
+  PathLoss path_loss; ///< how the signal weakens with distance
+  double exponent; ///< path loss exponent of the log-distance model
+  meters_t ref_distance; ///< the log-distance model applies beyond this range
+  double wall_loss; ///< attenuation of each wall crossed, in dB
+  meters_t range_max; ///< if non-zero, no link is longer than this
+
+  /** Returns the path loss at range meters with no walls, in dB. */
+  double PathLossAt(meters_t range) const;
+
+  /** Returns the range in meters at which the path loss reaches loss dB. */
+  meters_t RangeForLoss(double loss) const;
+
+  /** Access the links found in the last update, in order of peer ID. */
+  std::vector<Link> &GetLinks()
+  {
+    SenseIfStale();
+    return links;
+  }
+};
+
 } // end namespace stg
 
 #endif
@@ -0,0 +1,164 @@
+/*
+  threadtune.cc
+  choosing the number of worker threads to use by timing updates with
+  different numbers of them, for "threads auto".
+*/
+
+#include <limits.h>
+
+#include "barrier.hh"
+#include "stage.hh"
+using namespace Stg;
+
+// number of updates to skip after changing the number of threads,
+// while the caches and the load balancing settle down
+static const uint64_t TUNE_WARMUP(20);
+
+// number of updates timed with each number of threads
+static const uint64_t TUNE_TRIAL(100);
+
+// once tuned, the number of updates between checks of the number of
+// subscribed models
+static const uint64_t TUNE_CHECK(100);
+
+// retune when the number of subscribed models changes by more than
+// this fraction
+static const double TUNE_CHANGE(0.25);
+
+// stop adding threads once a trial is this much slower than the best
+// so far: it is unlikely to get better with more
+static const double TUNE_WORSE(1.15);
+
+// value of tune_trial when not tuning
+static const unsigned int TUNED(UINT_MAX);
+
+unsigned int World::CountParallelModels() const
+{
+  unsigned int count(0);
+  FOR_EACH (it, models)
+    if ((*it)->event_queue_num > 0 && (*it)->subs > 0)
+      ++count;
+  return count;
+}
+
+void World::StartTuning()
+{
+  // try 1, 2, 4 ... threads and all of them
+  tune_counts.clear();
+  for (unsigned int n(1); n < max_worker_threads; n *= 2)
+    tune_counts.push_back(n);
+  tune_counts.push_back(max_worker_threads);
+
+  tune_times.clear();
+  tune_trial = 0;
+  tune_start = updates + TUNE_WARMUP;
+  tune_wall = 0;
+  tuned_models = CountParallelModels();
+
+  SetWorkerThreads(tune_counts[0]);
+}
+
+void World::TuneThreads(double update_nsec)
+{
+  if (!auto_threads || max_worker_threads < 2)
+    return;
+
+  if (tune_trial == TUNED) {
+    if (updates % TUNE_CHECK == 0) {
+      const double n(CountParallelModels());
+      if (fabs(n - tuned_models) > TUNE_CHANGE * std::max(tuned_models, 1U))
+        StartTuning();
+    }
+    return;
+  }
+
+  if (updates <= tune_start)
+    return;
+
+  tune_wall += update_nsec;
+
+  if (updates < tune_start + TUNE_TRIAL)
+    return;
+
+  // wall time per simulated second
+  const double t(tune_wall / (TUNE_TRIAL * (double)sim_interval / 1e6));
+  tune_times.push_back(t);
+
+  if (show_load)
+    printf("\n[threads %u: %.1f msec/sec]\n", tune_counts[tune_trial], t / 1e6);
+
+  const size_t best(std::min_element(tune_times.begin(), tune_times.end()) - tune_times.begin());
+
+  if (++tune_trial < tune_counts.size() && t < TUNE_WORSE * tune_times[best]) {
+    // try the next number of threads
+    tune_start = updates + TUNE_WARMUP;
+    tune_wall = 0;
+    SetWorkerThreads(tune_counts[tune_trial]);
+    return;
+  }
+
+  // settle on the fastest
+  tune_trial = TUNED;
+  tuned_models = CountParallelModels();
+  SetWorkerThreads(tune_counts[best]);
+
+  printf("[threads %u]", worker_threads);
+  fflush(stdout);
+}
+
+void World::SetWorkerThreads(unsigned int n)
+{
+  n = std::max(1U, std::min(n, max_worker_threads));
+  if (n == worker_threads)
+    return;
+
+  const unsigned int old(worker_threads);
+  worker_threads = n;
+
+  // the workers still in use take over the models of those that are
+  // parking
+  AssignQueues(true);
+
+  // threads that are parking meet the others once more, at the start
+  // of the next update, then the barrier opens for the new number
+  tick_barrier->SetNextParties(n + 1);
+
+  if (n > old)
+    unpark = true;
+  else
+    for (unsigned int t(n + 1); t <= old; ++t)
+      __atomic_store_n(&parked[t], 1, __ATOMIC_RELEASE);
+}
+
+void World::Park(unsigned int t)
+{
+  pthread_mutex_lock(&park_mutex);
+  while (IsParked(t))
+    pthread_cond_wait(&park_cond, &park_mutex);
+  pthread_mutex_unlock(&park_mutex);
+}
+
+void World::UnparkWorkers()
+{
+  pthread_mutex_lock(&park_mutex);
+  for (unsigned int t(1); t <= worker_threads; ++t)
+    __atomic_store_n(&parked[t], 0, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&park_cond);
+  pthread_mutex_unlock(&park_mutex);
+
+  unpark = false;
+}
+
+void World::LimitWorkerThreads(unsigned int n)
+{
+  n = std::max(1U, n);
+  if (n >= max_worker_threads)
+    return;
+
+  // the workers above n are parked and never woken again
+  SetWorkerThreads(std::min(worker_threads, n));
+  max_worker_threads = n;
+
+  if (auto_threads)
+    StartTuning();
+}
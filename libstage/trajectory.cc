@@ -0,0 +1,461 @@
+/*
+  trajectory.cc
+  recording the trajectories of models to a compact binary file, with
+  a writer thread, and reading them back.
+*/
+
+#include <limits.h> // for PATH_MAX
+#include <pthread.h>
+#include <stdlib.h> // for realpath(3)
+#include <zlib.h>
+
+#include "stage.hh"
+using namespace Stg;
+
+const char TrajectoryLog::MAGIC[8] = { 'S', 'T', 'G', 'T', 'R', 'J', '0', '1' };
+const unsigned int TrajectoryLog::COLUMNS;
+
+// the columns of doubles, in the order they are stored
+enum { COL_X, COL_Y, COL_Z, COL_A, COL_VX, COL_VY, COL_VZ, COL_VA, COL_ENERGY };
+
+// compressing a block is done by the writer, so the simulation only
+// waits for it if the writer falls a whole block behind
+static const int TRAJECTORY_ZLIB_LEVEL(Z_BEST_SPEED);
+
+// the files open for recording in this process, by real path, so that
+// no two logs truncate and interleave one file
+static std::set<std::string> open_paths;
+static pthread_mutex_t open_paths_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// the real path of an existing file, else the empty string
+static std::string real_path(const std::string &filename)
+{
+  char buf[PATH_MAX];
+  return realpath(filename.c_str(), buf) ? std::string(buf) : std::string();
+}
+
+TrajectoryLog::TrajectoryLog()
+    : file(NULL), path(), capacity(0), compress(false), models(), positions(), models_changed(false),
+      filling(&blocks[0]), pending(NULL), writer(), closing(false), index(), offset(0),
+      failed(false)
+{
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+}
+
+TrajectoryLog::~TrajectoryLog()
+{
+  Close();
+}
+
+bool TrajectoryLog::Open(const std::string &filename, unsigned int ticks, bool compress)
+{
+  Close();
+
+  // a file that doesn't exist yet can't be open, and once it has been
+  // created its real path is known
+  pthread_mutex_lock(&open_paths_mutex);
+  if (open_paths.count(real_path(filename))) {
+    pthread_mutex_unlock(&open_paths_mutex);
+    PRINT_ERR1("trajectory log %s is already being recorded", filename.c_str());
+    return false;
+  }
+
+  file = fopen(filename.c_str(), "wb");
+  if (file) {
+    path = real_path(filename);
+    open_paths.insert(path);
+  }
+  pthread_mutex_unlock(&open_paths_mutex);
+
+  if (!file)
+    return false;
+
+  capacity = std::max(ticks, 1U);
+  this->compress = compress;
+  models_changed = true;
+  blocks[0].ticks = blocks[1].ticks = 0;
+  filling = &blocks[0];
+  pending = NULL;
+  closing = false;
+  index.clear();
+  failed = false;
+
+  offset = fwrite(MAGIC, 1, sizeof(MAGIC), file);
+
+  pthread_create(&writer, NULL, TrajectoryLog::writer_entry, this);
+  return true;
+}
+
+void TrajectoryLog::Close()
+{
+  if (!file)
+    return;
+
+  if (filling->ticks)
+    HandOff();
+
+  pthread_mutex_lock(&mutex);
+  closing = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(writer, NULL);
+
+  IndexTrailer trailer;
+  trailer.offset = offset;
+  trailer.count = index.size();
+  memcpy(trailer.magic, MAGIC, sizeof(MAGIC));
+
+  if (!index.empty())
+    fwrite(&index[0], sizeof(BlockIndex), index.size(), file);
+  fwrite(&trailer, sizeof(trailer), 1, file);
+
+  if (fclose(file) != 0 && !failed)
+    PRINT_ERR("failed to close the trajectory log");
+  file = NULL;
+
+  pthread_mutex_lock(&open_paths_mutex);
+  open_paths.erase(path);
+  pthread_mutex_unlock(&open_paths_mutex);
+}
+
+void TrajectoryLog::Add(Model *mod)
+{
+  std::vector<Model *>::iterator it(
+      std::lower_bound(models.begin(), models.end(), mod, World::ltid()));
+  if (it != models.end() && *it == mod)
+    return;
+
+  positions.insert(positions.begin() + (it - models.begin()),
+                   dynamic_cast<ModelPosition *>(mod));
+  models.insert(it, mod);
+  models_changed = true;
+}
+
+void TrajectoryLog::Remove(Model *mod)
+{
+  std::vector<Model *>::iterator it(
+      std::lower_bound(models.begin(), models.end(), mod, World::ltid()));
+  if (it == models.end() || *it != mod)
+    return;
+
+  positions.erase(positions.begin() + (it - models.begin()));
+  models.erase(it);
+  models_changed = true;
+}
+
+void TrajectoryLog::Record(usec_t now)
+{
+  if (!file)
+    return;
+
+  // a block holds one set of models, and times that only increase,
+  // which they don't after the world is restored from a snapshot
+  if (filling->ticks && (models_changed || now <= filling->times[filling->ticks - 1]))
+    HandOff();
+
+  if (models.empty())
+    return;
+
+  Block &b(*filling);
+  const size_t count(models.size());
+
+  if (b.ticks == 0) {
+    b.times.resize(capacity);
+    b.ids.resize(count);
+    for (size_t m(0); m < count; ++m)
+      b.ids[m] = models[m]->GetId();
+    b.values.resize(COLUMNS * count * capacity);
+    b.stalls.resize(count * capacity);
+    models_changed = false;
+  }
+
+  const unsigned int t(b.ticks);
+  b.times[t] = now;
+
+  const size_t stride(count * capacity);
+  double *v(&b.values[t]);
+  for (size_t m(0); m < count; ++m, v += capacity) {
+    const Model *mod(models[m]);
+    const Pose pose(mod->GetGlobalPose());
+    const Velocity vel(positions[m] ? positions[m]->GetVelocity() : Velocity());
+    const PowerPack *pp(mod->FindPowerPack());
+
+    v[COL_X * stride] = pose.x;
+    v[COL_Y * stride] = pose.y;
+    v[COL_Z * stride] = pose.z;
+    v[COL_A * stride] = pose.a;
+    v[COL_VX * stride] = vel.x;
+    v[COL_VY * stride] = vel.y;
+    v[COL_VZ * stride] = vel.z;
+    v[COL_VA * stride] = vel.a;
+    v[COL_ENERGY * stride] = pp ? pp->GetStored() : 0.0;
+    b.stalls[m * capacity + t] = mod->Stalled();
+  }
+
+  if (++b.ticks == capacity)
+    HandOff();
+}
+
+void TrajectoryLog::HandOff()
+{
+  pthread_mutex_lock(&mutex);
+  while (pending)
+    pthread_cond_wait(&cond, &mutex);
+  pending = filling;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+
+  filling = (filling == &blocks[0]) ? &blocks[1] : &blocks[0];
+  filling->ticks = 0;
+}
+
+void TrajectoryLog::Flush()
+{
+  pthread_mutex_lock(&mutex);
+  while (pending)
+    pthread_cond_wait(&cond, &mutex);
+  pthread_mutex_unlock(&mutex);
+}
+
+void TrajectoryLog::Detach()
+{
+  if (!file)
+    return;
+
+  // the writer and anything waiting on the lock stayed in the parent
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+
+  // the file stays in open_paths: the parent is still recording it
+  fclose(file);
+  file = NULL;
+  pending = NULL;
+  filling->ticks = 0;
+}
+
+std::string TrajectoryLog::Suffixed(const std::string &filename, const std::string &suffix)
+{
+  const size_t slash(filename.rfind('/'));
+  const size_t dot(filename.rfind('.'));
+  if (dot == std::string::npos || dot == 0 || (slash != std::string::npos && dot <= slash + 1))
+    return filename + suffix;
+
+  return filename.substr(0, dot) + suffix + filename.substr(dot);
+}
+
+void *TrajectoryLog::writer_entry(void *arg)
+{
+  TrajectoryLog *log(static_cast<TrajectoryLog *>(arg));
+
+  pthread_mutex_lock(&log->mutex);
+  while (1) {
+    while (!log->pending && !log->closing)
+      pthread_cond_wait(&log->cond, &log->mutex);
+    if (!log->pending)
+      break;
+
+    // the block is ours until we hand it back
+    pthread_mutex_unlock(&log->mutex);
+    log->Write(*log->pending);
+    pthread_mutex_lock(&log->mutex);
+
+    log->pending = NULL;
+    pthread_cond_broadcast(&log->cond);
+  }
+  pthread_mutex_unlock(&log->mutex);
+
+  return NULL;
+}
+
+void TrajectoryLog::Write(const Block &b)
+{
+  const size_t count(b.ids.size());
+  const size_t stride(count * capacity);
+
+  // pack the block's columns, leaving out the ticks it didn't fill
+  std::vector<uint8_t> raw;
+  raw.reserve(b.ticks * sizeof(usec_t) + count * sizeof(uint32_t)
+              + (COLUMNS * sizeof(double) + 1) * count * b.ticks);
+  raw.insert(raw.end(), (const uint8_t *)&b.times[0], (const uint8_t *)(&b.times[0] + b.ticks));
+  for (unsigned int c(0); c < COLUMNS; ++c)
+    for (size_t m(0); m < count; ++m) {
+      const double *v(&b.values[c * stride + m * capacity]);
+      raw.insert(raw.end(), (const uint8_t *)v, (const uint8_t *)(v + b.ticks));
+    }
+  raw.insert(raw.end(), (const uint8_t *)&b.ids[0], (const uint8_t *)(&b.ids[0] + count));
+  for (size_t m(0); m < count; ++m)
+    raw.insert(raw.end(), &b.stalls[m * capacity], &b.stalls[m * capacity] + b.ticks);
+
+  BlockHeader header;
+  header.ticks = b.ticks;
+  header.models = count;
+  header.raw_size = raw.size();
+  header.size = raw.size();
+
+  // keep the compressed data only if it is smaller
+  std::vector<uint8_t> packed;
+  if (compress) {
+    uLongf size(compressBound(raw.size()));
+    packed.resize(size);
+    if (compress2(&packed[0], &size, &raw[0], raw.size(), TRAJECTORY_ZLIB_LEVEL) == Z_OK
+        && size < raw.size())
+      header.size = size;
+  }
+  const uint8_t *data(header.size < header.raw_size ? &packed[0] : &raw[0]);
+
+  BlockIndex entry;
+  entry.first = b.times[0];
+  entry.last = b.times[b.ticks - 1];
+  entry.offset = offset;
+
+  if (fwrite(&header, sizeof(header), 1, file) != 1
+      || fwrite(data, 1, header.size, file) != header.size) {
+    if (!failed)
+      PRINT_ERR("failed to write to the trajectory log");
+    failed = true;
+    return;
+  }
+
+  index.push_back(entry);
+  offset += sizeof(header) + header.size;
+}
+
+TrajectoryReader::TrajectoryReader() : file(NULL), index()
+{
+}
+
+TrajectoryReader::~TrajectoryReader()
+{
+  Close();
+}
+
+void TrajectoryReader::Close()
+{
+  if (file)
+    fclose(file);
+  file = NULL;
+  index.clear();
+}
+
+bool TrajectoryReader::Open(const std::string &filename)
+{
+  Close();
+
+  file = fopen(filename.c_str(), "rb");
+  if (!file)
+    return false;
+
+  char magic[sizeof(TrajectoryLog::MAGIC)];
+  if (fread(magic, sizeof(magic), 1, file) != 1
+      || memcmp(magic, TrajectoryLog::MAGIC, sizeof(magic)) != 0) {
+    Close();
+    return false;
+  }
+
+  TrajectoryLog::IndexTrailer trailer;
+  if (fseeko(file, -(off_t)sizeof(trailer), SEEK_END) == 0
+      && fread(&trailer, sizeof(trailer), 1, file) == 1
+      && memcmp(trailer.magic, TrajectoryLog::MAGIC, sizeof(trailer.magic)) == 0) {
+    index.resize(trailer.count);
+    if (trailer.count == 0
+        || (fseeko(file, trailer.offset, SEEK_SET) == 0
+            && fread(&index[0], sizeof(TrajectoryLog::BlockIndex), trailer.count, file)
+                   == trailer.count))
+      return true;
+    index.clear();
+  }
+
+  // no index, so find the whole blocks from their headers
+  uint64_t offset(sizeof(magic));
+  TrajectoryLog::BlockHeader header;
+  while (fseeko(file, offset, SEEK_SET) == 0 && fread(&header, sizeof(header), 1, file) == 1
+         && header.ticks > 0) {
+    const uint64_t data(offset + sizeof(header));
+    std::vector<usec_t> times(header.ticks);
+    if (header.size == header.raw_size) {
+      if (fread(&times[0], sizeof(usec_t), header.ticks, file) != header.ticks)
+        break;
+    } else {
+      std::vector<uint8_t> packed(header.size);
+      std::vector<uint8_t> raw(header.raw_size);
+      uLongf size(header.raw_size);
+      if (fread(&packed[0], 1, header.size, file) != header.size
+          || uncompress(&raw[0], &size, &packed[0], header.size) != Z_OK)
+        break;
+      memcpy(&times[0], &raw[0], header.ticks * sizeof(usec_t));
+    }
+
+    TrajectoryLog::BlockIndex entry;
+    entry.first = times.front();
+    entry.last = times.back();
+    entry.offset = offset;
+    index.push_back(entry);
+
+    offset = data + header.size;
+  }
+
+  return true;
+}
+
+bool TrajectoryReader::Read(usec_t start, usec_t end, std::vector<Sample> &samples)
+{
+  if (!file)
+    return false;
+
+  FOR_EACH (it, index) {
+    if (it->last < start || it->first > end)
+      continue;
+
+    TrajectoryLog::BlockHeader header;
+    if (fseeko(file, it->offset, SEEK_SET) != 0 || fread(&header, sizeof(header), 1, file) != 1)
+      return false;
+
+    std::vector<uint8_t> raw(header.raw_size);
+    if (header.size == header.raw_size) {
+      if (fread(&raw[0], 1, header.size, file) != header.size)
+        return false;
+    } else {
+      std::vector<uint8_t> packed(header.size);
+      uLongf size(header.raw_size);
+      if (fread(&packed[0], 1, header.size, file) != header.size
+          || uncompress(&raw[0], &size, &packed[0], header.size) != Z_OK || size != header.raw_size)
+        return false;
+    }
+
+    const size_t ticks(header.ticks), count(header.models);
+    if (raw.size() != ticks * sizeof(usec_t) + count * sizeof(uint32_t)
+                          + (TrajectoryLog::COLUMNS * sizeof(double) + 1) * count * ticks)
+      return false;
+
+    const usec_t *times((const usec_t *)&raw[0]);
+    const double *values((const double *)(times + ticks));
+    const uint32_t *ids((const uint32_t *)(values + TrajectoryLog::COLUMNS * count * ticks));
+    const uint8_t *stalls((const uint8_t *)(ids + count));
+
+    // the value of column c for model m at tick t
+#define TRAJECTORY_VALUE(c, m, t) values[((c) * count + (m)) * ticks + (t)]
+
+    for (size_t t(0); t < ticks; ++t) {
+      if (times[t] < start || times[t] > end)
+        continue;
+
+      for (size_t m(0); m < count; ++m) {
+        Sample s;
+        s.time = times[t];
+        s.id = ids[m];
+        s.pose = Pose(TRAJECTORY_VALUE(COL_X, m, t), TRAJECTORY_VALUE(COL_Y, m, t),
+                      TRAJECTORY_VALUE(COL_Z, m, t), TRAJECTORY_VALUE(COL_A, m, t));
+        s.velocity = Velocity(TRAJECTORY_VALUE(COL_VX, m, t), TRAJECTORY_VALUE(COL_VY, m, t),
+                              TRAJECTORY_VALUE(COL_VZ, m, t), TRAJECTORY_VALUE(COL_VA, m, t));
+        s.stall = stalls[m * ticks + t];
+        s.energy = TRAJECTORY_VALUE(COL_ENERGY, m, t);
+        samples.push_back(s);
+      }
+    }
+
+#undef TRAJECTORY_VALUE
+  }
+
+  return true;
+}
@@ -23,7 +23,21 @@
 
     show_clock                0
     show_clock_interval     100
+    seed                      0
+    fiducial_grid             0
+    fiducial_los_cache        0
+    wifi_wall_cache         0.5
+    model_grid                2.0
     threads                   1
+    thread_spin               0
+    pipeline                  0
+    deterministic             0
+    load_balance              1
+    load_balance_interval  1000
+    show_load                 0
+    trajectory_log           ""
+    trajectory_block        100
+    trajectory_compress       1
 
     @endverbatim
 
@@ -62,6 +76,44 @@
     if $show_clock is enabled. The default is once every 10 simulated
     seconds. Smaller values slow the simulation down a little.
 
+    - seed <int>\n
+    Seeds the random numbers used by models, such as ranger noise and
+    odometry error. Each model draws its own stream, which depends
+    only on the seed, the order the model was made in the world and
+    the update count, so runs with the same seed give the same results
+    with any number of threads, and in any process.
+
+    - fiducial_grid <float>\n
+    The size in meters of the cells of the grid used to find the
+    fiducials near each fiducial sensor. If zero, the cells are as
+    large as the longest fiducial sensor range, which is usually
+    best.
+
+    - fiducial_los_cache <int>\n
+    If non-zero, the line of sight between two robots is traced once
+    per update and sensor height, from the origin of the one with the
+    lower ID, and shared by the fiducial sensors of each that look
+    for fiducials on the other, so robots that see each other cost
+    one trace instead of two. Only sensors and fiducials within a
+    cell of their robot's origin use it. Seen from the other robot,
+    a ray that grazes a third model can differ from tracing from the
+    sensor itself, and models overlapping that robot are missed.
+
+    - wifi_wall_cache <float>\n
+    The size in meters of the cells used to cache the number of walls
+    between wifi models. The walls between two cells are counted once,
+    between their centers, and the count is reused for every pair of
+    wifi models in them. The walls are mapped the first time they are
+    counted, so this assumes that they don't move. Only
+    obstacles that no position model carries count as walls. If zero,
+    the walls are counted between the models themselves each time.
+
+    - model_grid <float>\n
+    The size in meters of the cells of the grid used by spatial
+    queries such as World::ModelsInRadius(). About the size of the
+    typical robot, or the typical query radius if that is larger,
+    works well.
+
     - threads <int>\n The number of worker threads to spawn. Some
     models can be updated in parallel (e.g. laser, ranger), and
     running 2 or more threads here may make the simulation run faster,
@@ -69,7 +121,76 @@
     worldfile. As a guideline, use one thread per core if you have
     parallel-enabled high-resolution models, e.g. a laser with
     hundreds or thousands of samples, or lots of models. Defaults to
-    1. Values of less than 1 will be forced to 1.
+    1. Values of less than 1 will be forced to 1.\n
+    If set to "auto" (with the quotes), Stage starts one worker
+    thread per CPU core, then times the first few seconds of
+    simulation with 1, 2, 4 ... of them and uses the fastest, leaving
+    the rest asleep. It does this again whenever the number of models
+    being updated changes by more than a quarter.
+
+    - thread_spin <int>\n
+    If non-zero, idle worker threads busy-wait for the next update
+    instead of going to sleep. This gives the lowest latency between
+    updates when running as fast as possible with small
+    interval_sim, but keeps every worker's core busy all the
+    time. It is ignored if there are fewer cores than worker threads
+    plus the main thread. By default workers spin briefly, adapting to
+    how long they usually wait, and then sleep.
+
+    - pipeline <int>\n
+    If non-zero, update callbacks that were added as thread-safe are
+    called one update late, in parallel with the sensing and moving
+    of the next update, against a snapshot of their model's data. So
+    the commands they issue take effect one update later, much as a
+    real robot's would, and the threads are kept busy instead of
+    waiting for the callbacks. Other callbacks are unaffected.
+
+    - deterministic <int>\n
+    If non-zero, runs with the same seed give bit-identical results
+    whatever the number of threads. Update callbacks that are not
+    thread-safe are called in model ID order rather than in the order
+    of the queues the models were updated in, a robot's thread-safe
+    callbacks are called in ID order, fiducials are reported in ID
+    order, and models are moved before the sensors are updated rather
+    than while they are. Thread-safe callbacks must still only touch
+    their own robot.
+
+    - load_balance <int>\n
+    If non-zero, and there is more than one worker thread, Stage
+    measures how much CPU time each thread-safe model takes to update
+    and periodically reassigns them to worker threads to even out
+    the load, placing the most expensive models first. Otherwise
+    models stay on the thread they started on.
+
+    - load_balance_interval <int>\n
+    The number of updates between load balancing passes. The costs
+    are measured over the last few updates before each pass.
+
+    - show_load <int>\n
+    If non-zero, print the estimated CPU time per update of each
+    worker thread after each load balancing pass, and the time taken
+    with each number of threads tried by "threads auto".
+
+    - trajectory_log <string>\n
+    If set, the name of a file to record the trajectories of the
+    models with log_trajectory set to, or of those passed to
+    World::Log(): their global poses, velocities, stall flags and
+    stored energy, each update. The file is a compact binary format,
+    described at Stg::TrajectoryLog, and is read by
+    Stg::TrajectoryReader. It is complete once the simulation quits.
+    Another world in the same process can't record to the same file:
+    a clone made with World::Clone(), or a run of stage-batch, is
+    given a file of its own, named with a suffix before the extension.
+
+    - trajectory_block <int>\n
+    The number of updates recorded into each block of the trajectory
+    log. A block is written out by a thread of its own while the next
+    one is recorded, and a time window is read by reading the blocks
+    that overlap it.
+
+    - trajectory_compress <int>\n
+    If non-zero, each block of the trajectory log is compressed with
+    zlib, by the thread that writes it.
 
     @par More examples
     The Stage source distribution contains several example world files in
@@ -95,6 +216,9 @@ using std::abs;
 #include <locale.h>
 #include <string.h> // for strdup(3)
 
+#include <sstream>
+
+#include "barrier.hh"
 #include "file_manager.hh"
 #include "option.hh"
 #include "region.hh"
@@ -102,26 +226,28 @@ using std::abs;
 #include "worldfile.hh"
 using namespace Stg;
 
-// // function objects for comparing model positions
-bool World::ltx::operator()(const Model *a, const Model *b) const
-{
-  const meters_t ax(a->GetGlobalPose().x);
-  const meters_t bx(b->GetGlobalPose().x);
-  // break ties using the pointer value to give a unique ordering
-  return (ax == bx ? a < b : ax < bx);
-}
-bool World::lty::operator()(const Model *a, const Model *b) const
-{
-  const meters_t ay(a->GetGlobalPose().y);
-  const meters_t by(b->GetGlobalPose().y);
-  // break ties using the pointer value ro give a unique ordering
-  return (ay == by ? a < b : ay < by);
-}
+// below this many models with power packs, accounting for energy in
+// parallel costs more in synchronization than it saves
+static const size_t ENERGY_PARALLEL_MIN(128);
+
+// the number of cell pairs to remember the walls between, a power of
+// two. Moving wifi models visit ever more of them, so older ones are
+// overwritten
+static const size_t WIFI_WALLS_SLOTS(1 << 20);
+
+// true in a thread while it calls thread-safe update callbacks
+static __thread bool in_threadsafe_callback(false);
 
+// // function objects for comparing model positions
 // static data members
 unsigned int World::next_id(0);
 bool World::quit_all(false);
 std::set<World *> World::world_set;
+bool World::parallel_worlds(false);
+std::vector<World *> World::worlds_order;
+std::vector<char> World::worlds_quit;
+unsigned int World::worlds_threads(0);
+Barrier *World::worlds_barrier(NULL);
 std::string World::ctrlargs;
 std::vector<std::string> World::args;
 
@@ -129,45 +255,69 @@ World::World(const std::string &,
              double ppm)
     : // private
       destroy(false),
-      dirty(true), models(), models_by_name(), models_with_fiducials(), models_with_fiducials_byx(),
-      models_with_fiducials_byy(), ppm(ppm), // raytrace resolution
+      dirty(true), models(), models_by_name(), models_with_fiducials(),
+      fiducial_grid(1.0, false), fiducial_grid_auto(true), fiducial_range_max(0),
+      fiducial_los_cache(false), los_segments(), los_segments_updates(0),
+      wifi_grid(1.0, false), wifi_range_max(0), wifi_power_max(-HUGE_VAL), wifi_walls(),
+      wifi_walls_cell(0.5), wifi_wall_cells(), wifi_wall_regions(),
+      wifi_wall_origin(), wifi_wall_size(), wifi_wall_cells_mapped(false),
+      model_grid(2.0, true), model_grid_updates(0), model_grid_queried(false), metrics(), trajectory(), clones(0), ppm(ppm), // raytrace resolution
       quit(false), show_clock(false),
       show_clock_interval(100), // 10 simulated seconds using defaults
-      sync_mutex(), threads_working(0), threads_start_cond(), threads_done_cond(), total_subs(0),
-      worker_threads(1),
+      tick_barrier(NULL), workers(), stop_workers(false), total_subs(0), worker_threads(1), max_worker_threads(1), parked(),
+      unpark(false), start_parked(), shared_work(), shared_work_count(0),
 
       // protected
       cb_list(), extent(), graphics(false), option_table(), powerpack_list(), quit_time(0),
-      ray_list(), sim_time(0), superregions(), updates(0), wf(NULL), paused(false),
+      ray_list(), sim_time(0), superregions(), updates(0), seed(0), models_made(0), wf(NULL), paused(false),
       event_queues(1), // use 1 thread by default
-      pending_update_callbacks(), active_energy(), active_velocity(),
+      pending_update_callbacks(), pending_threadsafe_callbacks(), threadsafe_cb_count(0),
+      threadsafe_callbacks_phase(false), pipeline(false), deterministic(false),
+      pipelined_callbacks(), deferred_subs(),
+      active_energy(), energy_groups(), energy_dirty(false), energy_phase(false),
+      active_velocity(),
       sim_interval(1e5), // 100 msec has proved a good default
-      update_cb_count(0)
+      update_cb_count(0), load_balance(true), load_balance_interval(1000), show_load(false),
+      measure_costs(false), queue_loads(), default_model_load(1.0), auto_threads(false),
+      tune_counts(), tune_times(), tune_trial(0), tune_start(0), tune_wall(0), tuned_models(0)
 {
   if (!Stg::InitDone()) {
     PRINT_WARN("Stg::Init() must be called before a World is created.");
     exit(-1);
   }
 
-  pthread_mutex_init(&sync_mutex, NULL);
-  pthread_cond_init(&threads_start_cond, NULL);
-  pthread_cond_init(&threads_done_cond, NULL);
-
   World::world_set.insert(this);
 
+  pthread_mutex_init(&park_mutex, NULL);
+  pthread_cond_init(&park_cond, NULL);
+  pthread_mutex_init(&model_grid_mutex, NULL);
+  pthread_mutex_init(&los_segments_mutex, NULL);
+  pthread_mutex_init(&wifi_walls_mutex, NULL);
+  pthread_mutex_init(&metrics_mutex, NULL);
+  pthread_mutex_init(&shared_work_mutex, NULL);
+  pthread_mutex_init(&deferred_subs_mutex, NULL);
+
   ground = new Model(this, NULL, "model");
   assert(ground);
   ground->SetToken("_ground_model"); // allow users to identify this unique model
   AddModelName(ground, ground->Token()); // add this name to the world's table
   ground->ClearBlocks();
   ground->SetGuiMove(false);
+  model_grid.Remove(ground); // it covers everything
 }
 
 World::~World(void)
 {
   PRINT_DEBUG1("destroying world %s", Token());
-  if (ground)
-    delete ground;
+  trajectory.Close();
+  StopWorkers();
+
+  // models remove themselves from the world as they are deleted, so
+  // they go while it is whole, not in ~Ancestor. The ground is one.
+  const std::vector<Model *> doomed(children);
+  FOR_EACH (it, doomed)
+    delete (*it);
+  ground = NULL;
   if (wf)
     delete wf;
   World::world_set.erase(this);
@@ -215,6 +365,9 @@ void World::Run()
 
 bool World::UpdateAll()
 {
+  if (parallel_worlds && world_set.size() > 1)
+    return UpdateAllParallel();
+
   bool quit(true);
 
   FOR_EACH (world_it, World::world_set) {
@@ -230,41 +383,309 @@ void *World::update_thread_entry(std::pair<World *, int> *thread_info)
   World *world(thread_info->first);
   const int thread_instance(thread_info->second);
 
-  // printf( "thread ID %d waiting for mutex\n", thread_instance );
-
-  pthread_mutex_lock(&world->sync_mutex);
+  // a worker started parked, in a forked child, has no update to meet
+  // the others at before it sleeps
+  bool waited(world->start_parked[thread_instance]);
 
   while (1) {
-    // printf( "thread ID %d waiting for start\n", thread_instance );
-    // wait until the main thread signals us
-    // puts( "worker waiting for start signal" );
+    // wait until the main thread starts the update
+    if (!waited)
+      world->tick_barrier->Wait();
+    waited = false;
 
-    pthread_cond_wait(&world->threads_start_cond, &world->sync_mutex);
-    pthread_mutex_unlock(&world->sync_mutex);
+    // if we are not in use, sleep until we are needed again, then
+    // join in with the update that is starting
+    if (world->IsParked(thread_instance))
+      world->Park(thread_instance);
+
+    if (__atomic_load_n(&world->stop_workers, __ATOMIC_ACQUIRE))
+      break;
 
-    // printf( "worker %u thread awakes for task %u\n", thread_instance, task );
     world->ConsumeQueue(thread_instance);
-    // printf( "thread %d done\n", thread_instance );
 
-    // done working, so increment the counter. If this was the last
-    // thread to finish working, signal the main thread, which is
-    // blocked waiting for this to happen
+    // call our share of the last update's thread-safe callbacks
+    if (world->pipeline)
+      world->CallThreadSafeCallbacks(thread_instance);
 
-    pthread_mutex_lock(&world->sync_mutex);
-    if (--world->threads_working == 0) {
-      // puts( "last worker signalling main thread" );
-      pthread_cond_signal(&world->threads_done_cond);
+    // done working: wait for the main thread and the other workers
+    world->tick_barrier->Wait();
+
+    // everything has been updated and moved, so call thread-safe
+    // update callbacks, then wait again
+    if (world->threadsafe_callbacks_phase) {
+      world->CallThreadSafeCallbacks(thread_instance);
+      world->tick_barrier->Wait();
+    }
+
+    // help with energy accounting once the main thread has called the
+    // other callbacks
+    if (world->energy_phase) {
+      world->tick_barrier->Wait();
+      world->AccountEnergy(thread_instance);
+      world->tick_barrier->Wait();
     }
-    // keep lock going round the loop
   }
 
+  delete thread_info;
   return NULL;
 }
 
+void World::StartWorkers(bool spin)
+{
+  // the main thread meets the workers that aren't parked at the
+  // barrier, and from the next update on, those in use
+  unsigned int awake(0);
+  start_parked.assign(max_worker_threads + 1, 0);
+  for (unsigned int t(1); t <= max_worker_threads; ++t) {
+    start_parked[t] = IsParked(t);
+    if (!start_parked[t])
+      ++awake;
+  }
+
+  tick_barrier = new Barrier(awake + 1);
+  tick_barrier->SetNextParties(worker_threads + 1);
+  tick_barrier->SetSpinForever(spin);
+  tick_barrier->SetHelper(HelpWithWork, this);
+
+  for (unsigned int t(1); t <= max_worker_threads; ++t) {
+    // normal posix pthread C function pointer
+    typedef void *(*func_ptr)(void *);
+
+    // the pair<World*,int> is the configuration for each thread. it can't be a
+    // local
+    // stack var, since it's accssed in the threads
+
+    pthread_t pt;
+    pthread_create(&pt, NULL, (func_ptr)World::update_thread_entry,
+                   new std::pair<World *, int>(this, t));
+    workers.push_back(pt);
+  }
+}
+
+void World::StopWorkers()
+{
+  if (!tick_barrier)
+    return;
+
+  // the workers in use exit as they meet us at the start of an
+  // update, and the parked ones as they wake
+  __atomic_store_n(&stop_workers, true, __ATOMIC_RELEASE);
+  tick_barrier->Wait();
+
+  pthread_mutex_lock(&park_mutex);
+  for (unsigned int t(1); t <= max_worker_threads; ++t)
+    __atomic_store_n(&parked[t], 0, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&park_cond);
+  pthread_mutex_unlock(&park_mutex);
+
+  FOR_EACH (it, workers)
+    pthread_join(*it, NULL);
+  workers.clear();
+
+  delete tick_barrier;
+  tick_barrier = NULL;
+  stop_workers = false;
+}
+
+pid_t World::Fork()
+{
+  // don't let the child write out what is buffered here
+  trajectory.Flush();
+  fflush(NULL);
+
+  const pid_t pid(fork());
+  if (pid != 0)
+    return pid;
+
+  // the log is the parent's to finish
+  trajectory.Detach();
+
+  // the workers are gone, and may have left the barrier and the
+  // parking lock in any state, so start again with new ones. The old
+  // barrier is leaked rather than deleted: it may still count the
+  // threads that were waiting at it, and where it sleeps on a mutex,
+  // one of them may have held it, which destroying would not allow.
+  workers.clear();
+  pthread_mutex_init(&park_mutex, NULL);
+  pthread_cond_init(&park_cond, NULL);
+  pthread_mutex_init(&shared_work_mutex, NULL);
+  StartWorkers(tick_barrier->GetSpinForever());
+
+  return 0;
+}
+
+void World::FiducialRange(meters_t range)
+{
+  // queries then look at no more than 3x3 cells
+  if (fiducial_grid_auto && range > fiducial_range_max) {
+    fiducial_range_max = range;
+    fiducial_grid.SetCellSize(range);
+  }
+}
+
+void World::WifiRange(meters_t range, double power)
+{
+  wifi_power_max = std::max(wifi_power_max, power);
+
+  // queries then look at no more than 3x3 cells
+  if (range > wifi_range_max) {
+    wifi_range_max = range;
+    wifi_grid.SetCellSize(range);
+  }
+}
+
+// radio signals are attenuated by the obstacles that stay put
+static bool wifi_wall_match(Model *candidate, const Model *, const void *)
+{
+  return candidate->vis.obstacle_return && dynamic_cast<ModelPosition *>(candidate->Root()) == NULL;
+}
+
+unsigned int World::WifiWalls(const point_t &a, const point_t &b)
+{
+  if (wifi_walls_cell <= 0)
+    return CountCrossings(a, b, wifi_wall_match, NULL, NULL);
+
+  point_int_t ca((int32_t)floor(a.x / wifi_walls_cell), (int32_t)floor(a.y / wifi_walls_cell));
+  point_int_t cb((int32_t)floor(b.x / wifi_walls_cell), (int32_t)floor(b.y / wifi_walls_cell));
+  if (cb < ca)
+    std::swap(ca, cb);
+
+  const size_t slot((((uint32_t)ca.x * 73856093u) ^ ((uint32_t)ca.y * 19349663u)
+                     ^ ((uint32_t)cb.x * 83492791u) ^ ((uint32_t)cb.y * 50331653u))
+                    & (WIFI_WALLS_SLOTS - 1));
+
+  pthread_mutex_lock(&wifi_walls_mutex);
+  if (!wifi_wall_cells_mapped) {
+    MapWifiWalls();
+    WallCount empty;
+    empty.walls = 0;
+    empty.valid = false;
+    wifi_walls.assign(WIFI_WALLS_SLOTS, empty);
+  }
+  const WallCount &cached(wifi_walls[slot]);
+  const bool found(cached.valid && cached.from == ca && cached.to == cb);
+  unsigned int walls(cached.walls);
+  pthread_mutex_unlock(&wifi_walls_mutex);
+
+  if (found)
+    return walls;
+
+  // another thread may count the same walls meanwhile, but it gets
+  // the same answer
+  walls = CountWifiWalls(point_t((ca.x + 0.5) * wifi_walls_cell, (ca.y + 0.5) * wifi_walls_cell),
+                         point_t((cb.x + 0.5) * wifi_walls_cell, (cb.y + 0.5) * wifi_walls_cell));
+
+  pthread_mutex_lock(&wifi_walls_mutex);
+  WallCount &count(wifi_walls[slot]);
+  count.from = ca;
+  count.to = cb;
+  count.walls = walls;
+  count.valid = true;
+  pthread_mutex_unlock(&wifi_walls_mutex);
+
+  return walls;
+}
+
+void World::MapWifiWalls()
+{
+  const unsigned int layer((updates + 1) % 2);
+  const int32_t words(REGIONSIZE / 64);
+
+  std::vector<point_int_t> walls;
+  FOR_EACH (mit, models) {
+    Model *mod(*mit);
+    if (!wifi_wall_match(mod, NULL, NULL))
+      continue;
+
+    FOR_EACH (bit, mod->blockgroup.blocks)
+      FOR_EACH (cit, bit->rendered_cells[layer])
+        walls.push_back((*cit)->region->superregion->CellPosition(*cit));
+  }
+
+  wifi_wall_cells_mapped = true;
+  if (walls.empty())
+    return;
+
+  point_int_t lo(walls[0].x >> RBITS, walls[0].y >> RBITS), hi(lo);
+  FOR_EACH (it, walls) {
+    lo.x = std::min(lo.x, it->x >> RBITS);
+    lo.y = std::min(lo.y, it->y >> RBITS);
+    hi.x = std::max(hi.x, it->x >> RBITS);
+    hi.y = std::max(hi.y, it->y >> RBITS);
+  }
+
+  wifi_wall_origin = lo;
+  wifi_wall_size = point_int_t(hi.x - lo.x + 1, hi.y - lo.y + 1);
+  wifi_wall_regions.assign((size_t)wifi_wall_size.x * wifi_wall_size.y, -1);
+
+  FOR_EACH (it, walls) {
+    int32_t &offset(wifi_wall_regions[((it->y >> RBITS) - lo.y) * wifi_wall_size.x
+                                      + (it->x >> RBITS) - lo.x]);
+    if (offset < 0) {
+      offset = wifi_wall_cells.size();
+      wifi_wall_cells.resize(offset + words, 0);
+    }
+
+    const int32_t i(GETCELL(it->x) + GETCELL(it->y) * REGIONWIDTH);
+    wifi_wall_cells[offset + i / 64] |= (uint64_t)1 << (i % 64);
+  }
+}
+
+unsigned int World::CountWifiWalls(const point_t &a, const point_t &b) const
+{
+  // the same walk as CountCrossings(), over the map of the walls
+  point_int_t c(MetersToPixels(a));
+  const point_int_t end(MetersToPixels(b));
+  const int32_t sx(sgn(end.x - c.x));
+  const int32_t sy(sgn(end.y - c.y));
+  const int32_t ax(std::abs(end.x - c.x));
+  const int32_t ay(std::abs(end.y - c.y));
+  int32_t exy(ay - ax);
+
+  const uint64_t *cells(NULL);
+  point_int_t reg_org((c.x >> RBITS) - 1, 0);
+
+  unsigned int crossings(0);
+  bool inside(false);
+
+  for (int32_t n(ax + ay); n >= 0; --n) {
+    const point_int_t org(c.x >> RBITS, c.y >> RBITS);
+    if (!(org == reg_org)) {
+      reg_org = org;
+      const int32_t rx(org.x - wifi_wall_origin.x), ry(org.y - wifi_wall_origin.y);
+      const int32_t offset(rx >= 0 && rx < wifi_wall_size.x && ry >= 0 && ry < wifi_wall_size.y ?
+                               wifi_wall_regions[ry * wifi_wall_size.x + rx] :
+                               -1);
+      cells = offset < 0 ? NULL : &wifi_wall_cells[offset];
+    }
+
+    bool hit(false);
+    if (cells) {
+      const int32_t i(GETCELL(c.x) + GETCELL(c.y) * REGIONWIDTH);
+      hit = (cells[i / 64] >> (i % 64)) & 1;
+    }
+
+    if (hit && !inside)
+      ++crossings;
+    inside = hit;
+
+    if (exy < 0) {
+      c.x += sx;
+      exy += 2 * ay;
+    } else {
+      c.y += sy;
+      exy -= 2 * ax;
+    }
+  }
+
+  return crossings;
+}
+
 void World::AddModel(Model *mod)
 {
   models.insert(mod);
   models_by_name[mod->token] = mod;
+  model_grid.Insert(mod);
 }
 
 void World::AddModelName(Model *mod, const std::string &name)
@@ -278,6 +699,9 @@ void World::RemoveModel(Model *mod)
   models_by_name.erase(mod->token);
 
   models.erase(mod);
+  model_grid.Remove(mod);
+  FiducialErase(mod);
+  trajectory.Remove(mod);
 }
 
 void World::LoadBlock(Worldfile *wf, int entity)
@@ -399,6 +823,32 @@ bool World::Load(const std::string &worldfile_path)
   return true;
 }
 
+World *World::Clone() const
+{
+  if (!wf) {
+    PRINT_ERR1("world %s can't be cloned before it is loaded", Token());
+    return NULL;
+  }
+
+  printf(" [Cloning %s]", Token());
+  fflush(stdout);
+
+  World *clone(new World(token, ppm));
+  clone->wf = new Worldfile(*wf);
+  clone->SetToken(token);
+
+  // record to a file of its own rather than truncate ours
+  const std::string trajectory_file(wf->ReadString(0, "trajectory_log", ""));
+  if (!trajectory_file.empty()) {
+    std::ostringstream suffix;
+    suffix << "-clone" << __atomic_add_fetch(&clones, 1, __ATOMIC_RELAXED);
+    clone->wf->WriteString(0, "trajectory_log", TrajectoryLog::Suffixed(trajectory_file, suffix.str()));
+  }
+
+  clone->LoadWorldPostHook();
+  return clone;
+}
+
 void World::LoadWorldPostHook()
 {
   this->quit_time = (usec_t)(million * wf->ReadFloat(0, "quit_time", this->quit_time));
@@ -412,32 +862,72 @@ void World::LoadWorldPostHook()
   // read msec instead of usec: easier for user
   this->sim_interval = 1e3 * wf->ReadFloat(0, "interval_sim", this->sim_interval / 1e3);
 
-  this->worker_threads = wf->ReadInt(0, "threads", this->worker_threads);
+  this->seed = wf->ReadInt(0, "seed", this->seed);
+
+  // a fixed size for the fiducial grid's cells, else it follows the
+  // fiducial sensors' ranges
+  const meters_t fiducial_cell(wf->ReadLength(0, "fiducial_grid", 0));
+  if (fiducial_cell > 0) {
+    fiducial_grid_auto = false;
+    fiducial_grid.SetCellSize(fiducial_cell);
+  }
+
+  fiducial_los_cache = wf->ReadInt(0, "fiducial_los_cache", fiducial_los_cache);
+
+  wifi_walls_cell = wf->ReadLength(0, "wifi_wall_cache", wifi_walls_cell);
+
+  model_grid.SetCellSize(wf->ReadLength(0, "model_grid", model_grid.GetCellSize()));
+
+  // "threads auto" starts a worker per core and tunes how many to use
+  this->auto_threads = (wf->ReadString(0, "threads", "") == "auto");
+  if (this->auto_threads)
+    this->worker_threads = std::max(1L, sysconf(_SC_NPROCESSORS_ONLN));
+  else
+    this->worker_threads = wf->ReadInt(0, "threads", this->worker_threads);
   if (this->worker_threads < 1) {
     PRINT_WARN("threads set to <1. Forcing to 1");
     this->worker_threads = 1;
   }
+  this->max_worker_threads = this->worker_threads;
 
   pending_update_callbacks.resize(worker_threads + 1);
+  queue_loads.assign(worker_threads + 1, 0.0);
+  pending_threadsafe_callbacks.assign(worker_threads + 1,
+                                      std::vector<std::vector<Model *> >(worker_threads + 1));
+  parked.assign(worker_threads + 1, 0);
+  pipelined_callbacks = pending_threadsafe_callbacks;
+
+  this->pipeline = wf->ReadInt(0, "pipeline", this->pipeline);
+  this->deterministic = wf->ReadInt(0, "deterministic", this->deterministic);
+
+  this->load_balance = wf->ReadInt(0, "load_balance", this->load_balance);
+  this->load_balance_interval =
+      std::max(wf->ReadInt(0, "load_balance_interval", this->load_balance_interval), 20);
+  this->show_load = wf->ReadInt(0, "show_load", this->show_load);
+
+  // models choose to be logged as they load
+  const std::string trajectory_file(wf->ReadString(0, "trajectory_log", ""));
+  if (!trajectory_file.empty()
+      && !trajectory.Open(trajectory_file, std::max(wf->ReadInt(0, "trajectory_block", 100), 1),
+                          wf->ReadInt(0, "trajectory_compress", 1)))
+    PRINT_ERR1("failed to open trajectory log %s", trajectory_file.c_str());
+
+  // measure model costs from the start, for the first balancing pass
+  this->measure_costs = this->load_balance && this->worker_threads > 1;
   event_queues.resize(worker_threads + 1);
 
-  // printf( "worker threads %d\n", worker_threads );
+  // event queues are keyed by update, so they need to know how long that is
+  FOR_EACH (it, event_queues)
+    it->SetTickInterval(sim_interval);
 
   // kick off the threads
-  for (unsigned int t(0); t < worker_threads; ++t) {
-    // normal posix pthread C function pointer
-    typedef void *(*func_ptr)(void *);
-
-    // the pair<World*,int> is the configuration for each thread. it can't be a
-    // local
-    // stack var, since it's accssed in the threads
-
-    pthread_t pt;
-    pthread_create(&pt, NULL, (func_ptr)World::update_thread_entry,
-                   new std::pair<World *, int>(this, t + 1));
-  }
+  StartWorkers(wf->ReadInt(0, "thread_spin", 0));
 
-  if (worker_threads > 1)
+  // all the threads meet at the start of the first update, then those
+  // the tuner doesn't need yet park
+  if (auto_threads)
+    StartTuning();
+  else if (worker_threads > 1)
     printf("[threads %u]", worker_threads);
 
   // Iterate through entitys and create objects of the appropriate type
@@ -473,10 +963,14 @@ void World::LoadWorldPostHook()
 
 void World::UnLoad()
 {
+  trajectory.Close();
+
   if (wf)
     delete wf;
 
-  FOR_EACH (it, children)
+  // each model erases itself from children as it is deleted
+  const std::vector<Model *> doomed(children);
+  FOR_EACH (it, doomed)
     delete (*it);
   children.clear();
 
@@ -490,6 +984,21 @@ void World::UnLoad()
   token = "[unloaded]";
 }
 
+void World::SetMetric(const std::string &name, double value)
+{
+  pthread_mutex_lock(&metrics_mutex);
+  metrics[name] = value;
+  pthread_mutex_unlock(&metrics_mutex);
+}
+
+std::map<std::string, double> World::GetMetrics() const
+{
+  pthread_mutex_lock(&metrics_mutex);
+  const std::map<std::string, double> copy(metrics);
+  pthread_mutex_unlock(&metrics_mutex);
+  return copy;
+}
+
 bool World::PastQuitTime()
 {
   return ((quit_time > 0) && (sim_time >= quit_time));
@@ -549,6 +1058,23 @@ void World::CallUpdateCallbacks()
   size_t threads(pending_update_callbacks.size());
   int cbcount(0);
 
+  // the queue a model is on depends on the load balancing, so in
+  // deterministic mode call them in ID order instead of queue order
+  if (deterministic) {
+    std::vector<Model *> mods;
+    for (size_t t(0); t < threads; ++t) {
+      std::queue<Model *> &q(pending_update_callbacks[t]);
+      for (; !q.empty(); q.pop())
+        mods.push_back(q.front());
+    }
+
+    std::sort(mods.begin(), mods.end(), ltid());
+    cbcount += mods.size();
+
+    FOR_EACH (it, mods)
+      (*it)->CallUpdateCallbacks(false);
+  }
+
   for (size_t t(0); t < threads; ++t) {
     std::queue<Model *> &q(pending_update_callbacks[t]);
 
@@ -560,7 +1086,7 @@ void World::CallUpdateCallbacks()
     cbcount += q.size();
 
     while (!q.empty()) {
-      q.front()->CallUpdateCallbacks();
+      q.front()->CallUpdateCallbacks(false);
       q.pop();
     }
   }
@@ -576,30 +1102,158 @@ void World::CallUpdateCallbacks()
   }
 }
 
-void World::ConsumeQueue(unsigned int queue_num)
+void World::CallThreadSafeCallbacks(unsigned int thread_num)
 {
-  std::priority_queue<Event> &queue(event_queues[queue_num]);
+  std::vector<std::vector<std::vector<Model *> > > &lists(pipeline ? pipelined_callbacks
+                                                                    : pending_threadsafe_callbacks);
+
+  // collect our models from the lists filled by each queue
+  std::vector<Model *> mine;
+  FOR_EACH (it, lists) {
+    std::vector<Model *> &list((*it)[thread_num]);
+    mine.insert(mine.end(), list.begin(), list.end());
+    list.clear();
+
+    // the main thread takes the lists of threads that have been
+    // parked since they were filled
+    if (thread_num == 0)
+      for (size_t t(worker_threads + 1); t < it->size(); ++t) {
+        mine.insert(mine.end(), (*it)[t].begin(), (*it)[t].end());
+        (*it)[t].clear();
+      }
+  }
 
-  if (queue.empty())
-    return;
+  // a robot's models may be spread over several queues, so in
+  // deterministic mode call its callbacks in ID order
+  if (deterministic)
+    std::sort(mine.begin(), mine.end(), ltid());
+
+  in_threadsafe_callback = true;
+  FOR_EACH (it, mine)
+    (*it)->CallUpdateCallbacks(true);
+  in_threadsafe_callback = false;
+}
 
-  // printf( "event queue len %d\n", (int)queue.size() );
+bool World::InThreadSafeCallback()
+{
+  return in_threadsafe_callback;
+}
 
-  // update everything on the event queue that happens at this time or earlier
-  do {
-    Event ev(queue.top());
-    if (ev.time > sim_time)
-      break;
-    queue.pop();
+void World::DeferSubscription(Model *mod, int change)
+{
+  pthread_mutex_lock(&deferred_subs_mutex);
+  deferred_subs.push_back(std::make_pair(mod, change));
+  pthread_mutex_unlock(&deferred_subs_mutex);
+}
+
+void World::ApplyDeferredSubs()
+{
+  // the threads queued them in any order, but each model's changes
+  // came from one thread, so a stable sort by ID keeps them in order
+  std::stable_sort(deferred_subs.begin(), deferred_subs.end(), ltid());
 
-    // printf( "Q%d @ %llu next event ptr %p cb %p\n", queue_num, sim_time,
-    // ev.mod, ev.cb );
-    // std::string modelType = ev.mod->GetModelType();
-    // printf( "@ %llu next event <%s %llu %s>\n",  sim_time, modelType.c_str(),
-    // ev.time, ev.mod->Token() );
+  FOR_EACH (it, deferred_subs)
+    if (it->second > 0)
+      it->first->Subscribe();
+    else
+      it->first->Unsubscribe();
 
-    ev.cb(ev.mod, ev.arg); // call the event's callback on the model
-  } while (!queue.empty());
+  deferred_subs.clear();
+}
+
+bool World::ltid::operator()(const Model *a, const Model *b) const
+{
+  return a->GetId() < b->GetId();
+}
+
+void World::GroupEnergyModels()
+{
+  // work in ID order, so the order of the groups and of the
+  // transfers between them doesn't depend on pointer values
+  std::vector<Model *> mods(active_energy.begin(), active_energy.end());
+  std::sort(mods.begin(), mods.end(), ltid());
+
+  std::map<PowerPack *, size_t> index;
+  energy_groups.clear();
+
+  FOR_EACH (it, mods) {
+    PowerPack *pp((*it)->FindPowerPack());
+    if (pp == NULL)
+      continue;
+
+    std::map<PowerPack *, size_t>::iterator git(index.find(pp));
+    if (git == index.end()) {
+      git = index.insert(std::make_pair(pp, energy_groups.size())).first;
+      energy_groups.push_back(EnergyGroup(pp));
+    }
+
+    energy_groups[git->second].mods.push_back(*it);
+  }
+
+  energy_dirty = false;
+}
+
+void World::AccountEnergy(unsigned int thread_num)
+{
+  const size_t threads(energy_phase ? worker_threads + 1 : 1);
+
+  for (size_t g(thread_num); g < energy_groups.size(); g += threads) {
+    EnergyGroup &group(energy_groups[g]);
+    group.contacts.clear();
+
+    FOR_EACH (it, group.mods) {
+      (*it)->DissipateEnergy(group.pp);
+      (*it)->AppendChargeContacts(group.contacts);
+    }
+  }
+}
+
+void World::TransferEnergy()
+{
+  // detach chargers from all the packs charged last time
+  FOR_EACH (git, energy_groups) {
+    git->pp->CommitGlobals();
+
+    FOR_EACH (it, git->mods) {
+      std::list<PowerPack *> &charging((*it)->pps_charging);
+      FOR_EACH (pit, charging)
+        (*pit)->ChargeStop();
+      charging.clear();
+    }
+  }
+
+  FOR_EACH (git, energy_groups)
+    FOR_EACH (it, git->contacts) {
+      Model *giver(it->first);
+      Model *taker(it->second);
+      PowerPack *hispp(taker->FindPowerPack());
+
+      const watts_t rate = std::min(giver->watts_give, taker->watts_take);
+      const joules_t amount = rate * giver->interval_energy * 1e-6;
+
+      // set his charging flag
+      hispp->ChargeStart();
+
+      // move some joules from me to him
+      git->pp->TransferTo(hispp, amount);
+
+      // remember who we are charging so we can detatch next time
+      giver->pps_charging.push_front(hispp);
+    }
+}
+
+void World::ConsumeQueue(unsigned int queue_num)
+{
+  // update everything on the event queue that happens at this time or earlier
+  event_queues[queue_num].Consume(sim_time);
+}
+
+// wall clock time in nsec, for timing updates
+static double wall_nsec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
 }
 
 bool World::Update()
@@ -609,8 +1263,12 @@ bool World::Update()
   // puts( "World::Update()" );
 
   // if we've run long enough, exit
-  if (PastQuitTime() || World::quit_all || this->quit)
+  if (PastQuitTime() || World::quit_all || this->quit) {
+    trajectory.Close();
     return true;
+  }
+
+  const double start_nsec(auto_threads ? wall_nsec() : 0);
 
   if (show_clock && ((this->updates % show_clock_interval) == 0)) {
     printf("\r[Stage: %s]", ClockString().c_str());
@@ -619,46 +1277,79 @@ bool World::Update()
 
   sim_time += sim_interval;
 
-  // rebuild the sets sorted by position on x,y axis
-  models_with_fiducials_byx.clear();
-  models_with_fiducials_byy.clear();
-
-  FOR_EACH (it, models_with_fiducials) {
-    models_with_fiducials_byx.insert(*it);
-    models_with_fiducials_byy.insert(*it);
-  }
-
-  // printf( "x %lu y %lu\n", models_with_fiducials_byy.size(),
-  //			models_with_fiducials_byx.size() );
+  // move the fiducials that have changed cell since the last update
+  fiducial_grid.Refresh();
+  wifi_grid.Refresh();
 
   // handle the zeroth queue synchronously in the main thread
   ConsumeQueue(0);
 
+  // pipelined callbacks will be reading poses while the workers run,
+  // so move everything first. So do deterministic runs, since sensors
+  // that read other models' poses would race with moving them.
+  const bool move_first(pipeline || deterministic);
+  if (move_first) {
+    FOR_EACH (it, active_velocity)
+      (*it)->Move();
+
+    // pipelined callbacks are about to query the model grid
+    if (__atomic_load_n(&model_grid_queried, __ATOMIC_RELAXED))
+      RefreshModelGrid();
+  }
+
   // handle all the remaining queues asynchronously in worker threads
-  pthread_mutex_lock(&sync_mutex);
-  threads_working = worker_threads;
-  // unblock the workers - they are waiting on this condition var
-  // puts( "main thread signalling workers" );
-  pthread_cond_broadcast(&threads_start_cond);
-  pthread_mutex_unlock(&sync_mutex);
-
-  // update the position of all position models based on their velocity
-  // while sensor models are running in other threads
-  FOR_EACH (it, active_velocity)
-    (*it)->Move();
-
-  pthread_mutex_lock(&sync_mutex);
-  // wait for all the last update job to complete - it will
-  // signal the worker_threads_done condition var
-  while (threads_working > 0) {
-    // puts( "main thread waiting for workers to finish" );
-    pthread_cond_wait(&threads_done_cond, &sync_mutex);
+  // - they are waiting at the barrier for us
+  tick_barrier->Wait();
+
+  // the barrier now waits for the workers brought back into use too
+  if (unpark)
+    UnparkWorkers();
+
+  // the workers last read this flag before the barrier, so it is safe
+  // to set it for this update now
+  threadsafe_callbacks_phase =
+      !pipeline && (__atomic_load_n(&threadsafe_cb_count, __ATOMIC_RELAXED) > 0);
+  energy_phase = (active_energy.size() >= ENERGY_PARALLEL_MIN);
+
+  if (pipeline) {
+    // call our share of the last update's thread-safe callbacks
+    CallThreadSafeCallbacks(0);
+  } else if (!move_first) {
+    // update the position of all position models based on their velocity
+    // while sensor models are running in other threads
+    FOR_EACH (it, active_velocity)
+      (*it)->Move();
+
+    // have the model grid ready for the callbacks, so their queries
+    // don't change it
+    if (__atomic_load_n(&model_grid_queried, __ATOMIC_RELAXED))
+      RefreshModelGrid();
   }
-  pthread_mutex_unlock(&sync_mutex);
-  // puts( "main thread awakes" );
 
-  // TODO: allow threadsafe callbacks to be called in worker
-  // threads
+  // wait for all the workers to finish their queues
+  tick_barrier->Wait();
+
+  if (pipeline) {
+    // the last update's callbacks are done with their data, so
+    // publish the data from this update and hand its thread-safe
+    // callbacks to the next one
+    FOR_EACH (qit, pending_threadsafe_callbacks)
+      FOR_EACH (tit, *qit)
+        FOR_EACH (mit, *tit)
+          (*mit)->SwapDataBuffers();
+
+    pending_threadsafe_callbacks.swap(pipelined_callbacks);
+  }
+
+  // call thread-safe update callbacks in parallel with the workers
+  if (threadsafe_callbacks_phase) {
+    CallThreadSafeCallbacks(0);
+    tick_barrier->Wait();
+  }
+
+  // start or stop the models they subscribed to or unsubscribed from
+  if (!deferred_subs.empty())
+    ApplyDeferredSubs();
 
   dirty = true; // need redraw
 
@@ -667,22 +1358,29 @@ bool World::Update()
   // world callbacks
   CallUpdateCallbacks();
 
-  FOR_EACH (it, active_energy)
-    (*it)->UpdateCharge();
+  // energy accounting, in parallel if there is enough of it
+  if (energy_dirty)
+    GroupEnergyModels();
+
+  if (energy_phase) {
+    tick_barrier->Wait();
+    AccountEnergy(0);
+    tick_barrier->Wait();
+  } else
+    AccountEnergy(0);
+
+  TransferEnergy();
+
+  trajectory.Record(sim_time);
 
   ++updates;
 
-  return false;
-}
+  BalanceLoad();
 
-unsigned int World::GetEventQueue(Model *) const
-{
-  // todo: there should be a policy that works faster than random, but
-  // random should do a good core load balancing.
+  if (auto_threads)
+    TuneThreads(wall_nsec() - start_nsec);
 
-  if (worker_threads < 1)
-    return 0;
-  return ((random() % worker_threads) + 1);
+  return false;
 }
 
 Model *World::GetModel(const std::string &name) const
@@ -962,6 +1660,277 @@ RaytraceResult World::Raytrace(const Ray &r)
   return result;
 }
 
+void World::TraceBlocks(const Pose &gpose, meters_t range, block_visit_func_t func, void *arg)
+{
+  // our position in (floating point) cell coordinates, and the cell
+  // it is in
+  const double globx(gpose.x * ppm);
+  const double globy(gpose.y * ppm);
+  int32_t cx(floor(globx));
+  int32_t cy(floor(globy));
+
+  const double cosa(cos(gpose.a));
+  const double sina(sin(gpose.a));
+  const int32_t sx(cosa < 0 ? -1 : 1);
+  const int32_t sy(sina < 0 ? -1 : 1);
+
+  // visit every cell the ray passes through (Amanatides and Woo),
+  // tracking the distance along the ray to the next cell edge in X
+  // and in Y. An axis the ray runs parallel to is never crossed.
+  const double tlimit(range * ppm);
+  const double never(2.0 * tlimit + 1.0);
+  const double dtx(fabs(cosa) > 1e-12 ? fabs(1.0 / cosa) : never);
+  const double dty(fabs(sina) > 1e-12 ? fabs(1.0 / sina) : never);
+  double tx(dtx == never ? never : (sx > 0 ? cx + 1 - globx : globx - cx) * dtx);
+  double ty(dty == never ? never : (sy > 0 ? cy + 1 - globy : globy - cy) * dty);
+  double t(0);
+
+  // the number of cell edges crossed within range, counted down as
+  // we go so the loops below test an integer, as Raytrace() does
+  int32_t n((tx > tlimit ? 0 : (int32_t)((tlimit - tx) / dtx) + 1) +
+            (ty > tlimit ? 0 : (int32_t)((tlimit - ty) / dty) + 1));
+
+  const unsigned int layer((updates + 1) % 2);
+
+  // the superregion only changes every thousand cells or so
+  point_int_t sr_origin(GETSREG(cx), GETSREG(cy));
+  SuperRegion *sr(GetSuperRegion(sr_origin));
+
+  while (n >= 0) {
+    const point_int_t origin(GETSREG(cx), GETSREG(cy));
+    if (!(origin == sr_origin)) {
+      sr_origin = origin;
+      sr = GetSuperRegion(origin);
+    }
+
+    Region *reg(sr ? sr->GetRegion(GETREG(cx), GETREG(cy)) : NULL);
+
+    if (reg && reg->count) {
+      // walk the cells of this region, moving the cell pointer along
+      // with the ray, until it leaves
+      int32_t lx(GETCELL(cx));
+      int32_t ly(GETCELL(cy));
+      Cell *c(&reg->cells[lx + ly * REGIONWIDTH]);
+
+      do {
+        FOR_EACH (it, c->blocks[layer]) {
+          Block *block(*it);
+          if ((*func)(block, &block->group->mod, block->global_z, t / ppm, arg))
+            return;
+        }
+
+        if (tx < ty) {
+          t = tx;
+          tx += dtx;
+          cx += sx;
+          lx += sx;
+          c += sx;
+        } else {
+          t = ty;
+          ty += dty;
+          cy += sy;
+          ly += sy;
+          c += sy * REGIONWIDTH;
+        }
+      } while (--n >= 0 && lx >= 0 && lx < REGIONWIDTH && ly >= 0 && ly < REGIONWIDTH);
+    } else {
+      // jump to the cell where the ray leaves this empty region: find
+      // the number of steps to its edge in each axis, and the
+      // distance along the ray at the last of them
+      const int32_t nx(sx > 0 ? REGIONWIDTH - GETCELL(cx) : GETCELL(cx) + 1);
+      const int32_t ny(sy > 0 ? REGIONWIDTH - GETCELL(cy) : GETCELL(cy) + 1);
+      const double ex(dtx == never ? never : tx + (nx - 1) * dtx);
+      const double ey(dty == never ? never : ty + (ny - 1) * dty);
+
+      // the steps in the other axis before then, which come first
+      // when they tie, as above
+      if (ex < ey) {
+        const int32_t my(dty == never || ty > ex ? 0 :
+                         std::min(ny - 1, (int32_t)((ex - ty) / dty) + 1));
+        t = ex;
+        tx += nx * dtx;
+        cx += nx * sx;
+        ty += my * dty;
+        cy += my * sy;
+        n -= nx + my;
+      } else {
+        const int32_t mx(dtx == never || tx >= ey ? 0 :
+                         std::min(nx - 1, (int32_t)ceil((ey - tx) / dtx)));
+        t = ey;
+        ty += ny * dty;
+        cy += ny * sy;
+        tx += mx * dtx;
+        cx += mx * sx;
+        n -= ny + mx;
+      }
+    }
+  }
+}
+
+unsigned int World::CountCrossings(const point_t &a, const point_t &b, const ray_test_func_t func,
+                                   const Model *finder, const void *arg)
+{
+  const unsigned int layer((updates + 1) % 2);
+
+  // walk the cells from a to b in manhattan steps, as Raytrace() does
+  point_int_t c(MetersToPixels(a));
+  const point_int_t end(MetersToPixels(b));
+  const int32_t sx(sgn(end.x - c.x));
+  const int32_t sy(sgn(end.y - c.y));
+  const int32_t ax(std::abs(end.x - c.x));
+  const int32_t ay(std::abs(end.y - c.y));
+  int32_t exy(ay - ax);
+
+  // the region we are in, looked up when we enter it
+  Region *reg(NULL);
+  point_int_t reg_org((c.x >> RBITS) - 1, 0);
+
+  unsigned int crossings(0);
+  bool inside(false);
+
+  for (int32_t n(ax + ay); n >= 0; --n) {
+    const point_int_t org(c.x >> RBITS, c.y >> RBITS);
+    if (!(org == reg_org)) {
+      reg_org = org;
+      SuperRegion *sr(GetSuperRegion(point_int_t(GETSREG(c.x), GETSREG(c.y))));
+      reg = sr ? sr->GetRegion(GETREG(c.x), GETREG(c.y)) : NULL;
+    }
+
+    bool hit(false);
+    if (reg && reg->count) {
+      const Cell &cell(reg->cells[GETCELL(c.x) + GETCELL(c.y) * REGIONWIDTH]);
+      FOR_EACH (it, cell.blocks[layer])
+        if ((*func)(&(*it)->group->mod, finder, arg)) {
+          hit = true;
+          break;
+        }
+    }
+
+    if (hit && !inside)
+      ++crossings;
+    inside = hit;
+
+    if (exy < 0) {
+      c.x += sx;
+      exy += 2 * ay;
+    } else {
+      c.y += sy;
+      exy -= 2 * ax;
+    }
+  }
+
+  return crossings;
+}
+
+int World::LosCover(Model *mod, meters_t z)
+{
+  int cover(0);
+  FOR_EACH (it, mod->blockgroup.blocks) {
+    const int in(z >= it->global_z.min && z <= it->global_z.max);
+    if (it != mod->blockgroup.blocks.begin() && in != cover)
+      return -1;
+    cover = in;
+  }
+
+  // the ray could meet a child's block first
+  FOR_EACH (it, mod->GetChildren())
+    if ((*it)->blockgroup.GetCount() || LosCover(*it, z) < 0)
+      return -1;
+
+  return cover;
+}
+
+bool World::FiducialLos(Model *finder, Model *him, const Ray &ray, RaytraceResult &result)
+{
+  Model *near(finder->Root());
+  Model *far(him->Root());
+  if (near == far)
+    return false;
+
+  // the segment only stands in for rays between points within a cell
+  // of the robots' origins
+  const double cell(1.0 / ppm);
+  const Pose np(near->GetGlobalPose());
+  const Pose fp(far->GetGlobalPose());
+  const Pose hp(him->GetGlobalPose());
+  const double ox(ray.origin.x - np.x), oy(ray.origin.y - np.y);
+  const double hx(hp.x - fp.x), hy(hp.y - fp.y);
+  if (ox * ox + oy * oy > cell * cell || hx * hx + hy * hy > cell * cell)
+    return false;
+
+  // the segment is traced from the robot with the lower ID to just
+  // past the other's footprint, whichever of them asks first, so the
+  // results don't depend on the order the sensors are updated in
+  const bool forward(near->GetId() < far->GetId());
+  Model *from(forward ? near : far);
+  Model *to(forward ? far : near);
+  const los_key_t key(std::make_pair(from->GetId(), to->GetId()), ray.origin.z);
+  std::map<los_key_t, LosSegment>::iterator it;
+
+  pthread_mutex_lock(&los_segments_mutex);
+  if (los_segments_updates != updates + 1) {
+    los_segments.clear();
+    los_segments_updates = updates + 1;
+  }
+  it = los_segments.find(key);
+  pthread_mutex_unlock(&los_segments_mutex);
+
+  // two sensors may trace the same segment at once, to the same
+  // result. The map's entries stay put while others are added.
+  if (it == los_segments.end()) {
+    const Pose &a(forward ? np : fp);
+    const Pose &b(forward ? fp : np);
+    const Geom fg(from->GetGeom());
+    const Geom tg(to->GetGeom());
+
+    LosSegment seg;
+    seg.length = hypot(b.y - a.y, b.x - a.x);
+    seg.reach = seg.length + hypot(tg.pose.x, tg.pose.y) + hypot(tg.size.x, tg.size.y) / 2.0;
+    seg.from_reach = hypot(fg.pose.x, fg.pose.y) + hypot(fg.size.x, fg.size.y) / 2.0 + cell;
+    seg.from_cover = LosCover(from, ray.origin.z);
+    seg.result = Raytrace(Ray(from, Pose(a.x, a.y, ray.origin.z, atan2(b.y - a.y, b.x - a.x)),
+                              seg.reach, ray.func, ray.arg, ray.ztest));
+
+    pthread_mutex_lock(&los_segments_mutex);
+    it = los_segments.insert(std::make_pair(key, seg)).first;
+    pthread_mutex_unlock(&los_segments_mutex);
+  }
+
+  const LosSegment &seg(it->second);
+  Model *mod(seg.result.mod);
+
+  if (forward) {
+    if (ray.range > seg.reach + cell)
+      return false;
+
+    if (mod && seg.result.range <= ray.range)
+      result = RaytraceResult(ray.origin, mod, mod->GetColor(), seg.result.range);
+    else
+      result = RaytraceResult(ray.origin, NULL, Color(), ray.range);
+    return true;
+  }
+
+  // from the far end, a third model met between the near robot's
+  // footprint and the far robot's origin stops the ray there or nearer
+  if (mod && mod->Root() != to && seg.result.range > seg.from_reach &&
+      seg.result.range <= seg.length) {
+    result = RaytraceResult(ray.origin, mod, mod->GetColor(), seg.length - seg.result.range);
+    return true;
+  }
+
+  // if the ray from the near end met nothing before the far robot,
+  // the ray from the far end passes it and meets the near robot, if
+  // its blocks are at the ray's height
+  if (mod && mod->Root() == to && seg.from_cover >= 0) {
+    const meters_t range(std::max(seg.length - seg.from_reach, 0.0));
+    result = seg.from_cover ? RaytraceResult(ray.origin, from, from->GetColor(), range) :
+                              RaytraceResult(ray.origin, NULL, Color(), ray.range);
+    return true;
+  }
+
+  return false;
+}
+
 static int _save_cb(Model *mod, void *)
 {
   mod->Save();
@@ -1119,11 +2088,14 @@ void World::RegisterOption(Option *opt)
   option_table.insert(opt);
 }
 
-void World::Log(Model *)
+void World::Log(Model *mod)
+{
+  trajectory.Add(mod);
+}
+
+void World::UnLog(Model *mod)
 {
-  // LogEntry( sim_time, mod);
-  // printf( "log entry count %u\n", (unsigned int)LogEntry::Count() );
-  // LogEntry::Print();
+  trajectory.Remove(mod);
 }
 
 bool World::Event::operator<(const Event &other) const
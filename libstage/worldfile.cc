@@ -59,11 +59,22 @@ using namespace Stg;
 ///////////////////////////////////////////////////////////////////////////
 // Default constructor
 Worldfile::Worldfile()
-    : tokens(), macros(), entities(), properties(), filename(), unit_length(1.0),
-      unit_angle(M_PI / 180.0)
+    : tokens(), macros(), entities(), properties(), cache_key(), cache_property(NULL), filename(),
+      unit_length(1.0), unit_angle(M_PI / 180.0)
 {
 }
 
+///////////////////////////////////////////////////////////////////////////
+// Copy constructor
+Worldfile::Worldfile(const Worldfile &wf)
+    : tokens(wf.tokens), macros(wf.macros), entities(wf.entities), properties(), cache_key(),
+      cache_property(NULL), filename(wf.filename), unit_length(wf.unit_length),
+      unit_angle(wf.unit_angle)
+{
+  FOR_EACH (it, wf.properties)
+    properties[it->first] = new CProperty(*it->second);
+}
+
 ///////////////////////////////////////////////////////////////////////////
 // Destructor
 Worldfile::~Worldfile()
@@ -1340,6 +1351,9 @@ void Worldfile::ClearProperties()
   FOR_EACH (it, properties)
     delete it->second;
   properties.clear();
+
+  cache_key.clear();
+  cache_property = NULL;
 }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -1353,6 +1367,9 @@ CProperty *Worldfile::AddProperty(int entity, const char *name, int line)
 
   properties[key] = property;
 
+  // it may replace the cached property
+  cache_key.clear();
+
   return property;
 }
 
@@ -1379,12 +1396,9 @@ CProperty *Worldfile::GetProperty(int entity, const char *name)
 
   // printf( "looking up key %s for entity %d name %s\n", key, entity, name );
 
-  static char cache_key[128] = { 0 };
-  static CProperty *cache_property = NULL;
-
-  if (strncmp(key, cache_key, 128) != 0) // different to last time
+  if (cache_key != key) // different to last time
   {
-    strncpy(cache_key, key, 128); // remember for next time
+    cache_key = key; // remember for next time
 
     std::map<std::string, CProperty *>::iterator it = properties.find(key);
     if (it == properties.end()) // not found
@@ -69,6 +69,11 @@ class Worldfile {
 public:
   Worldfile();
 
+  // Copy of a loaded file, with properties of its own, so that it can
+  // be loaded from again without reading and parsing the file
+public:
+  Worldfile(const Worldfile &wf);
+
 public:
   ~Worldfile();
 
@@ -431,6 +436,12 @@ private:
 private:
   std::map<std::string, CProperty *> properties;
 
+  // The last property looked up by GetProperty(), and its key. Kept
+  // per file, since worlds may be loaded and updated in parallel
+private:
+  std::string cache_key;
+  CProperty *cache_property;
+
   // Name of the file we loaded
 public:
   std::string filename;
@@ -441,6 +452,10 @@ public:
 
 public:
   double unit_angle;
+
+  // not assignable
+private:
+  Worldfile &operator=(const Worldfile &);
 };
 }
 
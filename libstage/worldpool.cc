@@ -0,0 +1,71 @@
+/*
+  worldpool.cc
+  updating several independent worlds at once, for World::UpdateAll().
+*/
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "barrier.hh"
+#include "stage.hh"
+using namespace Stg;
+
+bool World::UpdateAllParallel()
+{
+  // share the worlds out again if they have changed, which only the
+  // main thread does, while the others wait for the next round
+  if (worlds_order.size() != world_set.size()
+      || !std::equal(worlds_order.begin(), worlds_order.end(), world_set.begin())) {
+    worlds_order.assign(world_set.begin(), world_set.end());
+    worlds_quit.assign(worlds_order.size(), 0);
+
+    const unsigned int cpus(std::max(1L, sysconf(_SC_NPROCESSORS_ONLN)));
+
+    // start a thread per world, up to a thread per core, the first
+    // time through
+    if (!worlds_barrier) {
+      worlds_threads = std::min(cpus, (unsigned int)worlds_order.size());
+      worlds_barrier = new Barrier(worlds_threads);
+
+      for (unsigned int t(1); t < worlds_threads; ++t) {
+        pthread_t pt;
+        pthread_create(&pt, NULL, World::worlds_thread_entry, new unsigned int(t));
+      }
+    }
+
+    // each world gets an even share of the cores for its own workers
+    const unsigned int share(std::max(1U, cpus / (unsigned int)worlds_order.size()));
+    FOR_EACH (it, worlds_order)
+      (*it)->LimitWorkerThreads(share);
+  }
+
+  worlds_barrier->Wait();
+  UpdateWorlds(0);
+  worlds_barrier->Wait();
+
+  FOR_EACH (it, worlds_quit)
+    if (!*it)
+      return false;
+  return true;
+}
+
+void World::UpdateWorlds(unsigned int t)
+{
+  for (size_t w(t); w < worlds_order.size(); w += worlds_threads)
+    worlds_quit[w] = worlds_order[w]->Update();
+}
+
+void *World::worlds_thread_entry(void *arg)
+{
+  const unsigned int t(*static_cast<unsigned int *>(arg));
+  delete static_cast<unsigned int *>(arg);
+
+  while (1) {
+    // wait for the main thread to start a round of updates
+    worlds_barrier->Wait();
+    UpdateWorlds(t);
+    worlds_barrier->Wait();
+  }
+
+  return NULL;
+}
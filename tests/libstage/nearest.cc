@@ -0,0 +1,120 @@
+/*
+  nearest.cc
+  checks that World::NearestModels() returns every model there is,
+  nearest first, when asked for more than there are, including when a
+  model was added after the grid was last refreshed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sstream>
+
+#include "stage.hh"
+using namespace Stg;
+
+static const unsigned int BOXES(5);
+static const size_t K(3 * BOXES); // more than there will ever be
+static const unsigned int UPDATES(3);
+
+static const char *WORLD("resolution 0.05\n"
+                         "interval_sim 100\n"
+                         "model( name \"b0\" pose [0 0 0 0] size [0.5 0.5 0.5] )\n"
+                         "model( name \"b1\" pose [2 0 0 0] size [0.5 0.5 0.5] )\n"
+                         "model( name \"b2\" pose [0 3 0 0] size [0.5 0.5 0.5] )\n"
+                         "model( name \"b3\" pose [-5 -5 0 0] size [0.5 0.5 0.5] )\n"
+                         "model( name \"b4\" pose [20 20 0 0] size [0.5 0.5 0.5] )\n");
+
+static bool only_boxes(const Model *mod, const void *arg)
+{
+  return mod->GetModelType() == "model" && mod != arg;
+}
+
+// checks a query that asks for more models than there are, where
+// expect of them pass the filter
+static bool check(World *world, const char *what, size_t expect, const Model *skip)
+{
+  Model *out[K];
+  meters_t ranges[K];
+  const size_t found(world->NearestModels(point_t(0.1, 0.1), K, out, ranges, only_boxes, skip));
+
+  if (found != expect) {
+    printf("%s: found %u models, expected %u\n", what, (unsigned int)found,
+           (unsigned int)expect);
+    return false;
+  }
+
+  for (size_t i(1); i < found; ++i)
+    if (ranges[i] < ranges[i - 1]) {
+      printf("%s: model %u is nearer than the one before it\n", what, (unsigned int)i);
+      return false;
+    }
+
+  return true;
+}
+
+class Added {
+public:
+  Model *mod;
+  bool ok;
+};
+
+// adds a model, then queries before the grid can be refreshed again
+static int add_and_query(World *world, void *arg)
+{
+  Added &added(*static_cast<Added *>(arg));
+  if (added.mod)
+    return 0;
+
+  added.mod = world->CreateModel(NULL, "model");
+  added.mod->SetPose(Pose(1, 1, 0, 0));
+  added.ok = check(world, "with a model added this update", BOXES, NULL)
+             && check(world, "leaving one out, with a model added", BOXES - 1,
+                      world->GetModel("b1"));
+  return 0;
+}
+
+static bool only_b4(const Model *mod, const void *arg)
+{
+  (void)arg;
+  return mod->TokenStr() == "b4";
+}
+
+int main(int argc, char *argv[])
+{
+  Init(&argc, &argv);
+
+  std::istringstream in(WORLD);
+  World world;
+  if (!world.Load(in, "nearest.world")) {
+    puts("failed to load the world");
+    return EXIT_FAILURE;
+  }
+
+  bool ok(true);
+  ok = check(&world, "before the first update", BOXES, NULL) && ok;
+  ok = check(&world, "leaving one out", BOXES - 1, world.GetModel("b0")) && ok;
+
+  Model *out[K];
+  const size_t found(world.NearestModels(point_t(0, 0), K, out, NULL, only_b4));
+  if (found != 1 || out[0] != world.GetModel("b4")) {
+    printf("filtered to one far away: found %u models\n", (unsigned int)found);
+    ok = false;
+  }
+
+  Added added;
+  added.mod = NULL;
+  added.ok = false;
+  world.AddUpdateCallback(add_and_query, &added);
+
+  for (unsigned int u(0); u < UPDATES; ++u)
+    world.Update();
+  ok = added.ok && ok;
+
+  // from the next update on, the added model is found too
+  ok = check(&world, "an update later", BOXES + 1, NULL) && ok;
+
+  if (ok)
+    printf("found every model when asked for %u\n", (unsigned int)K);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,112 @@
+/*
+  rng.cc
+  checks Rng's Philox4x32-10 generator against the known-answer
+  vectors published with Random123, and that the bulk Uniform() and
+  Normal() give the same numbers as calling them one at a time.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "stage.hh"
+using namespace Stg;
+
+/** A counter and key, and the block Philox4x32-10 makes of them. */
+class KnownAnswer {
+public:
+  uint32_t counter[4];
+  uint32_t key[2];
+  uint32_t out[4];
+};
+
+// from kat_vectors in the Random123 distribution
+static const KnownAnswer KAT[] = {
+  { { 0x00000000, 0x00000000, 0x00000000, 0x00000000 },
+    { 0x00000000, 0x00000000 },
+    { 0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8 } },
+  { { 0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff },
+    { 0xffffffff, 0xffffffff },
+    { 0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd } },
+  { { 0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344 },
+    { 0xa4093822, 0x299f31d0 },
+    { 0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1 } },
+};
+
+static bool test_known_answers()
+{
+  bool ok(true);
+  for (size_t v(0); v < sizeof(KAT) / sizeof(KAT[0]); ++v) {
+    const KnownAnswer &kat(KAT[v]);
+
+    // the first counter word counts blocks, the others are fixed
+    Rng rng(((uint64_t)kat.key[1] << 32) | kat.key[0],
+            ((uint64_t)kat.counter[3] << 32) | kat.counter[2], kat.counter[1]);
+    rng.Seek(kat.counter[0]);
+
+    for (int i(0); i < 4; ++i) {
+      const uint32_t got(rng.Uint32());
+      if (got != kat.out[i]) {
+        printf("vector %u word %d: got %08x, expected %08x\n", (unsigned int)v, i, got,
+               kat.out[i]);
+        ok = false;
+      }
+    }
+  }
+  return ok;
+}
+
+// the bulk calls must give the same numbers as the scalar ones, in
+// any length and starting part way through a batch, and leave the
+// stream in the same place
+static bool test_bulk()
+{
+  for (size_t n(0); n <= 3 * Rng::BATCH; n += 5)
+    for (unsigned int skip(0); skip < 6; ++skip) {
+      std::vector<double> one(n + 1), bulk(n + 1);
+
+      Rng a(42, 7, 3), b(42, 7, 3);
+      for (unsigned int s(0); s < skip; ++s) {
+        a.Uint32();
+        b.Uint32();
+      }
+      for (size_t i(0); i < n; ++i)
+        one[i] = a.Uniform(-1.0, 1.0);
+      b.Uniform(&bulk[0], n, -1.0, 1.0);
+      one[n] = a.Uniform();
+      bulk[n] = b.Uniform();
+      if (one != bulk) {
+        printf("bulk Uniform() of %u after %u differs\n", (unsigned int)n, skip);
+        return false;
+      }
+
+      Rng c(42, 7, 3), d(42, 7, 3);
+      for (unsigned int s(0); s < skip; ++s) {
+        c.Uint32();
+        d.Uint32();
+      }
+      for (size_t i(0); i < n; ++i)
+        one[i] = c.Normal(2.0);
+      d.Normal(&bulk[0], n, 2.0);
+      one[n] = c.Normal(2.0);
+      bulk[n] = d.Normal(2.0);
+      if (one != bulk) {
+        printf("bulk Normal() of %u after %u differs\n", (unsigned int)n, skip);
+        return false;
+      }
+    }
+
+  return true;
+}
+
+int main()
+{
+  bool ok(true);
+  ok = test_known_answers() && ok;
+  ok = test_bulk() && ok;
+
+  if (ok)
+    printf("Philox4x32-10 matches the known answers, and the bulk calls the scalar ones\n");
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,183 @@
+/*
+  snapshot.cc
+  checks that a world restored from a snapshot repeats the same
+  updates: the poses and sensor data after each of a run of updates
+  must match those of the first run exactly, with 1 and 4 threads.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sstream>
+
+#include "stage.hh"
+using namespace Stg;
+
+static const unsigned int ROBOTS(24);
+static const unsigned int WARMUP(20);
+static const unsigned int RUN(60);
+
+class Robot {
+public:
+  ModelPosition *position;
+  ModelRanger *ranger;
+  ModelFiducial *fiducial;
+};
+
+// wanders away from obstacles, and turns towards the robots it sees
+static int control(World *, void *arg)
+{
+  std::vector<Robot> &robots(*static_cast<std::vector<Robot> *>(arg));
+
+  FOR_EACH (it, robots) {
+    const std::vector<meters_t> &ranges(it->ranger->GetSensors()[0].ranges);
+    if (ranges.empty())
+      continue;
+
+    meters_t left(0), right(0), ahead(1e9);
+    for (size_t i(0); i < ranges.size(); ++i) {
+      if (i < ranges.size() / 2)
+        right += ranges[i];
+      else
+        left += ranges[i];
+      if (i > ranges.size() / 3 && i < 2 * ranges.size() / 3)
+        ahead = std::min(ahead, ranges[i]);
+    }
+
+    radians_t turn((left - right) / (left + right + 1e-9));
+    const std::vector<ModelFiducial::Fiducial> &fids(it->fiducial->GetFiducials());
+    if (!fids.empty())
+      turn += 0.2 * fids[0].bearing;
+
+    it->position->SetSpeed(ahead < 0.6 ? 0.0 : 0.4, 0, turn);
+  }
+
+  return 0;
+}
+
+// the state the run should repeat
+static std::vector<double> sample(const std::vector<Robot> &robots)
+{
+  std::vector<double> s;
+  FOR_EACH (it, robots) {
+    const Pose pose(it->position->GetGlobalPose());
+    s.push_back(pose.x);
+    s.push_back(pose.y);
+    s.push_back(pose.a);
+    s.push_back(it->position->GetVelocity().x);
+    s.push_back(it->position->FindPowerPack()->GetStored());
+
+    const std::vector<meters_t> &ranges(it->ranger->GetSensors()[0].ranges);
+    s.insert(s.end(), ranges.begin(), ranges.end());
+
+    const std::vector<ModelFiducial::Fiducial> &fids(it->fiducial->GetFiducials());
+    s.push_back(fids.size());
+    FOR_EACH (fit, fids) {
+      s.push_back(fit->id);
+      s.push_back(fit->range);
+      s.push_back(fit->bearing);
+    }
+  }
+  return s;
+}
+
+static std::string world_text(unsigned int threads)
+{
+  std::ostringstream text;
+  text << "resolution 0.05\n"
+       << "interval_sim 100\n"
+       << "threads " << threads << "\n"
+       << "deterministic 1\n" // else the fiducials found may come in any order
+       << "define bot position (\n"
+       << "  size [0.4 0.4 0.3] drive \"diff\" kjoules 10 watts 5 fiducial_return 1\n"
+       << "  ranger( sensor( range [0 4] fov 180 samples 45 ) )\n"
+       << "  fiducial( range_max 3 )\n"
+       << ")\n"
+       << "model( name \"w0\" pose [-6 0 0 0] size [0.2 12 1] )\n"
+       << "model( name \"w1\" pose [6 0 0 0] size [0.2 12 1] )\n"
+       << "model( name \"w2\" pose [0 -6 0 0] size [12 0.2 1] )\n"
+       << "model( name \"w3\" pose [0 6 0 0] size [12 0.2 1] )\n";
+
+  for (unsigned int r(0); r < ROBOTS; ++r)
+    text << "bot( name \"r" << r << "\" pose [" << (int)(r % 6) * 2 - 5 << " "
+         << (int)(r / 6) * 2 - 3 << " 0 " << (r * 47) % 360 << "] )\n";
+
+  return text.str();
+}
+
+static bool test_threads(unsigned int threads)
+{
+  std::istringstream in(world_text(threads));
+  World world;
+  if (!world.Load(in, "snapshot.world")) {
+    printf("failed to load the world\n");
+    return false;
+  }
+
+  std::vector<Robot> robots(ROBOTS);
+  for (unsigned int r(0); r < ROBOTS; ++r) {
+    std::ostringstream name;
+    name << "r" << r;
+    Robot &robot(robots[r]);
+    robot.position = static_cast<ModelPosition *>(world.GetModel(name.str()));
+    robot.ranger = static_cast<ModelRanger *>(robot.position->GetUnusedModelOfType("ranger"));
+    robot.fiducial =
+        static_cast<ModelFiducial *>(robot.position->GetUnusedModelOfType("fiducial"));
+    if (!robot.ranger || !robot.fiducial) {
+      printf("robot %u is missing a sensor\n", r);
+      return false;
+    }
+    robot.position->Subscribe();
+    robot.ranger->Subscribe();
+    robot.fiducial->Subscribe();
+  }
+  world.AddUpdateCallback(control, &robots);
+
+  for (unsigned int u(0); u < WARMUP; ++u)
+    world.Update();
+
+  WorldSnapshot snap;
+  world.Snapshot(snap);
+
+  std::vector<std::vector<double> > first;
+  for (unsigned int u(0); u < RUN; ++u) {
+    world.Update();
+    first.push_back(sample(robots));
+  }
+
+  // the robots must have gone somewhere for the test to mean much
+  if (first.front() == first.back()) {
+    printf("%u threads: nothing changed during the run\n", threads);
+    return false;
+  }
+
+  for (int pass(0); pass < 2; ++pass) {
+    if (!world.Restore(snap)) {
+      printf("%u threads: restore failed\n", threads);
+      return false;
+    }
+
+    for (unsigned int u(0); u < RUN; ++u) {
+      world.Update();
+      if (sample(robots) != first[u]) {
+        printf("%u threads: pass %d differs from the first run after update %u\n", threads,
+               pass + 1, u + 1);
+        return false;
+      }
+    }
+  }
+
+  printf("%u threads: %u updates repeated exactly\n", threads, RUN);
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  Init(&argc, &argv);
+
+  bool ok(true);
+  ok = test_threads(1) && ok;
+  ok = test_threads(4) && ok;
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
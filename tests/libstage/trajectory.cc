@@ -0,0 +1,280 @@
+/*
+  trajectory.cc
+  checks that TrajectoryReader reads back what TrajectoryLog recorded,
+  compressed or not: through the index at the end of the file, and by
+  skipping from header to header in a file that was never closed,
+  with blocks cut short when the logged models change and when the
+  world is restored to an earlier time.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <sstream>
+
+#include "stage.hh"
+using namespace Stg;
+
+static const unsigned int ROBOTS(4);
+static const unsigned int BLOCK(7); // updates to a block
+static const unsigned int UNLOG_AT(10); // not a multiple of BLOCK
+static const unsigned int SNAPSHOT_AT(15);
+static const unsigned int RESTORE_AT(20);
+static const unsigned int UPDATES(30);
+static const usec_t INTERVAL(100000); // simulated time between updates
+static const usec_t FOREVER(std::numeric_limits<usec_t>::max());
+
+static const char *FILENAME("test_trajectory.trj");
+static const char *COPY("test_trajectory_copy.trj");
+
+static int control(World *world, void *arg)
+{
+  std::vector<ModelPosition *> &robots(*static_cast<std::vector<ModelPosition *> *>(arg));
+  for (size_t r(0); r < robots.size(); ++r)
+    robots[r]->SetSpeed(0.2 + 0.1 * r, 0, 0.3 * ((world->GetUpdateCount() / 5 + r) % 3) - 0.3);
+  return 0;
+}
+
+// the samples TrajectoryLog should have recorded in the update just done
+static void expect(World &world, const std::vector<ModelPosition *> &logged,
+                   std::vector<TrajectoryReader::Sample> &samples)
+{
+  FOR_EACH (it, logged) {
+    TrajectoryReader::Sample s;
+    s.time = world.SimTimeNow();
+    s.id = (*it)->GetId();
+    s.pose = (*it)->GetGlobalPose();
+    s.velocity = (*it)->GetVelocity();
+    s.stall = (*it)->Stalled();
+    s.energy = (*it)->FindPowerPack()->GetStored();
+    samples.push_back(s);
+  }
+}
+
+static bool same(const Pose &a, const Pose &b)
+{
+  return a.x == b.x && a.y == b.y && a.z == b.z && a.a == b.a;
+}
+
+static bool check(const char *what, const std::vector<TrajectoryReader::Sample> &got,
+                  const std::vector<TrajectoryReader::Sample> &want)
+{
+  if (got.size() != want.size()) {
+    printf("%s: read %u samples, expected %u\n", what, (unsigned int)got.size(),
+           (unsigned int)want.size());
+    return false;
+  }
+
+  for (size_t i(0); i < got.size(); ++i) {
+    const TrajectoryReader::Sample &g(got[i]), &w(want[i]);
+    if (g.time != w.time || g.id != w.id || !same(g.pose, w.pose)
+        || !same(g.velocity, w.velocity) || g.stall != w.stall || g.energy != w.energy) {
+      printf("%s: sample %u (model %u at %llu usec) differs\n", what, (unsigned int)i, w.id,
+             (unsigned long long)w.time);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// the samples between start and end inclusive, in the order recorded
+static std::vector<TrajectoryReader::Sample>
+window(const std::vector<TrajectoryReader::Sample> &samples, usec_t start, usec_t end)
+{
+  std::vector<TrajectoryReader::Sample> in;
+  FOR_EACH (it, samples)
+    if (it->time >= start && it->time <= end)
+      in.push_back(*it);
+  return in;
+}
+
+// copies the first size bytes of a file
+static bool copy_head(const char *from, const char *to, size_t size)
+{
+  std::ifstream in(from, std::ios::binary);
+  std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  if (bytes.size() < size)
+    return false;
+  std::ofstream out(to, std::ios::binary);
+  out.write(&bytes[0], size);
+  return out.good();
+}
+
+static std::string world_text(bool compress)
+{
+  std::ostringstream text;
+  text << "resolution 0.05\n"
+       << "interval_sim " << INTERVAL / 1000 << "\n"
+       << "trajectory_log \"" << FILENAME << "\"\n"
+       << "trajectory_block " << BLOCK << "\n"
+       << "trajectory_compress " << compress << "\n"
+       << "define bot position (\n"
+       << "  size [0.4 0.4 0.3] drive \"diff\" kjoules 10 watts 5 log_trajectory 1\n"
+       << ")\n"
+       << "model( name \"w0\" pose [-6 0 0 0] size [0.2 12 1] )\n"
+       << "model( name \"w1\" pose [6 0 0 0] size [0.2 12 1] )\n";
+
+  for (unsigned int r(0); r < ROBOTS; ++r)
+    text << "bot( name \"r" << r << "\" pose [" << (int)r * 2 - 3 << " 0 0 " << r * 90
+         << "] )\n";
+
+  return text.str();
+}
+
+static bool test_log(bool compress)
+{
+  const char *mode(compress ? "compressed" : "uncompressed");
+  std::vector<TrajectoryReader::Sample> want;
+  usec_t unlog_time(0), restore_time(0);
+
+  {
+    std::istringstream in(world_text(compress));
+    World world;
+    if (!world.Load(in, "trajectory.world")) {
+      printf("%s: failed to load the world\n", mode);
+      return false;
+    }
+
+    std::vector<ModelPosition *> robots;
+    for (unsigned int r(0); r < ROBOTS; ++r) {
+      std::ostringstream name;
+      name << "r" << r;
+      robots.push_back(static_cast<ModelPosition *>(world.GetModel(name.str())));
+      robots.back()->Subscribe();
+    }
+    world.AddUpdateCallback(control, &robots);
+
+    std::vector<ModelPosition *> logged(robots);
+    WorldSnapshot snap;
+
+    for (unsigned int u(1); u <= UPDATES; ++u) {
+      world.Update();
+      expect(world, logged, want);
+
+      if (u == UNLOG_AT) {
+        unlog_time = world.SimTimeNow();
+        world.UnLog(logged[1]);
+        logged.erase(logged.begin() + 1);
+      }
+
+      if (u == SNAPSHOT_AT)
+        world.Snapshot(snap);
+
+      if (u == RESTORE_AT) {
+        restore_time = world.SimTimeNow();
+        world.Restore(snap);
+      }
+    }
+  } // closes the log
+
+  // the whole file, through the index
+  TrajectoryReader reader;
+  if (!reader.Open(FILENAME)) {
+    printf("%s: failed to open %s\n", mode, FILENAME);
+    return false;
+  }
+
+  std::vector<TrajectoryReader::Sample> got;
+  if (!reader.Read(0, FOREVER, got) || !check(mode, got, want))
+    return false;
+
+  // the blocks end early at the change of models and at the rewind
+  const std::vector<TrajectoryLog::BlockIndex> index(reader.GetIndex());
+  bool cut_unlog(false), cut_rewind(false);
+  FOR_EACH (it, index) {
+    cut_unlog = cut_unlog || it->last == unlog_time;
+    cut_rewind = cut_rewind || it->last == restore_time;
+  }
+  if (!cut_unlog || !cut_rewind) {
+    printf("%s: no block ends at the %s\n", mode, cut_unlog ? "rewind" : "change of models");
+    return false;
+  }
+
+  // the blocks are stored as asked
+  FILE *file(fopen(FILENAME, "rb"));
+  FOR_EACH (it, index) {
+    TrajectoryLog::BlockHeader header;
+    if (fseeko(file, it->offset, SEEK_SET) != 0 || fread(&header, sizeof(header), 1, file) != 1
+        || (header.size != header.raw_size) != compress) {
+      printf("%s: the block at %llu is stored wrongly\n", mode, (unsigned long long)it->offset);
+      fclose(file);
+      return false;
+    }
+  }
+
+  TrajectoryLog::IndexTrailer trailer;
+  fseeko(file, -(off_t)sizeof(trailer), SEEK_END);
+  const bool has_trailer(fread(&trailer, sizeof(trailer), 1, file) == 1
+                         && trailer.count == index.size());
+  fclose(file);
+  if (!has_trailer) {
+    printf("%s: the trailer doesn't match the index\n", mode);
+    return false;
+  }
+
+  // a window across the change of models and the rewind, read from
+  // the blocks that overlap it
+  const usec_t start((UNLOG_AT - 2) * INTERVAL), end((RESTORE_AT - 2) * INTERVAL);
+  got.clear();
+  if (!reader.Read(start, end, got) || !check(mode, got, window(want, start, end)))
+    return false;
+  reader.Close();
+
+  // a file that was never closed has no index, so its blocks are found
+  // from their headers
+  if (!copy_head(FILENAME, COPY, trailer.offset) || !reader.Open(COPY)) {
+    printf("%s: failed to open the copy without an index\n", mode);
+    return false;
+  }
+  if (reader.GetIndex().size() != index.size()) {
+    printf("%s: found %u blocks without the index, expected %u\n", mode,
+           (unsigned int)reader.GetIndex().size(), (unsigned int)index.size());
+    return false;
+  }
+  got.clear();
+  if (!reader.Read(0, FOREVER, got) || !check(mode, got, want))
+    return false;
+
+  // and a block the writer was part way through is left out
+  const TrajectoryLog::BlockIndex &last(index.back());
+  if (!copy_head(FILENAME, COPY, last.offset + sizeof(TrajectoryLog::BlockHeader) + 10)
+      || !reader.Open(COPY)) {
+    printf("%s: failed to open the copy cut short\n", mode);
+    return false;
+  }
+  size_t whole(want.size());
+  while (whole > 0 && want[whole - 1].time >= last.first)
+    --whole;
+  const std::vector<TrajectoryReader::Sample> written(want.begin(), want.begin() + whole);
+  if (reader.GetIndex().size() != index.size() - 1) {
+    printf("%s: found %u blocks in the copy cut short, expected %u\n", mode,
+           (unsigned int)reader.GetIndex().size(), (unsigned int)index.size() - 1);
+    return false;
+  }
+  got.clear();
+  if (!reader.Read(0, FOREVER, got) || !check(mode, got, written))
+    return false;
+  reader.Close();
+
+  printf("%s: %u samples in %u blocks read back\n", mode, (unsigned int)want.size(),
+         (unsigned int)index.size());
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  Init(&argc, &argv);
+
+  bool ok(true);
+  ok = test_log(false) && ok;
+  ok = test_log(true) && ok;
+
+  remove(FILENAME);
+  remove(COPY);
+
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}